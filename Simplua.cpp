@@ -25,9 +25,46 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <deque>
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <exception>
 
 #include <cassert>
 #include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <limits>
+
+//MSVC and MinGW provide stat too, which ScriptReloader polls on platforms without inotify
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+//the vector math kernels are compiled for SSE2 and AVX2 and chosen when they are first used
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SIMPLUA_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 namespace lua
 {
@@ -39,20 +76,44 @@ namespace lua
                 throw std::overflow_error("lua::internal::growStack");
         }
 
+        //The address of this is the key, in the metatable of a watched table, of the table
+        //that actually holds its contents (see State::watch).
+        static const char watchedContentsKey = 0;
+
+        //Returns the index of the table that holds the contents of the table at index.
+        //For a watched table this pushes its contents table, which the caller must pop;
+        //for any other table it just returns index.
+        static int contentsIndex(lua_State* state, int index)
+        {
+            index = lua_absindex(state, index);
+            growStack(state, 2);
+            if(!lua_getmetatable(state, index))
+                return index;
+            lua_rawgetp(state, -1, &watchedContentsKey);
+            if(lua_istable(state, -1))
+            {
+                lua_remove(state, -2);
+                return lua_gettop(state);
+            }
+            lua_pop(state, 2);
+            return index;
+        }
+
     } //namespace internal
 
     void Object::copy(const Object& rhs)
     {
         if(rhs.type == NUMBER)
             num = rhs.num;
-        else if(rhs.type == STRING)
-            str = rhs.str;
-        else if(rhs.type == TABLE)
-            table = rhs.table;
         else if(rhs.type == FUNCTION)
             func = rhs.func;
         else if(rhs.type == BOOLEAN)
             boolean = rhs.boolean;
+        else if(rhs.type == WEAK_TABLE)
+            weakTable = rhs.weakTable;
+        //only the reference counts change; the old payloads are released
+        str = rhs.type == STRING ? rhs.str : nullptr;
+        table = rhs.type == TABLE ? rhs.table : nullptr;
         type = rhs.type;
     }
 
@@ -61,14 +122,16 @@ namespace lua
         type = rhs.type;
         if(type == NUMBER)
             num = rhs.num;
-        else if(type == STRING)
-            str = std::move(rhs.str);
-        else if(type == TABLE)
-            table = std::move(rhs.table);
         else if(type == FUNCTION)
             func = rhs.func;
         else if(type == BOOLEAN)
             boolean = rhs.boolean;
+        else if(type == WEAK_TABLE)
+            weakTable = rhs.weakTable;
+        str = std::move(rhs.str);
+        table = std::move(rhs.table);
+        rhs.str = nullptr;
+        rhs.table = nullptr;
         rhs.type = NIL;
     }
 
@@ -131,7 +194,15 @@ namespace lua
     {
         Object o;
         o.type = STRING;
-        o.str = s;
+        o.str = std::make_shared<LuaString>(s);
+        return o;
+    }
+
+    Object Object::makeString(LuaString&& s)
+    {
+        Object o;
+        o.type = STRING;
+        o.str = std::make_shared<LuaString>(std::move(s));
         return o;
     }
 
@@ -139,7 +210,15 @@ namespace lua
     {
         Object o;
         o.type = TABLE;
-        o.table = m;
+        o.table = std::make_shared<LuaTable>(m);
+        return o;
+    }
+
+    Object Object::makeTable(LuaTable&& m)
+    {
+        Object o;
+        o.type = TABLE;
+        o.table = std::make_shared<LuaTable>(std::move(m));
         return o;
     }
 
@@ -159,6 +238,14 @@ namespace lua
         return o;
     }
 
+    Object Object::makeWeakTable(LuaWeakTable t)
+    {
+        Object o;
+        o.type = WEAK_TABLE;
+        o.weakTable = t;
+        return o;
+    }
+
     LuaNumber Object::getNumber() const
     {
         if(type != NUMBER)
@@ -177,14 +264,14 @@ namespace lua
     {
         if(type != STRING)
             throw type_mismatch("Object::getString");
-        return str;
+        return *str;
     }
 
     const LuaTable& Object::getTable() const
     {
         if(type != TABLE)
             throw type_mismatch("Object::getTable");
-        return table;
+        return *table;
     }
 
     LuaFunction Object::getFunction() const
@@ -201,6 +288,23 @@ namespace lua
         return boolean;
     }
 
+    LuaWeakTable Object::getWeakTable() const
+    {
+        if(type != WEAK_TABLE)
+            throw type_mismatch("Object::getWeakTable");
+        return weakTable;
+    }
+
+    LuaTable& Object::editTable()
+    {
+        if(type != TABLE)
+            throw type_mismatch("Object::editTable");
+        if(table.use_count() > 1)
+            table = std::make_shared<LuaTable>(*table);
+        //tables are always created non-const, so this is safe
+        return const_cast<LuaTable&>(*table);
+    }
+
     bool Object::isNil() const
     {
         return type == NIL;
@@ -236,6 +340,11 @@ namespace lua
         return type == BOOLEAN;
     }
 
+    bool Object::isWeakTable() const
+    {
+        return type == WEAK_TABLE;
+    }
+
     int Object::getType() const
     {
         return type;
@@ -250,13 +359,15 @@ namespace lua
             if(type == NUMBER)
                 return num < rhs.num;
             if(type == STRING)
-                return str < rhs.str;
+                return *str < *rhs.str;
             if(type == TABLE)
                 return table < rhs.table;
             if(type == FUNCTION)
                 return func < rhs.func;
             if(type == BOOLEAN)
                 return !boolean && rhs.boolean;
+            if(type == WEAK_TABLE)
+                return weakTable < rhs.weakTable;
             //if(type == USERDATA)
             //    return (intptr_t)userdata < (intptr_t)rhs.userdata;
             //if(type == THREAD)
@@ -290,13 +401,15 @@ namespace lua
             if(type == NUMBER)
                 return num == rhs.num;
             if(type == STRING)
-                return str == rhs.str;
+                return str == rhs.str || *str == *rhs.str;
             if(type == TABLE)
                 return table == rhs.table;
             if(type == FUNCTION)
                 return func == rhs.func;
             if(type == BOOLEAN)
                 return boolean == rhs.boolean;
+            if(type == WEAK_TABLE)
+                return weakTable == rhs.weakTable;
             //if(type == USERDATA)
             //    return (intptr_t)userdata == (intptr_t)rhs.userdata;
             //if(type == THREAD)
@@ -310,10 +423,42 @@ namespace lua
     {
         return !(*this == rhs);
     }
+}//namespace lua
+
+namespace std
+{
+    std::size_t hash<lua::Object>::operator()(const lua::Object& obj) const
+    {
+        switch(obj.getType())
+        {
+            case lua::Object::NUMBER:
+            {
+                //0 and -0 are equal, so they must hash the same
+                lua::LuaNumber d = obj.getNumber();
+                return d == 0 ? 0 : hash<lua::LuaNumber>()(d);
+            }
+            case lua::Object::STRING:
+                return hash<lua::LuaString>()(obj.getString());
+            case lua::Object::TABLE:
+                return hash<const lua::LuaTable*>()(&obj.getTable());
+            case lua::Object::FUNCTION:
+                return hash<std::uintptr_t>()(reinterpret_cast<std::uintptr_t>(obj.getFunction()));
+            case lua::Object::BOOLEAN:
+                return obj.getBoolean() ? 1 : 2;
+            case lua::Object::WEAK_TABLE:
+                return hash<const lua::LuaTable*>()(obj.getWeakTable());
+        }
+        return 0;
+    }
+}//namespace std
+
+namespace lua
+{
 
     namespace internal
     {
-        void printObject(std::ostream& out, const Object& obj, int indents = 2)
+        //visiting holds the weak tables currently being printed, so cycles are printed only once
+        void printObject(std::ostream& out, const Object& obj, std::set<LuaWeakTable>& visiting, int indents = 2)
         {
             if(obj.isNil())
                 out << "nil";
@@ -323,21 +468,30 @@ namespace lua
                 out << obj.getString();
             if(obj.isBoolean())
                 out << (obj.getBoolean() == false ? "false" : "true");
-            if(obj.isTable())
+            if(obj.isTable() || obj.isWeakTable())
             {
+                if(obj.isWeakTable() && !visiting.insert(obj.getWeakTable()).second)
+                {
+                    out << "Table: (cycle)\n";
+                    return;
+                }
+
                 out << "Table:\n";
                 std::string indent(indents, ' ');
                 if(indents == 0)
                     indent = "";
-                for(auto& p : obj.getTable())
+                for(auto& p : obj.isTable() ? obj.getTable() : *obj.getWeakTable())
                 {
                     out << indent;
-                    printObject(out, p.first, indents + 2);
+                    printObject(out, p.first, visiting, indents + 2);
                     out << ": ";
-                    printObject(out, p.second, indents + 2);
-                    if(!p.second.isTable())
+                    printObject(out, p.second, visiting, indents + 2);
+                    if(!p.second.isTable() && !p.second.isWeakTable())
                         out << '\n';
                 }
+
+                if(obj.isWeakTable())
+                    visiting.erase(obj.getWeakTable());
             }
             if(obj.isFunction())
                 out << "Function";
@@ -346,12 +500,42 @@ namespace lua
 
     std::ostream& operator <<(std::ostream& out, const Object& obj)
     {
-        internal::printObject(out, obj);
+        std::set <LuaWeakTable> visiting;
+        internal::printObject(out, obj, visiting);
 
         return out;
     }
 
 
+    ObjectGraph::ObjectGraph()
+    {}
+
+    ObjectGraph::ObjectGraph(ObjectGraph&& rhs)
+    : tables(std::move(rhs.tables)), root(std::move(rhs.root))
+    {}
+
+    ObjectGraph& ObjectGraph::operator =(ObjectGraph&& rhs)
+    {
+        if(this == &rhs)
+            return *this;
+
+        tables = std::move(rhs.tables);
+        root = std::move(rhs.root);
+
+        return *this;
+    }
+
+    const Object& ObjectGraph::getRoot() const
+    {
+        return root;
+    }
+
+    std::size_t ObjectGraph::getTableCount() const
+    {
+        return tables.size();
+    }
+
+
 
 
     void State::cleanup()
@@ -490,6 +674,28 @@ namespace lua
     }
 
 
+    namespace internal
+    {
+        //The address of this is the registry key of the table mapping each file passed to loadFile to its mode.
+        static const char loadedFilesKey = 0;
+
+        static void rememberFile(lua_State* state, const std::string& filename, const std::string& mode)
+        {
+            growStack(state, 3);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &loadedFilesKey);
+            if(lua_isnil(state, -1))
+            {
+                lua_pop(state, 1);
+                lua_newtable(state);
+                lua_pushvalue(state, -1);
+                lua_rawsetp(state, LUA_REGISTRYINDEX, &loadedFilesKey);
+            }
+            lua_pushlstring(state, mode.data(), mode.size());
+            lua_setfield(state, -2, filename.c_str());
+            lua_pop(state, 1);
+        }
+    }//namespace internal
+
     void State::loadFile(const std::string& filename, const std::string& mode)
     {
         if(!state)
@@ -497,6 +703,7 @@ namespace lua
         if(mode != "b" && mode != "t" && mode != "bt" && mode != "tb")
             throw std::invalid_argument("lua::State::loadFile");
 
+        internal::TraceSpan span("loadFile", filename);
         TrivialLuaReaderData trivialData;
         trivialData.first = true;
         trivialData.text = readFile(filename);
@@ -510,6 +717,176 @@ namespace lua
             ss << "lua::State::loadFile - " << err;
             throw compile_error(ss.str());
         }
+
+        internal::rememberFile(state, filename, mode);
+    }
+
+    namespace internal
+    {
+        //Helper functions for the chunk cache used by State::loadString
+
+        static int stringWriter(lua_State*, const void* p, std::size_t size, void* buffer)
+        {
+            try
+            {
+                static_cast<std::string*>(buffer)->append(static_cast<const char*>(p), size);
+                return 0;
+            }
+            catch(...)
+            {
+                return 1;
+            }
+        }
+
+        //Appends the bytecode of the function on top of the stack to out.
+        static void dumpFunction(lua_State* state, std::string& out)
+        {
+            if(lua_dump(state, stringWriter, &out) != 0)
+                throw std::runtime_error("lua::dumpFunction");
+        }
+
+        //The address of this is the registry key of the State's ChunkCache userdata, if the cache is enabled.
+        static const char chunkCacheKey = 0;
+
+        //The bytecode of each chunk is kept, and a hit loads it again, so every load returns a new function as compiling
+        //would.  Entries are found by script and mode, and evicted least recently used first.
+        struct ChunkCache
+        {
+            struct Entry
+            {
+                std::string bytecode;
+                std::list <const std::string*>::iterator position;
+            };
+
+            std::size_t capacity;
+            std::size_t hits;
+            std::size_t misses;
+            //keys are the mode, a null character, and the script
+            std::unordered_map <std::string, Entry> entries;
+            //most recently used first
+            std::list <const std::string*> order;
+
+            explicit ChunkCache(std::size_t capacity)
+            : capacity(capacity), hits(0), misses(0)
+            {}
+
+            void evict(std::unordered_map <std::string, Entry>::iterator it)
+            {
+                order.erase(it->second.position);
+                entries.erase(it);
+            }
+
+            void shrink()
+            {
+                while(entries.size() > capacity)
+                    evict(entries.find(*order.back()));
+            }
+
+            //Loads the cached chunk and returns true on a hit.
+            bool push(lua_State* state, const std::string& key)
+            {
+                auto it = entries.find(key);
+                if(it == entries.end())
+                {
+                    ++misses;
+                    return false;
+                }
+
+                const std::string& bytecode = it->second.bytecode;
+                if(luaL_loadbufferx(state, bytecode.data(), bytecode.size(), "string_script", "b") != LUA_OK)
+                {
+                    //only possible when out of memory; compiling again reports the error
+                    lua_pop(state, 1);
+                    evict(it);
+                    ++misses;
+                    return false;
+                }
+
+                order.splice(order.begin(), order, it->second.position);
+                ++hits;
+                return true;
+            }
+
+            //Caches the function on top of the stack, leaving it there.
+            void insert(lua_State* state, std::string&& key)
+            {
+                if(capacity == 0)
+                    return;
+                Entry entry;
+                dumpFunction(state, entry.bytecode);
+                auto it = entries.emplace(std::move(key), std::move(entry)).first;
+                order.push_front(&it->first);
+                it->second.position = order.begin();
+                shrink();
+            }
+        };
+
+        static int collectChunkCache(lua_State* state)
+        {
+            static_cast<ChunkCache*>(lua_touserdata(state, 1))->~ChunkCache();
+            return 0;
+        }
+
+        static ChunkCache* getChunkCache(lua_State* state)
+        {
+            growStack(state, 1);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &chunkCacheKey);
+            ChunkCache* cache = static_cast<ChunkCache*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            return cache;
+        }
+    }//namespace internal
+
+    void State::setChunkCacheCapacity(std::size_t capacity)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::setChunkCacheCapacity");
+
+        internal::ChunkCache* cache = internal::getChunkCache(state);
+        if(capacity == 0)
+        {
+            if(cache)
+            {
+                cache->capacity = 0;
+                cache->shrink();
+                lua_pushnil(state);
+                lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::chunkCacheKey);
+            }
+        }
+        else if(cache)
+        {
+            cache->capacity = capacity;
+            cache->shrink();
+        }
+        else
+        {
+            internal::growStack(state, 3);
+            void* memory = lua_newuserdata(state, sizeof(internal::ChunkCache));
+            new (memory) internal::ChunkCache(capacity);
+            if(luaL_newmetatable(state, "Simplua.ChunkCache"))
+            {
+                lua_pushcfunction(state, internal::collectChunkCache);
+                lua_setfield(state, -2, "__gc");
+            }
+            lua_setmetatable(state, -2);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::chunkCacheKey);
+        }
+    }
+
+    ChunkCacheStats State::getChunkCacheStats() const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::getChunkCacheStats");
+
+        ChunkCacheStats stats = ChunkCacheStats();
+        if(internal::ChunkCache* cache = internal::getChunkCache(state))
+        {
+            stats.hits = cache->hits;
+            stats.misses = cache->misses;
+            stats.size = cache->entries.size();
+            stats.capacity = cache->capacity;
+        }
+        return stats;
     }
 
     void State::loadString(const std::string& script, const std::string& mode)
@@ -519,6 +896,18 @@ namespace lua
         if(mode != "b" && mode != "t" && mode != "bt" && mode != "tb")
             throw std::invalid_argument("lua::State::loadFile");
 
+        internal::ChunkCache* cache = internal::getChunkCache(state);
+        std::string key;
+        if(cache)
+        {
+            key.reserve(mode.size() + 1 + script.size());
+            key += mode;
+            key += '\0';
+            key += script;
+            if(cache->push(state, key))
+                return;
+        }
+
         TrivialLuaReaderData trivialData;
         trivialData.first = true;
         trivialData.text = script;
@@ -532,19 +921,20 @@ namespace lua
             ss << "lua::State::loadFile - " << err;
             throw compile_error(ss.str());
         }
+
+        if(cache)
+            cache->insert(state, std::move(key));
     }
 
-    void State::setVariable(const std::string& name, const Object& object)//, const std::vector<std::string>& path)
+    //Pops the value on top of the stack and assigns it to the variable with the specified name (which may contain periods).
+    static void assignVariable(lua_State* state, const std::string& name)
     {
-        if(!state)
-            throw uninitialized_resource("lua::State::makeGlobal");
-
-        int index = lua_gettop(state);
-
+        int value = lua_gettop(state);
 
         std::size_t period = name.find('.');
         if(period != std::string::npos)
         {
+            internal::growStack(state, 2);
             lua_getglobal(state, name.substr(0, period).c_str());
 
             std::size_t last = period + 1;
@@ -556,28 +946,36 @@ namespace lua
                 period = name.find('.', period + 1);
             }
 
-            internal::growStack(state, 2);
-            lua_pushstring(state, name.substr(last).c_str());
-            internal::pushVar(state, object);
-            lua_settable(state, -3);
+            lua_pushvalue(state, value);
+            lua_setfield(state, -2, name.substr(last).c_str());
         }
         else
         {
-            internal::pushVar(state, object);
+            lua_pushvalue(state, value);
             lua_setglobal(state, name.c_str());
         }
 
-        lua_settop(state, index);
+        lua_settop(state, value - 1);
     }
 
-    Object State::getVariable(const std::string& name, const std::set<Object>& ignoreList) const
+    void State::setVariable(const std::string& name, const Object& object)//, const std::vector<std::string>& path)
     {
         if(!state)
             throw uninitialized_resource("lua::State::makeGlobal");
 
+        internal::pushVar(state, object);
+        assignVariable(state, name);
+    }
+
+    //Pushes the variable with the specified name (which may contain periods) onto the stack.
+    static void pushVariable(lua_State* state, const std::string& name)
+    {
+        int index = lua_gettop(state);
+
         std::size_t period = name.find('.');
         if(period != std::string::npos)
         {
+            internal::growStack(state, 2);
             lua_getglobal(state, name.substr(0, period).c_str());
 
             std::size_t last = period + 1;
@@ -590,83 +988,7300 @@ namespace lua
             }
 
             lua_getfield(state, -1, name.substr(last).c_str());
+            lua_replace(state, index + 1);
+            lua_settop(state, index + 1);
         }
         else
+        {
+            internal::growStack(state, 1);
             lua_getglobal(state, name.c_str());
+        }
+    }
+
+    Object State::getVariable(const std::string& name, const ObjectSet& ignoreList) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::makeGlobal");
+
+        pushVariable(state, name);
 
         Object o = internal::GetStackVar<Object>()(state, -1, ignoreList);
         lua_pop(state, 1);
         return o;
     }
 
+    ObjectGraph State::getVariableGraph(const std::string& name, const ObjectSet& ignoreList) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::getVariableGraph");
 
+        pushVariable(state, name);
 
-    std::vector <Object> State::run()
+        ObjectGraph graph = internal::GetStackVar<ObjectGraph>()(state, -1, ignoreList);
+        lua_pop(state, 1);
+        return graph;
+    }
+
+    namespace internal
     {
-        if(!state)
-            throw uninitialized_resource("lua::State::run");
+        //Helper functions for the cache of pure functions
 
-        if(lua_pcall(state, 0, LUA_MULTRET, 0) != LUA_OK)
+        //The address of this is the registry key of the State's PureCache userdata, created when first used.
+        static const char pureCacheKey = 0;
+
+        //Arguments are converted anew for every call, so unlike Objects, tables are compared by contents,
+        //including tables used as keys.  This is also used to compare replayed results with recorded ones.
+        static bool sameContents(const Object& a, const Object& b)
         {
-            Object err = internal::GetStackVar<Object>()(state, -1);
-            lua_pop(state, 1);
-            std::stringstream ss;
-            ss << "lua::State::run - " << err;
-            throw script_error(ss.str());
+            if(!a.isTable() || !b.isTable())
+                return a == b;
+
+            const LuaTable& x = a.getTable();
+            const LuaTable& y = b.getTable();
+            if(x.size() != y.size())
+                return false;
+            std::vector <const LuaTable::value_type*> tableKeys;
+            for(const auto& pair : x)
+            {
+                if(pair.first.isTable())
+                {
+                    tableKeys.push_back(&pair);
+                    continue;
+                }
+                auto it = y.find(pair.first);
+                if(it == y.end() || !sameContents(pair.second, it->second))
+                    return false;
+            }
+            if(tableKeys.empty())
+                return true;
+
+            //table keys cannot be looked up, so each is matched with an unused equal pair of y;
+            //equality is transitive, so taking the first match never rules out a complete matching
+            std::vector <const LuaTable::value_type*> candidates;
+            for(const auto& pair : y)
+                if(pair.first.isTable())
+                    candidates.push_back(&pair);
+            for(const LuaTable::value_type* pair : tableKeys)
+            {
+                auto it = candidates.begin();
+                while(it != candidates.end() && !(sameContents(pair->first, (*it)->first) && sameContents(pair->second, (*it)->second)))
+                    ++it;
+                if(it == candidates.end())
+                    return false;
+                candidates.erase(it);
+            }
+            return true;
         }
 
-        unsigned retsLeft = lua_gettop(state);
-        std::vector <Object> ret(retsLeft);
-        while(retsLeft > 0)
+        static std::size_t hashPureArg(const Object& arg)
         {
-            Object obj = internal::GetStackVar<Object>()(state, -1);
-            lua_pop(state, 1);
-            ret[--retsLeft] = std::move(obj);
+            if(!arg.isTable())
+                return std::hash<Object>()(arg);
+
+            //the pairs are combined in a way that does not depend on their order
+            std::size_t h = arg.getTable().size();
+            for(const auto& pair : arg.getTable())
+                h += hashPureArg(pair.first) * 31 + hashPureArg(pair.second);
+            return h;
         }
 
-        return ret;
-    }
+        struct PureCall
+        {
+            void* function;
+            std::vector <Object> args;
 
+            bool operator ==(const PureCall& rhs) const
+            {
+                if(function != rhs.function || args.size() != rhs.args.size())
+                    return false;
+                for(std::size_t i = 0; i < args.size(); ++i)
+                    if(!sameContents(args[i], rhs.args[i]))
+                        return false;
+                return true;
+            }
+        };
 
-    static LuaFunction getLibraryFunction(Lib lib)
-    {
-        switch(lib)
+        struct HashPureCall
         {
-            case Lib::base:
-                return luaopen_base;
-            case Lib::coroutine:
-                return luaopen_coroutine;
-            case Lib::table:
-                return luaopen_table;
-            case Lib::io:
-                return luaopen_io;
-            case Lib::os:
-                return luaopen_os;
-            case Lib::string:
-                return luaopen_string;
-            case Lib::bit32:
-                return luaopen_bit32;
-            case Lib::math:
-                return luaopen_math;
-            case Lib::debug:
-                return luaopen_debug;
-            case Lib::package:
-                return luaopen_package;
-            default:
-                return luaopen_base; //this should not happen
-        }
-    }
+            std::size_t operator()(const PureCall& call) const
+            {
+                std::size_t h = std::hash<void*>()(call.function);
+                for(const Object& arg : call.args)
+                    h ^= hashPureArg(arg) + 0x9e3779b9 + (h << 6) + (h >> 2);
+                return h;
+            }
+        };
 
-    static std::string getLibraryName(Lib lib)
-    {
-        switch(lib)
+        static const std::size_t defaultPureCacheCapacity = 1024;
+
+        //Results are found by function and arguments, and evicted least recently used first.
+        struct PureCache
         {
-            case Lib::base:
-                return "base";
-            case Lib::coroutine:
-                return "coroutine";
-            case Lib::table:
-                return "table";
+            struct Entry
+            {
+                std::vector <Object> results;
+                std::list <const PureCall*>::iterator position;
+            };
+
+            std::size_t capacity;
+            std::size_t hits;
+            std::size_t misses;
+            std::unordered_map <PureCall, Entry, HashPureCall> entries;
+            //most recently used first
+            std::list <const PureCall*> order;
+
+            explicit PureCache(std::size_t capacity)
+            : capacity(capacity), hits(0), misses(0)
+            {}
+
+            void shrink()
+            {
+                while(entries.size() > capacity)
+                {
+                    entries.erase(entries.find(*order.back()));
+                    order.pop_back();
+                }
+            }
+        };
+
+        static int collectPureCache(lua_State* state)
+        {
+            static_cast<PureCache*>(lua_touserdata(state, 1))->~PureCache();
+            return 0;
+        }
+
+        //Returns the State's PureCache, or nullptr if it has not been created yet.
+        static PureCache* findPureCache(lua_State* state)
+        {
+            growStack(state, 1);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &pureCacheKey);
+            PureCache* cache = static_cast<PureCache*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            return cache;
+        }
+
+        static PureCache* getPureCache(lua_State* state)
+        {
+            PureCache* cache = findPureCache(state);
+            if(cache)
+                return cache;
+
+            growStack(state, 3);
+
+            void* memory = lua_newuserdata(state, sizeof(PureCache));
+            cache = new (memory) PureCache(defaultPureCacheCapacity);
+            if(luaL_newmetatable(state, "Simplua.PureCache"))
+            {
+                lua_pushcfunction(state, collectPureCache);
+                lua_setfield(state, -2, "__gc");
+            }
+            lua_setmetatable(state, -2);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &pureCacheKey);
+            return cache;
+        }
+
+        int pushPureResults(lua_State* state, void* function, std::vector <Object>& args)
+        {
+            PureCache* cache = getPureCache(state);
+            //the key borrows args for the lookup
+            PureCall call;
+            call.function = function;
+            call.args.swap(args);
+            auto it = cache->entries.find(call);
+            call.args.swap(args);
+            if(it == cache->entries.end())
+            {
+                ++cache->misses;
+                return -1;
+            }
+
+            ++cache->hits;
+            cache->order.splice(cache->order.begin(), cache->order, it->second.position);
+            const std::vector <Object>& results = it->second.results;
+            growStack(state, static_cast<int>(results.size()));
+            for(const Object& result : results)
+                pushVar(state, result);
+            return static_cast<int>(results.size());
+        }
+
+        void storePureResults(lua_State* state, void* function, std::vector <Object>&& args, const std::vector <Object>& results)
+        {
+            PureCache* cache = getPureCache(state);
+            if(cache->capacity == 0)
+                return;
+
+            PureCall call;
+            call.function = function;
+            call.args = std::move(args);
+            auto inserted = cache->entries.emplace(std::move(call), PureCache::Entry());
+            if(!inserted.second)
+                return;
+            inserted.first->second.results = results;
+            cache->order.push_front(&inserted.first->first);
+            inserted.first->second.position = cache->order.begin();
+            cache->shrink();
+        }
+    }//namespace internal
+
+    void State::setPureCacheCapacity(std::size_t capacity)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::setPureCacheCapacity");
+
+        internal::PureCache* cache = internal::getPureCache(state);
+        cache->capacity = capacity;
+        cache->shrink();
+    }
+
+    PureCacheStats State::getPureCacheStats() const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::getPureCacheStats");
+
+        //a State that never used its cache reports an empty one rather than creating it
+        internal::PureCache* cache = internal::findPureCache(state);
+        PureCacheStats stats;
+        stats.hits = cache ? cache->hits : 0;
+        stats.misses = cache ? cache->misses : 0;
+        stats.size = cache ? cache->entries.size() : 0;
+        stats.capacity = cache ? cache->capacity : internal::defaultPureCacheCapacity;
+        return stats;
+    }
+
+    void State::clearPureCache()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::clearPureCache");
+
+        internal::PureCache* cache = internal::getPureCache(state);
+        cache->entries.clear();
+        cache->order.clear();
+    }
+
+    void State::clearPureCache(const std::string& name)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::clearPureCache");
+
+        //registered functions keep the native function pointer in their first upvalue
+        pushVariable(state, name);
+        void* function = nullptr;
+        if(lua_iscfunction(state, -1) && lua_getupvalue(state, -1, 1))
+        {
+            function = lua_touserdata(state, -1);
+            lua_pop(state, 1);
+        }
+        lua_pop(state, 1);
+        if(!function)
+            throw type_mismatch("lua::State::clearPureCache");
+
+        internal::PureCache* cache = internal::getPureCache(state);
+        for(auto it = cache->order.begin(); it != cache->order.end();)
+        {
+            if((*it)->function == function)
+            {
+                cache->entries.erase(cache->entries.find(**it));
+                it = cache->order.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    void State::registerLibrary(const std::string& name, const std::vector <LibraryFunction>& functions)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::registerLibrary");
+
+        pushVariable(state, name);
+        if(!lua_istable(state, -1))
+        {
+            lua_pop(state, 1);
+            lua_createtable(state, 0, static_cast<int>(std::min<std::size_t>(functions.size(), INT_MAX)));
+            lua_pushvalue(state, -1);
+            assignVariable(state, name);
+        }
+
+        internal::growStack(state, 2);
+        for(const LibraryFunction& f : functions)
+        {
+            lua_pushlightuserdata(state, f.function);
+            lua_pushcclosure(state, f.registered, 1);
+            lua_setfield(state, -2, f.name.c_str());
+        }
+        lua_pop(state, 1);
+    }
+
+
+
+    namespace internal
+    {
+        //Helper functions for the JSON and binary functions
+
+        //The deepest nesting of tables the writers accept.  They recurse once per level, so this bounds
+        //the native stack they use.
+        static const int maxWriteDepth = 1000;
+
+        //Returns the length of the table if it is a sequence 1..n with n > 0, or 0 otherwise.
+        static std::size_t sequenceLength(lua_State* state, int index)
+        {
+            std::size_t length = lua_rawlen(state, index);
+            if(length == 0)
+                return 0;
+
+            std::size_t count = 0;
+            lua_pushnil(state);
+            while(lua_next(state, index) != 0)
+            {
+                lua_pop(state, 1);
+                if(lua_type(state, -1) != LUA_TNUMBER)
+                {
+                    lua_pop(state, 1);
+                    return 0;
+                }
+                LuaNumber key = lua_tonumber(state, -1);
+                if(key < 1 || key > length || key != static_cast<LuaNumber>(static_cast<std::size_t>(key)))
+                {
+                    lua_pop(state, 1);
+                    return 0;
+                }
+                ++count;
+            }
+
+            return count == length ? length : 0;
+        }
+
+
+        //Appends s as a quoted JSON string.
+        static void appendJsonString(std::string& buffer, const char* s, std::size_t size)
+        {
+            static const char* hex = "0123456789abcdef";
+
+            buffer += '"';
+            std::size_t run = 0;
+            for(std::size_t i = 0; i < size; ++i)
+            {
+                unsigned char c = s[i];
+                if(c >= 0x20 && c != '"' && c != '\\')
+                    continue;
+
+                buffer.append(s + run, i - run);
+                run = i + 1;
+                switch(c)
+                {
+                    case '"': buffer += "\\\""; break;
+                    case '\\': buffer += "\\\\"; break;
+                    case '\n': buffer += "\\n"; break;
+                    case '\r': buffer += "\\r"; break;
+                    case '\t': buffer += "\\t"; break;
+                    case '\b': buffer += "\\b"; break;
+                    case '\f': buffer += "\\f"; break;
+                    default:
+                        buffer += "\\u00";
+                        buffer += hex[c >> 4];
+                        buffer += hex[c & 0xf];
+                }
+            }
+            buffer.append(s + run, size - run);
+            buffer += '"';
+        }
+
+        //Buffers output and, when writing to a stream, flushes it in large blocks.
+        class JsonWriter
+        {
+            std::string& buffer;
+            std::ostream* out;
+            std::unordered_set <const void*> open;
+            int depth;
+
+            static const std::size_t flushSize = 1 << 16;
+
+            void flushIfFull()
+            {
+                if(out && buffer.size() >= flushSize)
+                    flush();
+            }
+
+            void writeNumber(LuaNumber d)
+            {
+                if(d != d || d - d != 0)
+                    throw type_mismatch("lua::State::writeJson - NaN and infinity cannot be written");
+
+                //use the shortest representation that survives a round trip
+                char text[32];
+                int length = std::snprintf(text, sizeof(text), "%.15g", d);
+                if(std::strtod(text, nullptr) != d)
+                    length = std::snprintf(text, sizeof(text), "%.17g", d);
+                buffer.append(text, length);
+            }
+
+            void writeString(const char* s, std::size_t size)
+            {
+                appendJsonString(buffer, s, size);
+            }
+
+            void writeTable(lua_State* state, int index)
+            {
+                const void* identity = lua_topointer(state, index);
+                if(!open.insert(identity).second)
+                    throw table_too_deep("lua::State::writeJson - table contains itself");
+                if(++depth > maxWriteDepth)
+                    throw table_too_deep("lua::State::writeJson - tables are nested too deeply");
+
+                growStack(state, 3);
+                int top = lua_gettop(state);
+                index = contentsIndex(state, index);
+                std::size_t length = sequenceLength(state, index);
+                if(length > 0)
+                {
+                    buffer += '[';
+                    for(std::size_t i = 1; i <= length; ++i)
+                    {
+                        if(i > 1)
+                            buffer += ',';
+                        lua_rawgeti(state, index, i);
+                        write(state, lua_gettop(state));
+                        lua_pop(state, 1);
+                    }
+                    buffer += ']';
+                }
+                else
+                {
+                    buffer += '{';
+                    bool first = true;
+                    lua_pushnil(state);
+                    while(lua_next(state, index) != 0)
+                    {
+                        if(!first)
+                            buffer += ',';
+                        first = false;
+
+                        int key = lua_gettop(state) - 1;
+                        if(lua_type(state, key) == LUA_TSTRING)
+                        {
+                            std::size_t size;
+                            const char* s = lua_tolstring(state, key, &size);
+                            writeString(s, size);
+                        }
+                        else if(lua_type(state, key) == LUA_TNUMBER)
+                        {
+                            buffer += '"';
+                            writeNumber(lua_tonumber(state, key));
+                            buffer += '"';
+                        }
+                        else
+                            throw type_mismatch("lua::State::writeJson - keys must be strings or numbers");
+
+                        buffer += ':';
+                        write(state, key + 1);
+                        lua_pop(state, 1);
+                    }
+                    buffer += '}';
+                }
+
+                lua_settop(state, top);
+                open.erase(identity);
+                --depth;
+            }
+
+        public:
+            JsonWriter(std::string& buffer, std::ostream* out)
+            : buffer(buffer), out(out), depth(0)
+            {}
+
+            void write(lua_State* state, int index)
+            {
+                switch(lua_type(state, index))
+                {
+                    case LUA_TNIL:
+                        buffer += "null";
+                        break;
+                    case LUA_TBOOLEAN:
+                        buffer += lua_toboolean(state, index) ? "true" : "false";
+                        break;
+                    case LUA_TNUMBER:
+                        writeNumber(lua_tonumber(state, index));
+                        break;
+                    case LUA_TSTRING:
+                    {
+                        std::size_t size;
+                        const char* s = lua_tolstring(state, index, &size);
+                        writeString(s, size);
+                        break;
+                    }
+                    case LUA_TTABLE:
+                        writeTable(state, index);
+                        break;
+                    default:
+                        throw type_mismatch("lua::State::writeJson - value cannot be written as JSON");
+                }
+
+                flushIfFull();
+            }
+
+            void flush()
+            {
+                if(!out)
+                    return;
+                out->write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        };
+
+        //Writes the value at index as JSON, restoring the stack even if an exception is thrown.
+        static void writeJsonValue(lua_State* state, int index, std::string& buffer, std::ostream* out)
+        {
+            index = lua_absindex(state, index);
+            int top = lua_gettop(state);
+
+            JsonWriter writer(buffer, out);
+            try
+            {
+                writer.write(state, index);
+            }
+            catch(...)
+            {
+                lua_settop(state, top);
+                throw;
+            }
+            writer.flush();
+        }
+
+        //A non-recursive JSON parser.  The Builder receives events for every value, so the same
+        //parser can be used both to validate and size the input and to build the Lua values.
+        class JsonParser
+        {
+            const char* begin;
+            const char* p;
+            const char* end;
+            std::string scratch;
+
+            void fail(const char* what) const
+            {
+                std::stringstream ss;
+                ss << "lua::State::readJson - " << what << " at offset " << (p - begin);
+                throw parse_error(ss.str());
+            }
+
+            void skipSpace()
+            {
+                while(p != end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+                    ++p;
+            }
+
+            char peek()
+            {
+                if(p == end)
+                    fail("unexpected end of input");
+                return *p;
+            }
+
+            unsigned readHex4()
+            {
+                if(end - p < 4)
+                    fail("unexpected end of input");
+                unsigned value = 0;
+                for(int i = 0; i < 4; ++i, ++p)
+                {
+                    char c = *p;
+                    value <<= 4;
+                    if(c >= '0' && c <= '9')
+                        value |= c - '0';
+                    else if(c >= 'a' && c <= 'f')
+                        value |= c - 'a' + 10;
+                    else if(c >= 'A' && c <= 'F')
+                        value |= c - 'A' + 10;
+                    else
+                        fail("invalid unicode escape");
+                }
+                return value;
+            }
+
+            void appendUtf8(unsigned code)
+            {
+                if(code < 0x80)
+                    scratch += static_cast<char>(code);
+                else if(code < 0x800)
+                {
+                    scratch += static_cast<char>(0xc0 | (code >> 6));
+                    scratch += static_cast<char>(0x80 | (code & 0x3f));
+                }
+                else if(code < 0x10000)
+                {
+                    scratch += static_cast<char>(0xe0 | (code >> 12));
+                    scratch += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                    scratch += static_cast<char>(0x80 | (code & 0x3f));
+                }
+                else
+                {
+                    scratch += static_cast<char>(0xf0 | (code >> 18));
+                    scratch += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+                    scratch += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                    scratch += static_cast<char>(0x80 | (code & 0x3f));
+                }
+            }
+
+            //Reads the string starting at p.  Strings without escapes are returned in place;
+            //others are decoded into scratch.
+            void readString(const char*& data, std::size_t& size)
+            {
+                ++p;
+                const char* start = p;
+                while(p != end && *p != '"' && *p != '\\')
+                {
+                    if(static_cast<unsigned char>(*p) < 0x20)
+                        fail("control character in string");
+                    ++p;
+                }
+                if(peek() == '"')
+                {
+                    data = start;
+                    size = p - start;
+                    ++p;
+                    return;
+                }
+
+                scratch.assign(start, p);
+                for(;;)
+                {
+                    char c = peek();
+                    ++p;
+                    if(c == '"')
+                        break;
+                    if(static_cast<unsigned char>(c) < 0x20)
+                        fail("control character in string");
+                    if(c != '\\')
+                    {
+                        scratch += c;
+                        continue;
+                    }
+
+                    c = peek();
+                    ++p;
+                    switch(c)
+                    {
+                        case '"': scratch += '"'; break;
+                        case '\\': scratch += '\\'; break;
+                        case '/': scratch += '/'; break;
+                        case 'b': scratch += '\b'; break;
+                        case 'f': scratch += '\f'; break;
+                        case 'n': scratch += '\n'; break;
+                        case 'r': scratch += '\r'; break;
+                        case 't': scratch += '\t'; break;
+                        case 'u':
+                        {
+                            unsigned code = readHex4();
+                            if(code >= 0xd800 && code < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+                            {
+                                p += 2;
+                                unsigned low = readHex4();
+                                if(low < 0xdc00 || low >= 0xe000)
+                                    fail("invalid surrogate pair");
+                                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                            }
+                            appendUtf8(code);
+                            break;
+                        }
+                        default:
+                            fail("invalid escape");
+                    }
+                }
+
+                data = scratch.data();
+                size = scratch.size();
+            }
+
+            LuaNumber readNumber()
+            {
+                const char* start = p;
+                if(*p == '-')
+                    ++p;
+                if(peek() == '0')
+                    ++p;
+                else if(*p >= '1' && *p <= '9')
+                    while(p != end && *p >= '0' && *p <= '9')
+                        ++p;
+                else
+                    fail("invalid number");
+
+                bool integer = true;
+                if(p != end && *p == '.')
+                {
+                    integer = false;
+                    ++p;
+                    if(peek() < '0' || *p > '9')
+                        fail("invalid number");
+                    while(p != end && *p >= '0' && *p <= '9')
+                        ++p;
+                }
+                if(p != end && (*p == 'e' || *p == 'E'))
+                {
+                    integer = false;
+                    ++p;
+                    if(peek() == '+' || *p == '-')
+                        ++p;
+                    if(peek() < '0' || *p > '9')
+                        fail("invalid number");
+                    while(p != end && *p >= '0' && *p <= '9')
+                        ++p;
+                }
+
+                //short integers are exact in a double, so they do not need strtod
+                std::size_t length = p - start;
+                if(integer && length < 16)
+                {
+                    const char* digit = start + (*start == '-');
+                    LuaNumber d = 0;
+                    for(; digit != p; ++digit)
+                        d = d * 10 + (*digit - '0');
+                    return *start == '-' ? -d : d;
+                }
+
+                //the input is not necessarily null terminated
+                std::string number(start, length);
+                return std::strtod(number.c_str(), nullptr);
+            }
+
+            void expectLiteral(const char* literal, std::size_t size)
+            {
+                if(static_cast<std::size_t>(end - p) < size || std::string(p, size) != literal)
+                    fail("invalid literal");
+                p += size;
+            }
+
+        public:
+            JsonParser(const char* json, std::size_t size)
+            : begin(json), p(json), end(json + size)
+            {}
+
+            template <typename Builder>
+            void parse(Builder& builder)
+            {
+                enum Expect { VALUE, KEY, AFTER_VALUE };
+
+                std::vector <char> containers;
+                Expect expect = VALUE;
+                const char* data;
+                std::size_t size;
+
+                skipSpace();
+                for(;;)
+                {
+                    if(expect == VALUE)
+                    {
+                        expect = AFTER_VALUE;
+                        switch(peek())
+                        {
+                            case '{':
+                                ++p;
+                                builder.beginObject();
+                                containers.push_back('{');
+                                skipSpace();
+                                if(peek() == '}')
+                                {
+                                    ++p;
+                                    containers.pop_back();
+                                    builder.endContainer();
+                                }
+                                else
+                                    expect = KEY;
+                                break;
+                            case '[':
+                                ++p;
+                                builder.beginArray();
+                                containers.push_back('[');
+                                skipSpace();
+                                if(peek() == ']')
+                                {
+                                    ++p;
+                                    containers.pop_back();
+                                    builder.endContainer();
+                                }
+                                else
+                                    expect = VALUE;
+                                break;
+                            case '"':
+                                readString(data, size);
+                                builder.string(data, size);
+                                break;
+                            case 't':
+                                expectLiteral("true", 4);
+                                builder.boolean(true);
+                                break;
+                            case 'f':
+                                expectLiteral("false", 5);
+                                builder.boolean(false);
+                                break;
+                            case 'n':
+                                expectLiteral("null", 4);
+                                builder.null();
+                                break;
+                            default:
+                                if(*p != '-' && (*p < '0' || *p > '9'))
+                                    fail("unexpected character");
+                                builder.number(readNumber());
+                        }
+                    }
+                    else if(expect == KEY)
+                    {
+                        if(peek() != '"')
+                            fail("expected a string key");
+                        readString(data, size);
+                        builder.key(data, size);
+                        skipSpace();
+                        if(peek() != ':')
+                            fail("expected ':'");
+                        ++p;
+                        expect = VALUE;
+                    }
+                    else
+                    {
+                        skipSpace();
+                        if(containers.empty())
+                        {
+                            if(p != end)
+                                fail("unexpected trailing characters");
+                            return;
+                        }
+
+                        char c = peek();
+                        ++p;
+                        if(c == ',')
+                            expect = containers.back() == '[' ? VALUE : KEY;
+                        else if(c == (containers.back() == '[' ? ']' : '}'))
+                        {
+                            containers.pop_back();
+                            builder.endContainer();
+                        }
+                        else
+                            fail("expected ',' or the end of a container");
+                    }
+                    skipSpace();
+                }
+            }
+        };
+
+        //First pass: counts the array elements or object keys of every container, in the order the containers begin.
+        struct JsonCounter
+        {
+            std::vector <int> counts;
+            //for each open container, its index in counts and whether it is an array
+            std::vector <std::pair<std::size_t, bool>> open;
+
+            void element()
+            {
+                if(!open.empty() && open.back().second)
+                    ++counts[open.back().first];
+            }
+
+            void begin(bool array)
+            {
+                element();
+                open.push_back(std::make_pair(counts.size(), array));
+                counts.push_back(0);
+            }
+
+            void beginArray() { begin(true); }
+            void beginObject() { begin(false); }
+            void endContainer() { open.pop_back(); }
+            void key(const char*, std::size_t) { ++counts[open.back().first]; }
+            void string(const char*, std::size_t) { element(); }
+            void number(LuaNumber) { element(); }
+            void boolean(bool) { element(); }
+            void null() { element(); }
+        };
+
+        //Second pass: builds the Lua values, creating each table with its final size.
+        struct JsonBuilder
+        {
+            lua_State* state;
+            const std::vector <int>& counts;
+            std::size_t nextCount;
+            //for each open container, the next array index, or 0 for objects
+            std::vector <int> indices;
+
+            JsonBuilder(lua_State* state, const std::vector <int>& counts)
+            : state(state), counts(counts), nextCount(0)
+            {}
+
+            //stores the value on top of the stack in the innermost open container
+            void attach()
+            {
+                if(indices.empty())
+                    return;
+                if(indices.back() > 0)
+                    lua_rawseti(state, -2, indices.back()++);
+                else
+                    lua_rawset(state, -3);
+            }
+
+            void beginArray()
+            {
+                growStack(state, 3);
+                lua_createtable(state, counts[nextCount++], 0);
+                indices.push_back(1);
+            }
+
+            void beginObject()
+            {
+                growStack(state, 3);
+                lua_createtable(state, 0, counts[nextCount++]);
+                indices.push_back(0);
+            }
+
+            void endContainer()
+            {
+                indices.pop_back();
+                attach();
+            }
+
+            void key(const char* data, std::size_t size)
+            {
+                lua_pushlstring(state, data, size);
+            }
+
+            void string(const char* data, std::size_t size)
+            {
+                lua_pushlstring(state, data, size);
+                attach();
+            }
+
+            void number(LuaNumber d)
+            {
+                lua_pushnumber(state, d);
+                attach();
+            }
+
+            void boolean(bool b)
+            {
+                lua_pushboolean(state, b);
+                attach();
+            }
+
+            void null()
+            {
+                lua_pushnil(state);
+                attach();
+            }
+        };
+
+        static std::vector <int> countJsonElements(const char* json, std::size_t size)
+        {
+            JsonCounter counter;
+            JsonParser(json, size).parse(counter);
+            return std::move(counter.counts);
+        }
+    }//namespace internal
+
+    void State::writeJson(const std::string& name, std::ostream& out) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::writeJson");
+
+        pushVariable(state, name);
+        std::string buffer;
+        try
+        {
+            internal::writeJsonValue(state, -1, buffer, &out);
+        }
+        catch(...)
+        {
+            lua_pop(state, 1);
+            throw;
+        }
+        lua_pop(state, 1);
+    }
+
+    void State::writeJson(const std::string& name, std::string& buffer) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::writeJson");
+
+        pushVariable(state, name);
+        try
+        {
+            internal::writeJsonValue(state, -1, buffer, nullptr);
+        }
+        catch(...)
+        {
+            lua_pop(state, 1);
+            throw;
+        }
+        lua_pop(state, 1);
+    }
+
+    void State::writeStackJson(int index, std::ostream& out) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::writeStackJson");
+
+        std::string buffer;
+        internal::writeJsonValue(state, index, buffer, &out);
+    }
+
+    void State::writeStackJson(int index, std::string& buffer) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::writeStackJson");
+
+        internal::writeJsonValue(state, index, buffer, nullptr);
+    }
+
+    void State::pushJson(const char* json, std::size_t size)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::pushJson");
+
+        //the first pass validates the input, so only running out of memory can interrupt the second
+        std::vector <int> counts = internal::countJsonElements(json, size);
+
+        int top = lua_gettop(state);
+        try
+        {
+            internal::JsonBuilder builder(state, counts);
+            internal::JsonParser(json, size).parse(builder);
+        }
+        catch(...)
+        {
+            lua_settop(state, top);
+            throw;
+        }
+    }
+
+    void State::readJson(const std::string& name, const std::string& json)
+    {
+        pushJson(json.data(), json.size());
+        assignVariable(state, name);
+    }
+
+
+
+    namespace internal
+    {
+        //Helper functions for Lua data files
+
+        //the deepest nesting of table constructors, as in the Lua compiler
+        static const int maxDataDepth = 200;
+
+        //A recursive descent parser for the subset of Lua that only assigns constants.  Like JsonParser,
+        //it reports every value to a Builder, which either builds Objects or pushes onto a Lua stack:
+        //values are pushed; setField pops a key and a value into the table below them, appendItem pops a value
+        //into the table below it, and assign pops a value into the variable with the path of keys.
+        class DataParser
+        {
+            const char* begin;
+            const char* p;
+            const char* end;
+            std::string scratch;
+
+            void fail(const char* what) const
+            {
+                std::stringstream ss;
+                ss << "lua::parseData - " << what << " on line " << (std::count(begin, p, '\n') + 1);
+                throw parse_error(ss.str());
+            }
+
+            static bool isNameStart(char c)
+            {
+                return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+            }
+
+            static bool isDigit(char c)
+            {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool isHexDigit(char c)
+            {
+                return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+            }
+
+            static int hexValue(char c)
+            {
+                return isDigit(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+            }
+
+            //Returns the level of the long bracket starting at p ([[ is 0, [=[ is 1...), or -1 if there is none.
+            int longBracketLevel() const
+            {
+                const char* q = p + 1;
+                while(q != end && *q == '=')
+                    ++q;
+                return q != end && *q == '[' ? static_cast<int>(q - p - 1) : -1;
+            }
+
+            //Reads a long string or comment whose opening bracket is at p.
+            void readLongString(int level, const char*& data, std::size_t& size)
+            {
+                p += level + 2;
+                //a newline right after the opening bracket is skipped
+                if(p != end && (*p == '\r' || *p == '\n'))
+                {
+                    char first = *p++;
+                    if(p != end && (*p == '\r' || *p == '\n') && *p != first)
+                        ++p;
+                }
+
+                const char* start = p;
+                bool newlines = false;
+                for(;;)
+                {
+                    if(p == end)
+                        fail("unfinished long string or comment");
+                    if(*p == ']')
+                    {
+                        const char* q = p + 1;
+                        while(q != end && *q == '=')
+                            ++q;
+                        if(q != end && *q == ']' && q - p - 1 == level)
+                            break;
+                    }
+                    else if(*p == '\r')
+                        newlines = true;
+                    ++p;
+                }
+
+                data = start;
+                size = p - start;
+                p += level + 2;
+                if(!newlines)
+                    return;
+
+                //every kind of newline becomes \n
+                scratch.clear();
+                for(const char* c = start; c != start + size; ++c)
+                {
+                    if(*c != '\r' && *c != '\n')
+                    {
+                        scratch += *c;
+                        continue;
+                    }
+                    scratch += '\n';
+                    if(c + 1 != start + size && (c[1] == '\r' || c[1] == '\n') && c[1] != *c)
+                        ++c;
+                }
+                data = scratch.data();
+                size = scratch.size();
+            }
+
+            void skipSpace()
+            {
+                for(;;)
+                {
+                    while(p != end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == '\f' || *p == '\v'))
+                        ++p;
+                    if(end - p < 2 || p[0] != '-' || p[1] != '-')
+                        return;
+
+                    p += 2;
+                    int level = p != end && *p == '[' ? longBracketLevel() : -1;
+                    if(level >= 0)
+                    {
+                        const char* data;
+                        std::size_t size;
+                        readLongString(level, data, size);
+                    }
+                    else
+                        while(p != end && *p != '\n' && *p != '\r')
+                            ++p;
+                }
+            }
+
+            char peek()
+            {
+                if(p == end)
+                    fail("unexpected end of input");
+                return *p;
+            }
+
+            void expect(char c, const char* what)
+            {
+                skipSpace();
+                if(p == end || *p != c)
+                    fail(what);
+                ++p;
+            }
+
+            void readName(const char*& data, std::size_t& size)
+            {
+                const char* start = p;
+                while(p != end && (isNameStart(*p) || isDigit(*p)))
+                    ++p;
+                data = start;
+                size = p - start;
+            }
+
+            static bool isWord(const char* data, std::size_t size, const char* word)
+            {
+                return std::strlen(word) == size && std::memcmp(data, word, size) == 0;
+            }
+
+            static bool isReserved(const char* data, std::size_t size)
+            {
+                static const char* const reserved[] =
+                {
+                    "and", "break", "do", "else", "elseif", "end", "false", "for", "function", "goto", "if", "in",
+                    "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"
+                };
+                if(size < 2 || size > 8 || *data < 'a' || *data > 'w')
+                    return false;
+                for(const char* word : reserved)
+                    if(isWord(data, size, word))
+                        return true;
+                return false;
+            }
+
+            //Reads a quoted string starting at p.  Strings without escapes are returned in place;
+            //others are decoded into scratch.
+            void readQuotedString(const char*& data, std::size_t& size)
+            {
+                char quote = *p++;
+                const char* start = p;
+                while(p != end && *p != quote && *p != '\\' && *p != '\n' && *p != '\r')
+                    ++p;
+                if(peek() == quote)
+                {
+                    data = start;
+                    size = p - start;
+                    ++p;
+                    return;
+                }
+
+                scratch.assign(start, p);
+                for(;;)
+                {
+                    char c = peek();
+                    if(c == quote)
+                    {
+                        ++p;
+                        break;
+                    }
+                    if(c == '\n' || c == '\r')
+                        fail("unfinished string");
+                    ++p;
+                    if(c != '\\')
+                    {
+                        scratch += c;
+                        continue;
+                    }
+
+                    c = peek();
+                    ++p;
+                    switch(c)
+                    {
+                        case 'a': scratch += '\a'; break;
+                        case 'b': scratch += '\b'; break;
+                        case 'f': scratch += '\f'; break;
+                        case 'n': scratch += '\n'; break;
+                        case 'r': scratch += '\r'; break;
+                        case 't': scratch += '\t'; break;
+                        case 'v': scratch += '\v'; break;
+                        case '\\': scratch += '\\'; break;
+                        case '"': scratch += '"'; break;
+                        case '\'': scratch += '\''; break;
+                        case '\n':
+                        case '\r':
+                            scratch += '\n';
+                            if(p != end && (*p == '\n' || *p == '\r') && *p != c)
+                                ++p;
+                            break;
+                        case 'x':
+                            if(end - p < 2 || !isHexDigit(p[0]) || !isHexDigit(p[1]))
+                                fail("invalid hexadecimal escape");
+                            scratch += static_cast<char>(hexValue(p[0]) * 16 + hexValue(p[1]));
+                            p += 2;
+                            break;
+                        case 'z':
+                            while(p != end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == '\f' || *p == '\v'))
+                                ++p;
+                            break;
+                        default:
+                        {
+                            if(!isDigit(c))
+                                fail("invalid escape");
+                            int value = c - '0';
+                            for(int i = 0; i < 2 && p != end && isDigit(*p); ++i)
+                                value = value * 10 + (*p++ - '0');
+                            if(value > 255)
+                                fail("decimal escape too large");
+                            scratch += static_cast<char>(value);
+                        }
+                    }
+                }
+
+                data = scratch.data();
+                size = scratch.size();
+            }
+
+            LuaNumber readNumber()
+            {
+                const char* start = p;
+                bool hex = end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+                bool integer = true;
+                if(hex)
+                {
+                    p += 2;
+                    while(p != end && (isHexDigit(*p) || *p == '.' || *p == 'p' || *p == 'P' ||
+                                       ((*p == '+' || *p == '-') && (p[-1] == 'p' || p[-1] == 'P'))))
+                        ++p;
+                    integer = false;
+                }
+                else
+                {
+                    while(p != end && isDigit(*p))
+                        ++p;
+                    if(p != end && *p == '.')
+                    {
+                        integer = false;
+                        ++p;
+                        while(p != end && isDigit(*p))
+                            ++p;
+                    }
+                    if(p != end && (*p == 'e' || *p == 'E'))
+                    {
+                        integer = false;
+                        ++p;
+                        if(p != end && (*p == '+' || *p == '-'))
+                            ++p;
+                        while(p != end && isDigit(*p))
+                            ++p;
+                    }
+                }
+                if(p != end && (isNameStart(*p) || isDigit(*p)))
+                    fail("malformed number");
+
+                //short integers are exact in a double, so they do not need strtod
+                std::size_t length = p - start;
+                if(integer && length < 16)
+                {
+                    LuaNumber d = 0;
+                    for(const char* digit = start; digit != p; ++digit)
+                        d = d * 10 + (*digit - '0');
+                    return d;
+                }
+
+                //the input is not necessarily null terminated
+                std::string number(start, length);
+                char* last;
+                LuaNumber d = std::strtod(number.c_str(), &last);
+                if(last != number.c_str() + length)
+                    fail("malformed number");
+                return d;
+            }
+
+            //Reads a key inside brackets in a path.  Only strings, numbers and booleans can be path keys.
+            Object readPathKey()
+            {
+                skipSpace();
+                char c = peek();
+                Object key;
+                if(c == '"' || c == '\'')
+                {
+                    const char* data;
+                    std::size_t size;
+                    readQuotedString(data, size);
+                    key = Object::makeString(LuaString(data, size));
+                }
+                else if(c == '[' && longBracketLevel() >= 0)
+                {
+                    const char* data;
+                    std::size_t size;
+                    readLongString(longBracketLevel(), data, size);
+                    key = Object::makeString(LuaString(data, size));
+                }
+                else if(isDigit(c) || c == '.' || c == '-')
+                {
+                    bool negative = c == '-';
+                    if(negative)
+                    {
+                        ++p;
+                        skipSpace();
+                        if(peek() != '.' && !isDigit(*p))
+                            fail("expected a number");
+                    }
+                    LuaNumber d = readNumber();
+                    key = Object::makeNumber(negative ? -d : d);
+                }
+                else if(isNameStart(c))
+                {
+                    const char* data;
+                    std::size_t size;
+                    readName(data, size);
+                    if(isWord(data, size, "true") || isWord(data, size, "false"))
+                        key = Object::makeBoolean(isWord(data, size, "true"));
+                    else
+                        fail("only constants can be used as keys in assignments");
+                }
+                else
+                    fail("only constants can be used as keys in assignments");
+                expect(']', "expected ']'");
+                return key;
+            }
+
+            //Parses a value and returns true if it is nil.
+            template <typename Builder>
+            bool parseValue(Builder& builder, int depth)
+            {
+                skipSpace();
+                char c = peek();
+                const char* data;
+                std::size_t size;
+                if(c == '"' || c == '\'')
+                {
+                    readQuotedString(data, size);
+                    builder.string(data, size);
+                }
+                else if(c == '[' && longBracketLevel() >= 0)
+                {
+                    readLongString(longBracketLevel(), data, size);
+                    builder.string(data, size);
+                }
+                else if(c == '{')
+                    parseTable(builder, depth + 1);
+                else if(isDigit(c) || (c == '.' && end - p > 1 && isDigit(p[1])))
+                    builder.number(readNumber());
+                else if(c == '-')
+                {
+                    ++p;
+                    skipSpace();
+                    if(peek() != '.' && !isDigit(*p))
+                        fail("only constants and table constructors are allowed");
+                    builder.number(-readNumber());
+                }
+                else if(isNameStart(c))
+                {
+                    readName(data, size);
+                    if(isWord(data, size, "nil"))
+                    {
+                        builder.nil();
+                        return true;
+                    }
+                    else if(isWord(data, size, "true"))
+                        builder.boolean(true);
+                    else if(isWord(data, size, "false"))
+                        builder.boolean(false);
+                    else
+                        fail("only constants and table constructors are allowed");
+                }
+                else
+                    fail("only constants and table constructors are allowed");
+
+                //anything that continues the expression, such as an operator or a call, is code
+                skipSpace();
+                if(p != end && !(*p == ',' || *p == ';' || *p == '}' || *p == ']' || isNameStart(*p)))
+                    fail("only constants and table constructors are allowed");
+                return false;
+            }
+
+            template <typename Builder>
+            void parseTable(Builder& builder, int depth)
+            {
+                if(depth > maxDataDepth)
+                    fail("table constructors nested too deeply");
+                ++p;
+                builder.beginTable();
+
+                int index = 1;
+                for(;;)
+                {
+                    skipSpace();
+                    if(peek() == '}')
+                        break;
+
+                    if(*p == '[' && longBracketLevel() < 0)
+                    {
+                        ++p;
+                        if(parseValue(builder, depth))
+                            fail("table index is nil");
+                        expect(']', "expected ']'");
+                        expect('=', "expected '='");
+                        parseValue(builder, depth);
+                        builder.setField();
+                    }
+                    else
+                    {
+                        //a name followed by = is a key; anything else is an item
+                        const char* start = p;
+                        const char* data;
+                        std::size_t size = 0;
+                        if(isNameStart(*p))
+                        {
+                            readName(data, size);
+                            skipSpace();
+                        }
+                        if(size > 0 && p != end && *p == '=' && (end - p < 2 || p[1] != '=') && !isReserved(data, size))
+                        {
+                            ++p;
+                            builder.string(data, size);
+                            parseValue(builder, depth);
+                            builder.setField();
+                        }
+                        else
+                        {
+                            p = start;
+                            parseValue(builder, depth);
+                            builder.appendItem(index++);
+                        }
+                    }
+
+                    skipSpace();
+                    if(peek() == ',' || *p == ';')
+                        ++p;
+                    else if(*p != '}')
+                        fail("expected ',' or '}'");
+                }
+
+                ++p;
+                builder.endTable();
+            }
+
+        public:
+            DataParser(const char* data, std::size_t size)
+            : begin(data), p(data), end(data + size)
+            {
+                //a first line starting with # is skipped, as by lua_load
+                if(p != end && *p == '#')
+                    while(p != end && *p != '\n')
+                        ++p;
+            }
+
+            template <typename Builder>
+            void parse(Builder& builder)
+            {
+                std::vector <Object> path;
+                for(;;)
+                {
+                    skipSpace();
+                    if(p == end)
+                        return;
+                    if(*p == ';')
+                    {
+                        ++p;
+                        continue;
+                    }
+
+                    const char* data;
+                    std::size_t size;
+                    if(!isNameStart(*p))
+                        fail("expected an assignment");
+                    readName(data, size);
+                    if(isReserved(data, size))
+                        fail("only assignments are allowed");
+
+                    path.clear();
+                    path.push_back(Object::makeString(LuaString(data, size)));
+                    for(;;)
+                    {
+                        skipSpace();
+                        char c = peek();
+                        if(c == '.')
+                        {
+                            ++p;
+                            skipSpace();
+                            if(p == end || !isNameStart(*p))
+                                fail("expected a name");
+                            readName(data, size);
+                            path.push_back(Object::makeString(LuaString(data, size)));
+                        }
+                        else if(c == '[' && longBracketLevel() < 0)
+                        {
+                            ++p;
+                            path.push_back(readPathKey());
+                        }
+                        else if(c == '=')
+                        {
+                            ++p;
+                            break;
+                        }
+                        else
+                            fail("only assignments are allowed");
+                    }
+
+                    parseValue(builder, 0);
+                    if(!builder.assign(path))
+                        fail("attempt to index a field that is not a table");
+                }
+            }
+        };
+
+        //Builds Objects.
+        struct DataObjectBuilder
+        {
+            LuaTable globals;
+            std::vector <Object> values;
+
+            Object pop()
+            {
+                Object value = std::move(values.back());
+                values.pop_back();
+                return value;
+            }
+
+            static void set(LuaTable& table, Object&& key, Object&& value)
+            {
+                if(value.isNil())
+                    table.erase(key);
+                else
+                    table[std::move(key)] = std::move(value);
+            }
+
+            void nil() { values.push_back(Object()); }
+            void boolean(bool b) { values.push_back(Object::makeBoolean(b)); }
+            void number(LuaNumber d) { values.push_back(Object::makeNumber(d)); }
+            void string(const char* data, std::size_t size) { values.push_back(Object::makeString(LuaString(data, size))); }
+            void beginTable() { values.push_back(Object::makeTable()); }
+            void endTable() {}
+
+            void setField()
+            {
+                Object value = pop();
+                Object key = pop();
+                set(values.back().editTable(), std::move(key), std::move(value));
+            }
+
+            void appendItem(int index)
+            {
+                Object value = pop();
+                set(values.back().editTable(), Object::makeNumber(index), std::move(value));
+            }
+
+            bool assign(const std::vector <Object>& path)
+            {
+                LuaTable* table = &globals;
+                for(std::size_t i = 0; i + 1 < path.size(); ++i)
+                {
+                    auto it = table->find(path[i]);
+                    if(it == table->end() || !it->second.isTable())
+                        return false;
+                    table = &it->second.editTable();
+                }
+                set(*table, Object(path.back()), pop());
+                return true;
+            }
+        };
+
+        //First pass: counts the items and fields of every table constructor, in the order they begin,
+        //so the tables can be created with their final sizes as the compiled chunk would.
+        struct DataCounter
+        {
+            std::vector <std::pair<int, int>> counts;
+            std::vector <std::size_t> open;
+
+            void nil() {}
+            void boolean(bool) {}
+            void number(LuaNumber) {}
+            void string(const char*, std::size_t) {}
+
+            void beginTable()
+            {
+                open.push_back(counts.size());
+                counts.push_back(std::make_pair(0, 0));
+            }
+
+            void endTable() { open.pop_back(); }
+            void setField() { ++counts[open.back()].second; }
+            void appendItem(int) { ++counts[open.back()].first; }
+            bool assign(const std::vector <Object>&) { return true; }
+        };
+
+        //Second pass: pushes onto a Lua stack and assigns into the State's variables.
+        struct DataLuaBuilder
+        {
+            lua_State* state;
+            const std::vector <std::pair<int, int>>& counts;
+            std::size_t nextCount;
+
+            DataLuaBuilder(lua_State* state, const std::vector <std::pair<int, int>>& counts)
+            : state(state), counts(counts), nextCount(0)
+            {}
+
+            void nil() { growStack(state, 1); lua_pushnil(state); }
+            void boolean(bool b) { growStack(state, 1); lua_pushboolean(state, b); }
+            void number(LuaNumber d) { growStack(state, 1); lua_pushnumber(state, d); }
+            void string(const char* data, std::size_t size) { growStack(state, 1); lua_pushlstring(state, data, size); }
+            void beginTable()
+            {
+                growStack(state, 3);
+                lua_createtable(state, counts[nextCount].first, counts[nextCount].second);
+                ++nextCount;
+            }
+
+            void endTable() {}
+            void setField() { lua_rawset(state, -3); }
+            void appendItem(int index) { lua_rawseti(state, -2, index); }
+
+            bool assign(const std::vector <Object>& path)
+            {
+                int value = lua_gettop(state);
+                if(path.size() == 1)
+                {
+                    lua_setglobal(state, path[0].getString().c_str());
+                    return true;
+                }
+
+                growStack(state, 2);
+                lua_getglobal(state, path[0].getString().c_str());
+                for(std::size_t i = 1; i < path.size(); ++i)
+                {
+                    if(!lua_istable(state, -1))
+                    {
+                        lua_settop(state, value - 1);
+                        return false;
+                    }
+                    pushVar(state, path[i]);
+                    if(i + 1 == path.size())
+                    {
+                        lua_pushvalue(state, value);
+                        lua_settable(state, -3);
+                    }
+                    else
+                        lua_gettable(state, -2);
+                    lua_remove(state, -2);
+                }
+                lua_settop(state, value - 1);
+                return true;
+            }
+        };
+    }//namespace internal
+
+    LuaTable parseData(const char* data, std::size_t size)
+    {
+        internal::DataObjectBuilder builder;
+        internal::DataParser(data, size).parse(builder);
+        return std::move(builder.globals);
+    }
+
+    void State::loadData(const char* data, std::size_t size)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::loadData");
+
+        //the first pass validates the syntax, so only assignments to fields of values that are not tables
+        //can interrupt the second
+        internal::DataCounter counter;
+        internal::DataParser(data, size).parse(counter);
+
+        int top = lua_gettop(state);
+        try
+        {
+            internal::DataLuaBuilder builder(state, counter.counts);
+            internal::DataParser(data, size).parse(builder);
+        }
+        catch(...)
+        {
+            lua_settop(state, top);
+            throw;
+        }
+    }
+
+    void State::loadDataFile(const std::string& filename)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::loadDataFile");
+
+        internal::TraceSpan span("loadDataFile", filename);
+        std::string data = readFile(filename);
+        loadData(data.data(), data.size());
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for the binary functions
+
+        static const char binaryMagic[] = {'S', 'L', 'B'};
+
+        class BinaryWriter
+        {
+            std::string& out;
+            std::unordered_set <const void*> open;
+            int depth;
+
+            void putBigEndian(unsigned long long value, int bytes)
+            {
+                for(int shift = (bytes - 1) * 8; shift >= 0; shift -= 8)
+                    out += static_cast<char>((value >> shift) & 0xff);
+            }
+
+            void putTagged(unsigned char tag, unsigned long long value, int bytes)
+            {
+                out += static_cast<char>(tag);
+                putBigEndian(value, bytes);
+            }
+
+            //writes an array or map header using the fix form when possible
+            void putSize(std::size_t size, unsigned char fix, std::size_t fixLimit, unsigned char size16)
+            {
+                if(size < fixLimit)
+                    out += static_cast<char>(fix | size);
+                else if(size < 0x10000)
+                    putTagged(size16, size, 2);
+                else
+                    putTagged(size16 + 1, size, 4);
+            }
+
+            void enter(const void* identity)
+            {
+                if(!open.insert(identity).second)
+                    throw table_too_deep("lua::writeBinary - table contains itself");
+            }
+
+            void deeper()
+            {
+                if(++depth > maxWriteDepth)
+                    throw table_too_deep("lua::writeBinary - tables are nested too deeply");
+            }
+
+        public:
+            explicit BinaryWriter(std::string& out)
+            : out(out), depth(0)
+            {
+                out.append(binaryMagic, sizeof(binaryMagic));
+                out += static_cast<char>(BINARY_VERSION);
+            }
+
+            void writeNil()
+            {
+                out += static_cast<char>(0xc0);
+            }
+
+            void writeBoolean(bool b)
+            {
+                out += static_cast<char>(b ? 0xc3 : 0xc2);
+            }
+
+            void writeNumber(LuaNumber d)
+            {
+                //integral values (except -0) are stored in the smallest integer encoding
+                if(d >= -9223372036854775808.0 && d < 9223372036854775808.0 && d == std::floor(d) && !(d == 0 && std::signbit(d)))
+                {
+                    long long i = static_cast<long long>(d);
+                    if(i >= 0)
+                    {
+                        if(i < 0x80)
+                            out += static_cast<char>(i);
+                        else if(i < 0x100)
+                            putTagged(0xcc, i, 1);
+                        else if(i < 0x10000)
+                            putTagged(0xcd, i, 2);
+                        else if(i < 0x100000000LL)
+                            putTagged(0xce, i, 4);
+                        else
+                            putTagged(0xcf, i, 8);
+                    }
+                    else
+                    {
+                        if(i >= -32)
+                            out += static_cast<char>(i);
+                        else if(i >= -0x80)
+                            putTagged(0xd0, i, 1);
+                        else if(i >= -0x8000)
+                            putTagged(0xd1, i, 2);
+                        else if(i >= -0x80000000LL)
+                            putTagged(0xd2, i, 4);
+                        else
+                            putTagged(0xd3, i, 8);
+                    }
+                    return;
+                }
+
+                unsigned long long bits;
+                std::memcpy(&bits, &d, sizeof(bits));
+                putTagged(0xcb, bits, 8);
+            }
+
+            void writeString(const char* data, std::size_t size)
+            {
+                if(size < 32)
+                    out += static_cast<char>(0xa0 | size);
+                else if(size < 0x100)
+                    putTagged(0xd9, size, 1);
+                else if(size < 0x10000)
+                    putTagged(0xda, size, 2);
+                else
+                    putTagged(0xdb, size, 4);
+                out.append(data, size);
+            }
+
+            void write(lua_State* state, int index)
+            {
+                switch(lua_type(state, index))
+                {
+                    case LUA_TNIL:
+                        writeNil();
+                        break;
+                    case LUA_TBOOLEAN:
+                        writeBoolean(lua_toboolean(state, index));
+                        break;
+                    case LUA_TNUMBER:
+                        writeNumber(lua_tonumber(state, index));
+                        break;
+                    case LUA_TSTRING:
+                    {
+                        std::size_t size;
+                        const char* data = lua_tolstring(state, index, &size);
+                        writeString(data, size);
+                        break;
+                    }
+                    case LUA_TTABLE:
+                    {
+                        const void* identity = lua_topointer(state, index);
+                        enter(identity);
+                        deeper();
+                        growStack(state, 3);
+                        int top = lua_gettop(state);
+                        index = contentsIndex(state, index);
+
+                        std::size_t length = sequenceLength(state, index);
+                        if(length > 0)
+                        {
+                            putSize(length, 0x90, 16, 0xdc);
+                            for(std::size_t i = 1; i <= length; ++i)
+                            {
+                                lua_rawgeti(state, index, i);
+                                write(state, lua_gettop(state));
+                                lua_pop(state, 1);
+                            }
+                        }
+                        else
+                        {
+                            std::size_t count = 0;
+                            lua_pushnil(state);
+                            while(lua_next(state, index) != 0)
+                            {
+                                lua_pop(state, 1);
+                                ++count;
+                            }
+
+                            putSize(count, 0x80, 16, 0xde);
+                            lua_pushnil(state);
+                            while(lua_next(state, index) != 0)
+                            {
+                                int key = lua_gettop(state) - 1;
+                                write(state, key);
+                                write(state, key + 1);
+                                lua_pop(state, 1);
+                            }
+                        }
+
+                        lua_settop(state, top);
+                        open.erase(identity);
+                        --depth;
+                        break;
+                    }
+                    default:
+                        throw type_mismatch("lua::State::writeBinary - value cannot be serialized");
+                }
+            }
+
+            void write(const Object& obj)
+            {
+                switch(obj.getType())
+                {
+                    case Object::NIL:
+                        writeNil();
+                        break;
+                    case Object::BOOLEAN:
+                        writeBoolean(obj.getBoolean());
+                        break;
+                    case Object::NUMBER:
+                        writeNumber(obj.getNumber());
+                        break;
+                    case Object::STRING:
+                        writeString(obj.getString().data(), obj.getString().size());
+                        break;
+                    case Object::TABLE:
+                    case Object::WEAK_TABLE:
+                    {
+                        const LuaTable& table = obj.isTable() ? obj.getTable() : *obj.getWeakTable();
+                        if(obj.isWeakTable())
+                            enter(&table);
+                        deeper();
+
+                        //keys are unique, so if each is an integer from 1 to the size, the table is a sequence
+                        bool sequence = !table.empty();
+                        for(auto& p : table)
+                        {
+                            if(!p.first.isNumber() || p.first.getNumber() < 1 || p.first.getNumber() > table.size() ||
+                               p.first.getNumber() != std::floor(p.first.getNumber()))
+                            {
+                                sequence = false;
+                                break;
+                            }
+                        }
+
+                        if(sequence)
+                        {
+                            putSize(table.size(), 0x90, 16, 0xdc);
+                            for(std::size_t i = 1; i <= table.size(); ++i)
+                                write(table.find(Object::makeNumber(i))->second);
+                        }
+                        else
+                        {
+                            putSize(table.size(), 0x80, 16, 0xde);
+                            for(auto& p : table)
+                            {
+                                write(p.first);
+                                write(p.second);
+                            }
+                        }
+
+                        if(obj.isWeakTable())
+                            open.erase(&table);
+                        --depth;
+                        break;
+                    }
+                    default:
+                        throw type_mismatch("lua::writeBinary - value cannot be serialized");
+                }
+            }
+        };
+    }//namespace internal
+
+    void writeBinary(const Object& obj, std::string& out)
+    {
+        internal::BinaryWriter(out).write(obj);
+    }
+
+    BinaryReader::BinaryReader(const char* data, std::size_t size)
+    : begin(data), p(data), end(data + size)
+    {
+        need(sizeof(internal::binaryMagic) + 1);
+        if(std::memcmp(p, internal::binaryMagic, sizeof(internal::binaryMagic)) != 0)
+            fail("missing header");
+        p += sizeof(internal::binaryMagic);
+        if(static_cast<unsigned char>(*p) != BINARY_VERSION)
+            fail("unsupported version");
+        ++p;
+    }
+
+    void BinaryReader::fail(const char* what) const
+    {
+        std::stringstream ss;
+        ss << "lua::BinaryReader - " << what << " at offset " << (p - begin);
+        throw parse_error(ss.str());
+    }
+
+    void BinaryReader::need(std::size_t bytes) const
+    {
+        if(static_cast<std::size_t>(end - p) < bytes)
+            fail("unexpected end of data");
+    }
+
+    unsigned char BinaryReader::next()
+    {
+        need(1);
+        return *p++;
+    }
+
+    unsigned long long BinaryReader::readBigEndian(int bytes)
+    {
+        need(bytes);
+        unsigned long long value = 0;
+        for(int i = 0; i < bytes; ++i)
+            value = (value << 8) | static_cast<unsigned char>(*p++);
+        return value;
+    }
+
+    int BinaryReader::peekType() const
+    {
+        need(1);
+        unsigned char tag = *p;
+        if(tag < 0x80 || tag >= 0xe0 || (tag >= 0xca && tag <= 0xd3))
+            return Object::NUMBER;
+        if(tag < 0xa0 || tag == 0xdc || tag == 0xdd || tag == 0xde || tag == 0xdf)
+            return Object::TABLE;
+        if(tag < 0xc0 || (tag >= 0xc4 && tag <= 0xc6) || (tag >= 0xd9 && tag <= 0xdb))
+            return Object::STRING;
+        if(tag == 0xc0)
+            return Object::NIL;
+        if(tag == 0xc2 || tag == 0xc3)
+            return Object::BOOLEAN;
+        fail("unsupported type");
+        return Object::NIL;
+    }
+
+    void BinaryReader::readNil()
+    {
+        if(next() != 0xc0)
+        {
+            --p;
+            fail("expected nil");
+        }
+    }
+
+    LuaBoolean BinaryReader::readBoolean()
+    {
+        unsigned char tag = next();
+        if(tag != 0xc2 && tag != 0xc3)
+        {
+            --p;
+            fail("expected a boolean");
+        }
+        return tag == 0xc3;
+    }
+
+    LuaNumber BinaryReader::readNumber()
+    {
+        unsigned char tag = next();
+        if(tag < 0x80)
+            return tag;
+        if(tag >= 0xe0)
+            return static_cast<signed char>(tag);
+
+        switch(tag)
+        {
+            case 0xca:
+            {
+                unsigned bits = static_cast<unsigned>(readBigEndian(4));
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                return f;
+            }
+            case 0xcb:
+            {
+                unsigned long long bits = readBigEndian(8);
+                LuaNumber d;
+                std::memcpy(&d, &bits, sizeof(d));
+                return d;
+            }
+            case 0xcc: return static_cast<LuaNumber>(readBigEndian(1));
+            case 0xcd: return static_cast<LuaNumber>(readBigEndian(2));
+            case 0xce: return static_cast<LuaNumber>(readBigEndian(4));
+            case 0xcf: return static_cast<LuaNumber>(readBigEndian(8));
+            case 0xd0: return static_cast<signed char>(readBigEndian(1));
+            case 0xd1: return static_cast<short>(readBigEndian(2));
+            case 0xd2: return static_cast<int>(readBigEndian(4));
+            case 0xd3: return static_cast<LuaNumber>(static_cast<long long>(readBigEndian(8)));
+        }
+
+        --p;
+        fail("expected a number");
+        return 0;
+    }
+
+    StringSlice BinaryReader::readString()
+    {
+        unsigned char tag = next();
+        std::size_t size;
+        if(tag >= 0xa0 && tag < 0xc0)
+            size = tag & 0x1f;
+        else if(tag == 0xd9 || tag == 0xc4)
+            size = readBigEndian(1);
+        else if(tag == 0xda || tag == 0xc5)
+            size = readBigEndian(2);
+        else if(tag == 0xdb || tag == 0xc6)
+            size = readBigEndian(4);
+        else
+        {
+            --p;
+            fail("expected a string");
+            return StringSlice();
+        }
+
+        need(size);
+        StringSlice slice = {p, size};
+        p += size;
+        return slice;
+    }
+
+    std::size_t BinaryReader::readTable(bool& isArray)
+    {
+        unsigned char tag = next();
+        std::size_t size;
+        isArray = (tag >= 0x90 && tag < 0xa0) || tag == 0xdc || tag == 0xdd;
+        if(tag >= 0x80 && tag < 0xa0)
+            size = tag & 0x0f;
+        else if(tag == 0xdc || tag == 0xde)
+            size = readBigEndian(2);
+        else if(tag == 0xdd || tag == 0xdf)
+            size = readBigEndian(4);
+        else
+        {
+            --p;
+            fail("expected a table");
+            return 0;
+        }
+
+        //every entry takes at least one byte, so larger sizes can only come from corrupt data
+        if(size > static_cast<std::size_t>(end - p))
+            fail("table is larger than the data");
+        return size;
+    }
+
+    void BinaryReader::skip()
+    {
+        std::size_t remaining = 1;
+        while(remaining > 0)
+        {
+            --remaining;
+            switch(peekType())
+            {
+                case Object::NIL:
+                    readNil();
+                    break;
+                case Object::BOOLEAN:
+                    readBoolean();
+                    break;
+                case Object::NUMBER:
+                    readNumber();
+                    break;
+                case Object::STRING:
+                    readString();
+                    break;
+                case Object::TABLE:
+                {
+                    bool isArray;
+                    std::size_t size = readTable(isArray);
+                    remaining += isArray ? size : size * 2;
+                    break;
+                }
+            }
+        }
+    }
+
+    bool BinaryReader::atEnd() const
+    {
+        return p == end;
+    }
+
+    std::size_t BinaryReader::getOffset() const
+    {
+        return p - begin;
+    }
+
+    namespace internal
+    {
+        //Reads one value without recursion.  The Builder keeps the values read so far
+        //and stores each completed value in the innermost open table.
+        template <typename Builder>
+        static void readBinaryValue(BinaryReader& reader, Builder& builder)
+        {
+            struct Frame
+            {
+                //values still to be read; a map entry counts as two values
+                std::size_t remaining;
+                bool isArray;
+                int index;
+            };
+
+            std::vector <Frame> frames;
+            for(;;)
+            {
+                bool complete = true;
+                switch(reader.peekType())
+                {
+                    case Object::NIL:
+                        reader.readNil();
+                        builder.pushNil();
+                        break;
+                    case Object::BOOLEAN:
+                        builder.pushBoolean(reader.readBoolean());
+                        break;
+                    case Object::NUMBER:
+                        builder.pushNumber(reader.readNumber());
+                        break;
+                    case Object::STRING:
+                        builder.pushString(reader.readString());
+                        break;
+                    case Object::TABLE:
+                    {
+                        bool isArray;
+                        std::size_t size = reader.readTable(isArray);
+                        builder.beginTable(size, isArray);
+                        if(size > 0)
+                        {
+                            Frame frame = {isArray ? size : size * 2, isArray, 1};
+                            frames.push_back(frame);
+                            complete = false;
+                        }
+                        else
+                            builder.endTable();
+                        break;
+                    }
+                }
+
+                while(complete)
+                {
+                    if(frames.empty())
+                        return;
+
+                    Frame& frame = frames.back();
+                    if(frame.isArray)
+                        builder.setElement(frame.index++);
+                    else if(frame.remaining % 2 == 1)
+                        builder.setField();
+                    //otherwise the value is a key and stays until its value is read
+
+                    if(--frame.remaining > 0)
+                        break;
+                    frames.pop_back();
+                    builder.endTable();
+                }
+            }
+        }
+
+        struct BinaryObjectBuilder
+        {
+            std::vector <Object> values;
+            std::vector <LuaTable> tables;
+
+            void pushNil() { values.push_back(Object()); }
+            void pushBoolean(LuaBoolean b) { values.push_back(Object::makeBoolean(b)); }
+            void pushNumber(LuaNumber d) { values.push_back(Object::makeNumber(d)); }
+            void pushString(StringSlice s) { values.push_back(Object::makeString(LuaString(s.data, s.size))); }
+            void beginTable(std::size_t, bool) { tables.push_back(LuaTable()); }
+
+            void endTable()
+            {
+                values.push_back(Object::makeTable(std::move(tables.back())));
+                tables.pop_back();
+            }
+
+            void setElement(int index)
+            {
+                tables.back()[Object::makeInteger(index)] = std::move(values.back());
+                values.pop_back();
+            }
+
+            void setField()
+            {
+                Object& key = values[values.size() - 2];
+                if(key.isNil() || (key.isNumber() && key.getNumber() != key.getNumber()))
+                    throw parse_error("lua::readBinary - table key is nil or NaN");
+                tables.back()[std::move(key)] = std::move(values.back());
+                values.pop_back();
+                values.pop_back();
+            }
+        };
+
+        struct BinaryLuaBuilder
+        {
+            lua_State* state;
+
+            void pushNil() { lua_pushnil(state); }
+            void pushBoolean(LuaBoolean b) { lua_pushboolean(state, b); }
+            void pushNumber(LuaNumber d) { lua_pushnumber(state, d); }
+            void pushString(StringSlice s) { lua_pushlstring(state, s.data, s.size); }
+            void endTable() {}
+
+            //makes room for the table, a key and a value
+            void beginTable(std::size_t size, bool isArray)
+            {
+                growStack(state, 3);
+                int n = static_cast<int>(std::min<std::size_t>(size, INT_MAX));
+                lua_createtable(state, isArray ? n : 0, isArray ? 0 : n);
+            }
+
+            void setElement(int index)
+            {
+                lua_rawseti(state, -2, index);
+            }
+
+            void setField()
+            {
+                if(lua_isnil(state, -2) || (lua_type(state, -2) == LUA_TNUMBER && lua_tonumber(state, -2) != lua_tonumber(state, -2)))
+                    throw parse_error("lua::State::readBinary - table key is nil or NaN");
+                lua_rawset(state, -3);
+            }
+        };
+    }//namespace internal
+
+    namespace internal
+    {
+        //Writes the value at index, restoring the stack even if an exception is thrown.
+        static void writeStackBinary(lua_State* state, int index, std::string& out)
+        {
+            index = lua_absindex(state, index);
+            int top = lua_gettop(state);
+            try
+            {
+                BinaryWriter(out).write(state, index);
+            }
+            catch(...)
+            {
+                lua_settop(state, top);
+                throw;
+            }
+        }
+
+        //Pushes the value in data, leaving the stack unchanged if an exception is thrown.
+        static void pushBinary(lua_State* state, const char* data, std::size_t size)
+        {
+            int top = lua_gettop(state);
+            try
+            {
+                growStack(state, 1);
+                BinaryReader reader(data, size);
+                BinaryLuaBuilder builder = {state};
+                readBinaryValue(reader, builder);
+                if(!reader.atEnd())
+                    throw parse_error("lua::State::readBinary - unexpected data after the value");
+            }
+            catch(...)
+            {
+                lua_settop(state, top);
+                throw;
+            }
+        }
+    }//namespace internal
+
+    Object readBinary(const char* data, std::size_t size)
+    {
+        BinaryReader reader(data, size);
+        internal::BinaryObjectBuilder builder;
+        internal::readBinaryValue(reader, builder);
+        if(!reader.atEnd())
+            throw parse_error("lua::readBinary - unexpected data after the value");
+        return std::move(builder.values.back());
+    }
+
+    void State::writeBinary(const std::string& name, std::string& out) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::writeBinary");
+
+        pushVariable(state, name);
+        try
+        {
+            writeStackBinary(-1, out);
+        }
+        catch(...)
+        {
+            lua_pop(state, 1);
+            throw;
+        }
+        lua_pop(state, 1);
+    }
+
+    void State::writeStackBinary(int index, std::string& out) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::writeStackBinary");
+
+        internal::writeStackBinary(state, index, out);
+    }
+
+    void State::pushBinary(const char* data, std::size_t size)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::pushBinary");
+
+        internal::pushBinary(state, data, size);
+    }
+
+    void State::readBinary(const std::string& name, const char* data, std::size_t size)
+    {
+        pushBinary(data, size);
+        assignVariable(state, name);
+    }
+
+
+    namespace internal
+    {
+        //Backs off while waiting for another thread: spins first, then yields, then sleeps.
+        class Backoff
+        {
+            unsigned count;
+
+        public:
+            Backoff()
+            : count(0)
+            {}
+
+            void wait()
+            {
+                if(count >= 128)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                else if(count >= 64)
+                    std::this_thread::yield();
+                ++count;
+            }
+        };
+
+        //Full userdata holding a shared_ptr, so Lua shares ownership of a C++ object.
+        template <typename T>
+        static int collectShared(lua_State* state)
+        {
+            typedef std::shared_ptr<T> Pointer;
+            static_cast<Pointer*>(lua_touserdata(state, 1))->~Pointer();
+            return 0;
+        }
+
+        template <typename T>
+        static void pushShared(lua_State* state, const std::shared_ptr<T>& object, const char* metatable)
+        {
+            growStack(state, 3);
+            void* memory = lua_newuserdata(state, sizeof(std::shared_ptr<T>));
+            new (memory) std::shared_ptr<T>(object);
+            if(luaL_newmetatable(state, metatable))
+            {
+                lua_pushcfunction(state, collectShared<T>);
+                lua_setfield(state, -2, "__gc");
+            }
+            lua_setmetatable(state, -2);
+        }
+
+        template <typename T>
+        static T& getShared(lua_State* state, int index)
+        {
+            return **static_cast<std::shared_ptr<T>*>(lua_touserdata(state, index));
+        }
+
+        //Calls f, which returns a number of results, and turns exceptions into Lua errors.
+        //lua_error does not unwind the C++ stack, so it is only called after the exception is destroyed.
+        template <typename F>
+        static int protect(lua_State* state, F f)
+        {
+            int results = 0;
+            bool failed = false;
+            try
+            {
+                results = f();
+            }
+            catch(const std::exception& e)
+            {
+                lua_pushstring(state, e.what());
+                failed = true;
+            }
+            catch(...)
+            {
+                lua_pushstring(state, "Native function: unknown exception");
+                failed = true;
+            }
+
+            if(failed)
+                return lua_error(state);
+            return results;
+        }
+
+        //Returns true if state is the main thread, which cannot yield.
+        static bool isMainThread(lua_State* state)
+        {
+            growStack(state, 1);
+            bool main = lua_pushthread(state) == 1;
+            lua_pop(state, 1);
+            return main;
+        }
+
+        //Functions of the channel library.  Each has the channel as its only upvalue.
+
+        static int channelTrySendValue(lua_State* state)
+        {
+            std::string data;
+            writeStackBinary(state, 1, data);
+            return getShared<Channel>(state, lua_upvalueindex(1)).trySendBinary(data) ? 1 : 0;
+        }
+
+        static int channelTryReceiveValue(lua_State* state)
+        {
+            std::string data;
+            if(!getShared<Channel>(state, lua_upvalueindex(1)).tryReceiveBinary(data))
+                return 0;
+            pushBinary(state, data.data(), data.size());
+            return 1;
+        }
+
+        static int channelSend(lua_State* state)
+        {
+            luaL_checkany(state, 1);
+
+            //coroutines yield and try again when resumed, so a consumer sharing their thread can run
+            if(!isMainThread(state))
+            {
+                if(!protect(state, [state]() { return channelTrySendValue(state); }))
+                    return lua_yieldk(state, 0, 0, channelSend);
+                return 0;
+            }
+
+            protect(state, [state]()
+            {
+                std::string data;
+                writeStackBinary(state, 1, data);
+                getShared<Channel>(state, lua_upvalueindex(1)).sendBinary(std::move(data));
+                return 0;
+            });
+            return 0;
+        }
+
+        static int channelTrySend(lua_State* state)
+        {
+            luaL_checkany(state, 1);
+            int sent = protect(state, [state]() { return channelTrySendValue(state); });
+            lua_pushboolean(state, sent);
+            return 1;
+        }
+
+        static int channelReceive(lua_State* state)
+        {
+            if(protect(state, [state]() { return channelTryReceiveValue(state); }))
+                return 1;
+
+            //coroutines yield and try again when resumed; the main thread can only wait
+            if(!isMainThread(state))
+                return lua_yieldk(state, 0, 0, channelReceive);
+
+            Backoff backoff;
+            do
+                backoff.wait();
+            while(!protect(state, [state]() { return channelTryReceiveValue(state); }));
+            return 1;
+        }
+
+        static int channelTryReceive(lua_State* state)
+        {
+            growStack(state, 2);
+            if(!protect(state, [state]() { return channelTryReceiveValue(state); }))
+            {
+                lua_pushboolean(state, false);
+                return 1;
+            }
+            lua_pushboolean(state, true);
+            lua_insert(state, -2);
+            return 2;
+        }
+    }//namespace internal
+
+    namespace internal
+    {
+        //Helper functions for tracing
+
+        std::atomic <bool> tracing(false);
+
+        //A span, in nanoseconds on the steady clock.  category is the name of the span's kind, and name,
+        //if not empty, what it ran (such as the function called).
+        struct TraceEvent
+        {
+            const char* category;
+            std::string name;
+            std::uint64_t begin;
+            std::uint64_t duration;
+        };
+
+        //Only the owning thread appends events.  An event is published by incrementing count, and a chunk by
+        //setting next, so other threads can read everything published so far without locking.
+        struct TraceChunk
+        {
+            static const std::size_t capacity = 1024;
+
+            TraceEvent events[capacity];
+            std::atomic <std::size_t> count;
+            std::atomic <TraceChunk*> next;
+
+            TraceChunk()
+            : count(0), next(nullptr)
+            {}
+        };
+
+        struct ThreadTrace
+        {
+            unsigned id;
+            TraceChunk* first;
+            //the chunk the owning thread appends to
+            TraceChunk* last;
+        };
+
+        //Thread traces are never freed, since their threads may still use them.
+        static std::mutex traceThreadsMutex;
+        static std::vector <ThreadTrace*> traceThreads;
+
+        static ThreadTrace* getThreadTrace()
+        {
+            static thread_local ThreadTrace* trace = nullptr;
+            if(!trace)
+            {
+                std::unique_ptr<ThreadTrace> created(new ThreadTrace);
+                created->first = created->last = new TraceChunk;
+                std::lock_guard<std::mutex> lock(traceThreadsMutex);
+                created->id = static_cast<unsigned>(traceThreads.size()) + 1;
+                traceThreads.push_back(created.get());
+                trace = created.release();
+            }
+            return trace;
+        }
+
+        static std::uint64_t traceClock()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        void TraceSpan::start()
+        {
+            begin = traceClock();
+        }
+
+        void TraceSpan::startNative(lua_State* state)
+        {
+            lua_Debug ar;
+            if(lua_getstack(state, 0, &ar) && lua_getinfo(state, "n", &ar) && ar.name)
+                detail = ar.name;
+            begin = traceClock();
+        }
+
+        void TraceSpan::finish()
+        {
+            std::uint64_t end = traceClock();
+            try
+            {
+                ThreadTrace* trace = getThreadTrace();
+                TraceChunk* chunk = trace->last;
+                std::size_t count = chunk->count.load(std::memory_order_relaxed);
+                if(count == TraceChunk::capacity)
+                {
+                    TraceChunk* next = new TraceChunk;
+                    chunk->next.store(next, std::memory_order_release);
+                    chunk = trace->last = next;
+                    count = 0;
+                }
+
+                TraceEvent& event = chunk->events[count];
+                event.category = name;
+                event.name = std::move(detail);
+                event.begin = begin;
+                event.duration = end - begin;
+                chunk->count.store(count + 1, std::memory_order_release);
+            }
+            catch(...)
+            {
+                //a span that cannot be recorded is dropped
+            }
+        }
+
+        static void writeTraceEvents(std::string& buffer, std::ostream* out)
+        {
+            std::vector <ThreadTrace*> threads;
+            {
+                std::lock_guard<std::mutex> lock(traceThreadsMutex);
+                threads = traceThreads;
+            }
+
+            buffer += "{\"traceEvents\":[";
+            bool first = true;
+            char text[96];
+            for(ThreadTrace* trace : threads)
+            {
+                for(TraceChunk* chunk = trace->first; chunk; chunk = chunk->next.load(std::memory_order_acquire))
+                {
+                    std::size_t count = chunk->count.load(std::memory_order_acquire);
+                    for(std::size_t i = 0; i < count; ++i)
+                    {
+                        const TraceEvent& event = chunk->events[i];
+                        if(!first)
+                            buffer += ',';
+                        first = false;
+
+                        buffer += "{\"name\":";
+                        if(event.name.empty())
+                            appendJsonString(buffer, event.category, std::strlen(event.category));
+                        else
+                            appendJsonString(buffer, event.name.data(), event.name.size());
+                        buffer += ",\"cat\":";
+                        appendJsonString(buffer, event.category, std::strlen(event.category));
+                        //timestamps are in microseconds
+                        int length = std::snprintf(text, sizeof(text), ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                                                   event.begin / 1000.0, event.duration / 1000.0, trace->id);
+                        buffer.append(text, length);
+
+                        if(out && buffer.size() >= (1 << 16))
+                        {
+                            out->write(buffer.data(), buffer.size());
+                            buffer.clear();
+                        }
+                    }
+                }
+            }
+            buffer += "]}";
+            if(out)
+            {
+                out->write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+    }//namespace internal
+
+    void setTracing(bool enabled)
+    {
+        internal::tracing.store(enabled);
+    }
+
+    bool isTracing()
+    {
+        return internal::tracing.load();
+    }
+
+    void writeTraceJson(std::ostream& out)
+    {
+        std::string buffer;
+        internal::writeTraceEvents(buffer, &out);
+    }
+
+    void writeTraceJson(std::string& buffer)
+    {
+        internal::writeTraceEvents(buffer, nullptr);
+    }
+
+    void clearTrace()
+    {
+        std::lock_guard<std::mutex> lock(internal::traceThreadsMutex);
+        for(internal::ThreadTrace* trace : internal::traceThreads)
+        {
+            internal::TraceChunk* chunk = trace->first->next.load();
+            while(chunk)
+            {
+                internal::TraceChunk* next = chunk->next.load();
+                delete chunk;
+                chunk = next;
+            }
+            trace->first->next.store(nullptr);
+            trace->first->count.store(0);
+            trace->last = trace->first;
+        }
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for recording and replaying calls
+
+        //The address of this is the registry key of the State's Recorder userdata while it is recording.
+        static const char recorderKey = 0;
+        //the number of States recording, so the others skip looking for a Recorder
+        std::atomic <int> recordingStates(0);
+
+        //A recording is "SLR" and a version byte followed by records, in the order the calls finished.  Each record
+        //is the kind (the Recorder flags), the name, the start time relative to the start of the recording and the duration
+        //in nanoseconds, and the arguments and results (the error for a failed call).  Both are counted lists of
+        //sized binary values, with integers in little endian.
+        static const char recordingMagic[3] = {'S', 'L', 'R'};
+        static const unsigned char recordingVersion = 1;
+
+        static void appendLittleEndian(std::string& out, std::uint64_t n, int bytes)
+        {
+            for(int i = 0; i < bytes; ++i)
+                out += static_cast<char>((n >> (8 * i)) & 0xff);
+        }
+
+        struct Recorder
+        {
+            //the kind of a record is a combination of these; 0 is a successful call()
+            enum Flags
+            {
+                native = 1,
+                failed = 2,
+                environment = 4
+            };
+
+            std::ofstream out;
+            std::uint64_t start;
+            std::string buffer;
+
+            void appendValues(const std::vector <Object>& values)
+            {
+                appendLittleEndian(buffer, values.size(), 4);
+                for(const Object& value : values)
+                {
+                    std::size_t size = buffer.size();
+                    appendLittleEndian(buffer, 0, 4);
+                    try
+                    {
+                        writeBinary(value, buffer);
+                    }
+                    catch(const std::exception&)
+                    {
+                        //values that cannot be serialized, such as functions, are recorded as nil
+                        buffer.resize(size + 4);
+                        writeBinary(Object(), buffer);
+                    }
+                    std::uint64_t written = buffer.size() - size - 4;
+                    for(int i = 0; i < 4; ++i)
+                        buffer[size + i] = static_cast<char>((written >> (8 * i)) & 0xff);
+                }
+            }
+
+            void write(int kind, const char* name, const std::vector <Object>& args, const std::vector <Object>& results,
+                       std::uint64_t begin, std::uint64_t end)
+            {
+                buffer += static_cast<char>(kind);
+                std::size_t nameSize = std::strlen(name);
+                appendLittleEndian(buffer, nameSize, 4);
+                buffer.append(name, nameSize);
+                appendLittleEndian(buffer, begin - start, 8);
+                appendLittleEndian(buffer, end - begin, 8);
+                appendValues(args);
+                appendValues(results);
+                if(buffer.size() >= (1 << 16))
+                    flush();
+            }
+
+            void flush()
+            {
+                out.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        };
+
+        static int collectRecorder(lua_State* state)
+        {
+            Recorder* recorder = static_cast<Recorder*>(lua_touserdata(state, 1));
+            if(recorder->out.is_open())
+            {
+                recorder->flush();
+                --recordingStates;
+            }
+            recorder->~Recorder();
+            return 0;
+        }
+
+        static Recorder* getRecorder(lua_State* state)
+        {
+            if(recordingStates.load(std::memory_order_relaxed) == 0)
+                return nullptr;
+            growStack(state, 1);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &recorderKey);
+            Recorder* recorder = static_cast<Recorder*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            return recorder;
+        }
+
+        //Converts count values starting at index, recording nil for values that have no Object form.
+        static std::vector <Object> recordValues(lua_State* state, int index, int count)
+        {
+            std::vector <Object> values(count);
+            for(int i = 0; i < count; ++i)
+            {
+                int type = lua_type(state, index + i);
+                if(type == LUA_TUSERDATA || type == LUA_TLIGHTUSERDATA || type == LUA_TTHREAD)
+                    continue;
+                try
+                {
+                    values[i] = GetStackVar<Object>()(state, index + i);
+                }
+                catch(const std::exception&)
+                {
+                }
+            }
+            return values;
+        }
+
+        //Returns the name the running native function was called by, or an empty string.
+        static const char* getNativeName(lua_State* state)
+        {
+            lua_Debug ar;
+            if(lua_getstack(state, 0, &ar) && lua_getinfo(state, "n", &ar) && ar.name)
+                return ar.name;
+            return "";
+        }
+
+        void NativeRecord::start()
+        {
+            try
+            {
+                recorder = getRecorder(state);
+                if(!recorder)
+                    return;
+                name = getNativeName(state);
+                args = recordValues(state, 1, lua_gettop(state));
+                begin = traceClock();
+            }
+            catch(...)
+            {
+                //the call is not recorded rather than failing
+                recorder = nullptr;
+            }
+        }
+
+        void NativeRecord::write(int results, const char* error)
+        {
+            std::uint64_t end = traceClock();
+            Recorder* target = static_cast<Recorder*>(recorder);
+            recorder = nullptr;
+            //the function may have stopped the recording
+            if(getRecorder(state) != target)
+                return;
+            try
+            {
+                if(error)
+                    target->write(Recorder::native | Recorder::failed, name.c_str(), args, std::vector <Object>(1, Object::makeString(error)), begin, end);
+                else
+                    target->write(Recorder::native, name.c_str(), args, recordValues(state, lua_gettop(state) - results + 1, results), begin, end);
+            }
+            catch(...)
+            {
+            }
+        }
+
+        //The address of this is the registry key of the light userdata pointing to the Replayer of a State
+        //replaying with recorded native results.
+        static const char replayerKey = 0;
+        std::atomic <int> replayingStates(0);
+
+        struct Replayer
+        {
+            //the recorded native calls of each function, in the order they finished
+            std::unordered_map <std::string, std::deque<const RecordedCall*>> natives;
+            std::size_t answered;
+            std::size_t unmatched;
+
+            Replayer()
+            : answered(0), unmatched(0)
+            {}
+        };
+
+        int pushReplayedResults(lua_State* state)
+        {
+            growStack(state, 1);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &replayerKey);
+            Replayer* replayer = static_cast<Replayer*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            //another State is replaying
+            if(!replayer)
+                return -1;
+
+            int top = lua_gettop(state);
+            bool failed = true;
+            {
+                try
+                {
+                    const char* name = getNativeName(state);
+                    const RecordedCall* found = nullptr;
+                    auto calls = replayer->natives.find(name);
+                    if(calls != replayer->natives.end())
+                    {
+                        std::vector <Object> args = recordValues(state, 1, top);
+                        for(auto it = calls->second.begin(); it != calls->second.end(); ++it)
+                        {
+                            const RecordedCall& call = **it;
+                            bool same = call.args.size() == args.size();
+                            for(std::size_t i = 0; same && i < args.size(); ++i)
+                                same = sameContents(call.args[i], args[i]);
+                            if(same)
+                            {
+                                found = &call;
+                                calls->second.erase(it);
+                                break;
+                            }
+                        }
+                    }
+
+                    if(!found)
+                    {
+                        ++replayer->unmatched;
+                        std::string message = std::string("Native function: no recorded call of ") + name + " matches";
+                        growStack(state, 1);
+                        lua_pushlstring(state, message.data(), message.size());
+                    }
+                    else
+                    {
+                        ++replayer->answered;
+                        growStack(state, static_cast<int>(found->results.size()) + 1);
+                        for(const Object& result : found->results)
+                            pushVar(state, result);
+                        failed = found->failed;
+                    }
+                }
+                catch(...)
+                {
+                    lua_settop(state, top);
+                    lua_pushliteral(state, "Native function: the recorded results cannot be replayed");
+                    failed = true;
+                }
+            }
+            //no C++ object may be alive here, since Lua does not unwind the C++ stack
+            if(failed)
+                return lua_error(state);
+            return lua_gettop(state) - top;
+        }
+
+        //Reads a recording; see recordingMagic for the format.
+        class RecordingReader
+        {
+            const std::string& data;
+            std::size_t p;
+
+            void need(std::size_t bytes) const
+            {
+                if(data.size() - p < bytes)
+                    throw parse_error("lua::readRecording - the recording is truncated");
+            }
+
+        public:
+            explicit RecordingReader(const std::string& data)
+            : data(data), p(0)
+            {
+                need(4);
+                if(data.compare(0, 3, recordingMagic, 3) != 0)
+                    throw parse_error("lua::readRecording - not a recording");
+                if(static_cast<unsigned char>(data[3]) != recordingVersion)
+                    throw parse_error("lua::readRecording - unsupported version");
+                p = 4;
+            }
+
+            bool atEnd() const
+            {
+                return p == data.size();
+            }
+
+            std::uint64_t readLittleEndian(int bytes)
+            {
+                need(bytes);
+                std::uint64_t n = 0;
+                for(int i = 0; i < bytes; ++i)
+                    n |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[p + i])) << (8 * i);
+                p += bytes;
+                return n;
+            }
+
+            std::string readString()
+            {
+                std::size_t size = readLittleEndian(4);
+                need(size);
+                std::string s = data.substr(p, size);
+                p += size;
+                return s;
+            }
+
+            std::vector <Object> readValues()
+            {
+                std::size_t count = readLittleEndian(4);
+                std::vector <Object> values;
+                for(std::size_t i = 0; i < count; ++i)
+                {
+                    std::size_t size = readLittleEndian(4);
+                    need(size);
+                    values.push_back(readBinary(data.data() + p, size));
+                    p += size;
+                }
+                return values;
+            }
+        };
+
+        //Calls the call() calls of a recording again for State::replay.
+        static void replayCalls(lua_State* state, const std::vector <RecordedCall>& calls, ReplayStats& stats)
+        {
+            for(const RecordedCall& call : calls)
+            {
+                if(call.native || call.environment)
+                    continue;
+
+                ++stats.calls;
+                stats.recorded += call.duration;
+
+                growStack(state, static_cast<int>(call.args.size()) + 1);
+                lua_getglobal(state, call.function.c_str());
+                for(const Object& arg : call.args)
+                    pushVar(state, arg);
+
+                auto begin = std::chrono::steady_clock::now();
+                try
+                {
+                    std::vector <Object> results = callLuaFunction(state, static_cast<int>(call.args.size()), nullptr);
+                    stats.replayed += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+
+                    bool same = !call.failed && results.size() == call.results.size();
+                    for(std::size_t i = 0; same && i < results.size(); ++i)
+                        same = sameContents(results[i], call.results[i]);
+                    if(!same)
+                        ++stats.mismatches;
+                }
+                catch(const script_error&)
+                {
+                    stats.replayed += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+                    ++stats.failures;
+                    if(!call.failed)
+                        ++stats.mismatches;
+                }
+            }
+        }
+    }//namespace internal
+
+    void State::startRecording(const std::string& filename)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::startRecording");
+
+        stopRecording();
+
+        internal::growStack(state, 3);
+        void* memory = lua_newuserdata(state, sizeof(internal::Recorder));
+        internal::Recorder* recorder = new (memory) internal::Recorder();
+        if(luaL_newmetatable(state, "Simplua.Recorder"))
+        {
+            lua_pushcfunction(state, internal::collectRecorder);
+            lua_setfield(state, -2, "__gc");
+        }
+        lua_setmetatable(state, -2);
+
+        recorder->out.open(filename, std::ios::binary | std::ios::trunc);
+        if(!recorder->out.is_open())
+        {
+            lua_pop(state, 1);
+            throw std::runtime_error("lua::State::startRecording - cannot open " + filename);
+        }
+        recorder->buffer.append(internal::recordingMagic, 3);
+        recorder->buffer += static_cast<char>(internal::recordingVersion);
+        recorder->start = internal::traceClock();
+        ++internal::recordingStates;
+        lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::recorderKey);
+    }
+
+    void State::stopRecording()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::stopRecording");
+
+        internal::growStack(state, 1);
+        lua_rawgetp(state, LUA_REGISTRYINDEX, &internal::recorderKey);
+        internal::Recorder* recorder = static_cast<internal::Recorder*>(lua_touserdata(state, -1));
+        lua_pop(state, 1);
+        if(!recorder)
+            return;
+
+        lua_pushnil(state);
+        lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::recorderKey);
+        recorder->flush();
+        recorder->out.close();
+        --internal::recordingStates;
+    }
+
+    std::vector <RecordedCall> readRecording(const std::string& filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if(!in.is_open())
+            throw std::runtime_error("lua::readRecording - cannot open " + filename);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        internal::RecordingReader reader(data);
+        std::vector <RecordedCall> calls;
+        while(!reader.atEnd())
+        {
+            RecordedCall call;
+            std::uint64_t kind = reader.readLittleEndian(1);
+            call.native = (kind & internal::Recorder::native) != 0;
+            call.failed = (kind & internal::Recorder::failed) != 0;
+            call.environment = (kind & internal::Recorder::environment) != 0;
+            if(kind > 7 || (call.native && call.environment))
+                throw parse_error("lua::readRecording - invalid record");
+            call.function = reader.readString();
+            call.time = std::chrono::nanoseconds(reader.readLittleEndian(8));
+            call.duration = std::chrono::nanoseconds(reader.readLittleEndian(8));
+            call.args = reader.readValues();
+            call.results = reader.readValues();
+            calls.push_back(std::move(call));
+        }
+        return calls;
+    }
+
+    ReplayStats State::replay(const std::string& filename, bool recordedNatives)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::replay");
+
+        std::vector <RecordedCall> calls = readRecording(filename);
+        internal::Replayer replayer;
+        if(recordedNatives)
+        {
+            for(const RecordedCall& call : calls)
+                if(call.native)
+                    replayer.natives[call.function].push_back(&call);
+            internal::growStack(state, 1);
+            lua_pushlightuserdata(state, &replayer);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::replayerKey);
+            ++internal::replayingStates;
+        }
+        auto finish = [&]()
+        {
+            if(!recordedNatives)
+                return;
+            lua_pushnil(state);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::replayerKey);
+            --internal::replayingStates;
+        };
+
+        ReplayStats stats = ReplayStats();
+        try
+        {
+            internal::replayCalls(state, calls, stats);
+        }
+        catch(...)
+        {
+            finish();
+            throw;
+        }
+        finish();
+        stats.natives = replayer.answered;
+        stats.unmatched = replayer.unmatched;
+        return stats;
+    }
+
+
+
+    namespace internal
+    {
+        //Helper functions for buffers
+
+        //The userdata of a buffer.  The elements of a buffer owned by Lua follow this header in the same allocation.
+        struct BufferBlock
+        {
+            void* data;
+            std::size_t size;
+            BufferType type;
+        };
+
+        static const char* const bufferName = "Simplua.Buffer";
+        //the elements of a buffer owned by Lua start at this offset, so they are aligned for any element type
+        static const std::size_t bufferHeaderSize = (sizeof(BufferBlock) + 15) / 16 * 16;
+
+        static std::size_t getElementSize(BufferType type)
+        {
+            switch(type)
+            {
+                case BufferType::uint8:
+                case BufferType::int8:
+                    return 1;
+                case BufferType::uint16:
+                case BufferType::int16:
+                    return 2;
+                case BufferType::uint32:
+                case BufferType::int32:
+                case BufferType::float32:
+                    return 4;
+                case BufferType::float64:
+                default:
+                    return 8;
+            }
+        }
+
+        static BufferBlock* toBufferBlock(lua_State* state, int index)
+        {
+            return static_cast<BufferBlock*>(luaL_testudata(state, index, bufferName));
+        }
+
+        template <typename T>
+        static lua_Number loadElement(const void* data, std::size_t i)
+        {
+            return static_cast<lua_Number>(static_cast<const T*>(data)[i]);
+        }
+
+        static lua_Number loadElement(const BufferBlock* block, std::size_t i)
+        {
+            switch(block->type)
+            {
+                case BufferType::uint8:
+                    return loadElement<std::uint8_t>(block->data, i);
+                case BufferType::int8:
+                    return loadElement<std::int8_t>(block->data, i);
+                case BufferType::uint16:
+                    return loadElement<std::uint16_t>(block->data, i);
+                case BufferType::int16:
+                    return loadElement<std::int16_t>(block->data, i);
+                case BufferType::uint32:
+                    return loadElement<std::uint32_t>(block->data, i);
+                case BufferType::int32:
+                    return loadElement<std::int32_t>(block->data, i);
+                case BufferType::float32:
+                    return loadElement<float>(block->data, i);
+                case BufferType::float64:
+                default:
+                    return loadElement<double>(block->data, i);
+            }
+        }
+
+        //Returns false if n cannot be represented by an integral T.
+        template <typename T>
+        static bool storeElement(void* data, std::size_t i, lua_Number n)
+        {
+            if(std::numeric_limits<T>::is_integer && (n != std::floor(n) ||
+                n < static_cast<lua_Number>(std::numeric_limits<T>::min()) || n > static_cast<lua_Number>(std::numeric_limits<T>::max())))
+                return false;
+            static_cast<T*>(data)[i] = static_cast<T>(n);
+            return true;
+        }
+
+        static bool storeElement(BufferBlock* block, std::size_t i, lua_Number n)
+        {
+            switch(block->type)
+            {
+                case BufferType::uint8:
+                    return storeElement<std::uint8_t>(block->data, i, n);
+                case BufferType::int8:
+                    return storeElement<std::int8_t>(block->data, i, n);
+                case BufferType::uint16:
+                    return storeElement<std::uint16_t>(block->data, i, n);
+                case BufferType::int16:
+                    return storeElement<std::int16_t>(block->data, i, n);
+                case BufferType::uint32:
+                    return storeElement<std::uint32_t>(block->data, i, n);
+                case BufferType::int32:
+                    return storeElement<std::int32_t>(block->data, i, n);
+                case BufferType::float32:
+                    return storeElement<float>(block->data, i, n);
+                case BufferType::float64:
+                default:
+                    return storeElement<double>(block->data, i, n);
+            }
+        }
+
+        //Returns the 0-based position of the 1-based index at stack index 2, or size if it is out of range.
+        static std::size_t bufferPosition(lua_State* state, const BufferBlock* block)
+        {
+            int isNumber = 0;
+            lua_Number i = lua_tonumberx(state, 2, &isNumber);
+            if(!isNumber || !(i >= 1) || i > static_cast<lua_Number>(block->size) || i != std::floor(i))
+                return block->size;
+            return static_cast<std::size_t>(i) - 1;
+        }
+
+        static int bufferIndex(lua_State* state)
+        {
+            BufferBlock* block = toBufferBlock(state, 1);
+            std::size_t i = bufferPosition(state, block);
+            if(i == block->size)
+                lua_pushnil(state);
+            else
+                lua_pushnumber(state, loadElement(block, i));
+            return 1;
+        }
+
+        static int bufferNewIndex(lua_State* state)
+        {
+            BufferBlock* block = toBufferBlock(state, 1);
+            std::size_t i = bufferPosition(state, block);
+            if(i == block->size)
+                return luaL_error(state, "buffer index out of range");
+            if(!storeElement(block, i, luaL_checknumber(state, 3)))
+                return luaL_error(state, "number does not fit in the buffer's element type");
+            return 0;
+        }
+
+        static int bufferLen(lua_State* state)
+        {
+            lua_pushnumber(state, static_cast<lua_Number>(toBufferBlock(state, 1)->size));
+            return 1;
+        }
+
+        //Pushes a buffer.  If data is null, the buffer owns size zeroed elements.
+        static BufferBlock* pushBuffer(lua_State* state, void* data, std::size_t size, BufferType type)
+        {
+            static const luaL_Reg metamethods[] =
+            {
+                {"__index", bufferIndex},
+                {"__newindex", bufferNewIndex},
+                {"__len", bufferLen},
+                {nullptr, nullptr}
+            };
+
+            std::size_t bytes = sizeof(BufferBlock);
+            if(!data)
+            {
+                if(size > (std::numeric_limits<std::size_t>::max() - bufferHeaderSize) / getElementSize(type))
+                    throw std::bad_alloc();
+                bytes = bufferHeaderSize + size * getElementSize(type);
+            }
+
+            growStack(state, 3);
+            BufferBlock* block = static_cast<BufferBlock*>(lua_newuserdata(state, bytes));
+            block->data = data;
+            block->size = size;
+            block->type = type;
+            if(!data)
+            {
+                block->data = reinterpret_cast<char*>(block) + bufferHeaderSize;
+                std::memset(block->data, 0, size * getElementSize(type));
+            }
+            if(luaL_newmetatable(state, bufferName))
+                luaL_setfuncs(state, metamethods, 0);
+            lua_setmetatable(state, -2);
+            return block;
+        }
+
+        Buffer GetStackVar<Buffer>::operator()(lua_State* state, int index) const
+        {
+            BufferBlock* block = toBufferBlock(state, index);
+            if(!block)
+                throw type_mismatch("lua::GetStackVar<Buffer>");
+            return Buffer(block->data, block->size, block->type);
+        }
+    }//namespace internal
+
+    Buffer::Buffer()
+    : data(nullptr), size(0), type(BufferType::uint8)
+    {
+    }
+
+    Buffer::Buffer(void* data, std::size_t size, BufferType type)
+    : data(data), size(size), type(type)
+    {
+    }
+
+    void* Buffer::getData() const
+    {
+        return data;
+    }
+
+    std::size_t Buffer::getSize() const
+    {
+        return size;
+    }
+
+    BufferType Buffer::getType() const
+    {
+        return type;
+    }
+
+    void State::setBuffer(const std::string& name, void* data, std::size_t size, BufferType type)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::setBuffer");
+        if(!data && size)
+            throw std::invalid_argument("lua::State::setBuffer - data is null");
+
+        //an empty host buffer still needs a pointer to tell it apart from one owned by Lua
+        static char empty;
+        internal::pushBuffer(state, data ? data : &empty, size, type);
+        assignVariable(state, name);
+    }
+
+    Buffer State::newBuffer(const std::string& name, BufferType type, std::size_t size)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::newBuffer");
+
+        internal::BufferBlock* block = internal::pushBuffer(state, nullptr, size, type);
+        Buffer buffer(block->data, block->size, block->type);
+        assignVariable(state, name);
+        return buffer;
+    }
+
+    Buffer State::getBuffer(const std::string& name) const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::getBuffer");
+
+        pushVariable(state, name);
+        internal::BufferBlock* block = internal::toBufferBlock(state, -1);
+        lua_pop(state, 1);
+        if(!block)
+            throw type_mismatch("lua::State::getBuffer");
+        return Buffer(block->data, block->size, block->type);
+    }
+
+
+    void State::setChannel(const std::string& name, const std::shared_ptr<Channel>& channel)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::setChannel");
+
+        static const luaL_Reg functions[] =
+        {
+            {"send", internal::channelSend},
+            {"try_send", internal::channelTrySend},
+            {"recv", internal::channelReceive},
+            {"try_recv", internal::channelTryReceive},
+            {nullptr, nullptr}
+        };
+
+        internal::growStack(state, 2);
+        lua_createtable(state, 0, 4);
+        internal::pushShared(state, channel, "Simplua.Channel");
+        luaL_setfuncs(state, functions, 1);
+        assignVariable(state, name);
+    }
+
+
+    Channel::Channel(std::size_t capacity)
+    : mask(0), sendPosition(0), receivePosition(0)
+    {
+        std::size_t size = 2;
+        while(size < capacity)
+            size *= 2;
+
+        cells.reset(new Cell[size]);
+        for(std::size_t i = 0; i < size; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        mask = size - 1;
+    }
+
+    std::size_t Channel::getCapacity() const
+    {
+        return mask + 1;
+    }
+
+    //Each cell's sequence number says whose turn it is: it equals the position while the cell
+    //is free for that position's sender, and the position + 1 once the value can be received.
+    bool Channel::trySendBinary(std::string& data)
+    {
+        std::size_t position = sendPosition.load(std::memory_order_relaxed);
+        Cell* cell;
+        for(;;)
+        {
+            cell = &cells[position & mask];
+            std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence - position);
+            if(difference == 0)
+            {
+                if(sendPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if(difference < 0)
+                return false;
+            else
+                position = sendPosition.load(std::memory_order_relaxed);
+        }
+
+        cell->data = std::move(data);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Channel::tryReceiveBinary(std::string& data)
+    {
+        std::size_t position = receivePosition.load(std::memory_order_relaxed);
+        Cell* cell;
+        for(;;)
+        {
+            cell = &cells[position & mask];
+            std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if(difference == 0)
+            {
+                if(receivePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if(difference < 0)
+                return false;
+            else
+                position = receivePosition.load(std::memory_order_relaxed);
+        }
+
+        data = std::move(cell->data);
+        cell->data.clear();
+        cell->sequence.store(position + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Channel::trySend(const Object& obj)
+    {
+        std::string data;
+        writeBinary(obj, data);
+        return trySendBinary(data);
+    }
+
+    bool Channel::tryReceive(Object& obj)
+    {
+        std::string data;
+        if(!tryReceiveBinary(data))
+            return false;
+        obj = readBinary(data.data(), data.size());
+        return true;
+    }
+
+    void Channel::sendBinary(std::string data)
+    {
+        internal::Backoff backoff;
+        while(!trySendBinary(data))
+            backoff.wait();
+    }
+
+    void Channel::send(const Object& obj)
+    {
+        std::string data;
+        writeBinary(obj, data);
+        sendBinary(std::move(data));
+    }
+
+    std::string Channel::receiveBinary()
+    {
+        std::string data;
+        internal::Backoff backoff;
+        while(!tryReceiveBinary(data))
+            backoff.wait();
+        return data;
+    }
+
+    Object Channel::receive()
+    {
+        std::string data = receiveBinary();
+        return readBinary(data.data(), data.size());
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for parallelMap
+
+        //Calls the function below its nargs arguments, leaving its first result on the stack.
+        static void callForResult(lua_State* state, int nargs)
+        {
+            if(lua_pcall(state, nargs, 1, 0) != LUA_OK)
+            {
+                Object err = GetStackVar<Object>()(state, -1);
+                lua_pop(state, 1);
+                std::stringstream ss;
+                ss << "lua::State::call - " << err;
+                throw script_error(ss.str());
+            }
+        }
+
+        //A range of element indices owned by one worker.  The owner takes chunks from the
+        //front; thieves take the back half.
+        struct WorkRange
+        {
+            std::mutex mutex;
+            std::size_t begin;
+            std::size_t end;
+        };
+
+        class ParallelMap
+        {
+            const std::string& script;
+            const std::string& function;
+            const std::vector <Object>& inputs;
+            void (*setup)(State&);
+            bool chunks;
+
+            std::size_t grain;
+            std::vector <std::unique_ptr<WorkRange>> ranges;
+            std::vector <Object> results;
+
+            std::atomic <bool> failed;
+            std::mutex errorMutex;
+            std::exception_ptr error;
+
+            //Takes the next chunk for worker, stealing if its own range is empty.
+            bool take(std::size_t worker, std::size_t& begin, std::size_t& end)
+            {
+                WorkRange& own = *ranges[worker];
+                for(;;)
+                {
+                    {
+                        std::lock_guard <std::mutex> lock(own.mutex);
+                        if(own.begin < own.end)
+                        {
+                            begin = own.begin;
+                            end = std::min(own.begin + grain, own.end);
+                            own.begin = end;
+                            return true;
+                        }
+                    }
+
+                    //steal half of the largest remaining range
+                    std::size_t victim = worker;
+                    std::size_t largest = 0;
+                    for(std::size_t i = 0; i < ranges.size(); ++i)
+                    {
+                        std::lock_guard <std::mutex> lock(ranges[i]->mutex);
+                        if(ranges[i]->end - ranges[i]->begin > largest)
+                        {
+                            largest = ranges[i]->end - ranges[i]->begin;
+                            victim = i;
+                        }
+                    }
+                    if(largest == 0 || failed)
+                        return false;
+
+                    std::size_t stolenBegin, stolenEnd;
+                    {
+                        std::lock_guard <std::mutex> lock(ranges[victim]->mutex);
+                        WorkRange& other = *ranges[victim];
+                        if(other.begin >= other.end)
+                            continue;
+                        stolenBegin = other.begin + (other.end - other.begin) / 2;
+                        stolenEnd = other.end;
+                        other.end = stolenBegin;
+                    }
+
+                    //a range of one element cannot be split, so take it whole
+                    if(stolenBegin == stolenEnd)
+                        continue;
+
+                    std::lock_guard <std::mutex> lock(own.mutex);
+                    own.begin = stolenBegin;
+                    own.end = stolenEnd;
+                }
+            }
+
+            void run(std::size_t worker)
+            {
+                try
+                {
+                    State state;
+                    state.loadLibLazy(Lib::all);
+                    if(setup)
+                        setup(state);
+                    state.loadFile(script);
+                    state.run();
+
+                    lua_State* L = state.get();
+                    std::size_t begin, end;
+                    while(!failed && take(worker, begin, end))
+                    {
+                        if(!chunks)
+                        {
+                            for(std::size_t i = begin; i < end; ++i)
+                            {
+                                growStack(L, 2);
+                                lua_getglobal(L, function.c_str());
+                                pushVar(L, inputs[i]);
+                                callForResult(L, 1);
+                                results[i] = GetStackVar<Object>()(L, -1);
+                                lua_pop(L, 1);
+                            }
+                            continue;
+                        }
+
+                        growStack(L, 3);
+                        lua_getglobal(L, function.c_str());
+                        lua_createtable(L, end - begin, 0);
+                        for(std::size_t i = begin; i < end; ++i)
+                        {
+                            pushVar(L, inputs[i]);
+                            lua_rawseti(L, -2, i - begin + 1);
+                        }
+                        callForResult(L, 1);
+                        if(!lua_istable(L, -1))
+                            throw type_mismatch("lua::parallelMapChunks - the function must return a table");
+                        for(std::size_t i = begin; i < end; ++i)
+                        {
+                            lua_rawgeti(L, -1, i - begin + 1);
+                            results[i] = GetStackVar<Object>()(L, -1);
+                            lua_pop(L, 1);
+                        }
+                        lua_pop(L, 1);
+                    }
+                }
+                catch(...)
+                {
+                    std::lock_guard <std::mutex> lock(errorMutex);
+                    if(!error)
+                        error = std::current_exception();
+                    failed = true;
+                }
+            }
+
+        public:
+            ParallelMap(const std::string& script, const std::string& function, const std::vector <Object>& inputs,
+                        void (*setup)(State&), bool chunks)
+            : script(script), function(function), inputs(inputs), setup(setup), chunks(chunks),
+              grain(1), results(inputs.size()), failed(false)
+            {}
+
+            std::vector <Object> operator()(unsigned threads)
+            {
+                if(inputs.empty())
+                    return std::move(results);
+
+                if(threads == 0)
+                    threads = std::max(1u, std::thread::hardware_concurrency());
+                threads = static_cast<unsigned>(std::min<std::size_t>(threads, inputs.size()));
+
+                //enough chunks per worker to balance, but few enough to keep the overhead low
+                grain = std::max<std::size_t>(1, std::min<std::size_t>(inputs.size() / (threads * 16), 4096));
+
+                for(unsigned i = 0; i < threads; ++i)
+                {
+                    ranges.push_back(std::unique_ptr<WorkRange>(new WorkRange));
+                    ranges[i]->begin = inputs.size() * i / threads;
+                    ranges[i]->end = inputs.size() * (i + 1) / threads;
+                }
+
+                std::vector <std::thread> workers;
+                for(unsigned i = 1; i < threads; ++i)
+                    workers.push_back(std::thread(&ParallelMap::run, this, i));
+                run(0);
+                for(auto& worker : workers)
+                    worker.join();
+
+                if(error)
+                    std::rethrow_exception(error);
+                return std::move(results);
+            }
+        };
+    }//namespace internal
+
+    std::vector <Object> parallelMap(const std::string& script, const std::string& function, const std::vector <Object>& inputs,
+                                     unsigned threads, void (*setup)(State&))
+    {
+        return internal::ParallelMap(script, function, inputs, setup, false)(threads);
+    }
+
+    std::vector <Object> parallelMapChunks(const std::string& script, const std::string& function, const std::vector <Object>& inputs,
+                                           unsigned threads, void (*setup)(State&))
+    {
+        return internal::ParallelMap(script, function, inputs, setup, true)(threads);
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for State::watch
+
+        //The address of this is the registry key of the list of watched tables.  Each entry is
+        //{name, contents, dirty}, where dirty holds the keys assigned since the last collectChanges.
+        static const char watchListKey = 0;
+
+        //The fields of a watched table's original metatable that are moved to its contents table.  The rest stay on the
+        //table's new metatable.
+        static const char* const watchContentsFields[] = {"__index", "__newindex", "__len", "__mode"};
+
+        static bool isWatchContentsField(lua_State* state, int index)
+        {
+            if(lua_type(state, index) != LUA_TSTRING)
+                return false;
+            const char* key = lua_tostring(state, index);
+            for(const char* field : watchContentsFields)
+                if(std::strcmp(key, field) == 0)
+                    return true;
+            return false;
+        }
+
+        //The metamethods of a watched table.  Upvalue 1 is its contents table; for __newindex, upvalue 2 is its dirty table.
+        static int watchNewIndex(lua_State* state)
+        {
+            lua_pushvalue(state, 2);
+            lua_pushboolean(state, 1);
+            lua_rawset(state, lua_upvalueindex(2));
+            //not raw, so the table's original metatable still applies
+            lua_settable(state, lua_upvalueindex(1));
+            return 0;
+        }
+
+        static int watchLen(lua_State* state)
+        {
+            lua_len(state, lua_upvalueindex(1));
+            return 1;
+        }
+
+        static int watchNext(lua_State* state)
+        {
+            lua_settop(state, 2);
+            if(lua_next(state, 1))
+                return 2;
+            lua_pushnil(state);
+            return 1;
+        }
+
+        static int watchPairs(lua_State* state)
+        {
+            lua_pushcfunction(state, watchNext);
+            lua_pushvalue(state, lua_upvalueindex(1));
+            lua_pushnil(state);
+            return 3;
+        }
+
+        static int watchIpairsNext(lua_State* state)
+        {
+            lua_Integer i = lua_tointeger(state, 2) + 1;
+            lua_pushinteger(state, i);
+            lua_rawgeti(state, 1, i);
+            return lua_isnil(state, -1) ? 1 : 2;
+        }
+
+        static int watchIpairs(lua_State* state)
+        {
+            lua_pushcfunction(state, watchIpairsNext);
+            lua_pushvalue(state, lua_upvalueindex(1));
+            lua_pushinteger(state, 0);
+            return 3;
+        }
+    }//namespace internal
+
+    void State::watch(const std::string& name)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::watch");
+
+        int top = lua_gettop(state);
+        pushVariable(state, name);
+        int table = lua_gettop(state);
+        if(!lua_istable(state, table))
+        {
+            lua_settop(state, top);
+            throw type_mismatch("lua::State::watch");
+        }
+        if(internal::contentsIndex(state, table) != table)
+        {
+            lua_settop(state, top);
+            return;
+        }
+
+        internal::growStack(state, 8);
+        //move everything into the contents table, leaving the table empty so every assignment reaches __newindex
+        lua_newtable(state);
+        int contents = lua_gettop(state);
+        lua_pushnil(state);
+        while(lua_next(state, table) != 0)
+        {
+            lua_pushvalue(state, -2);
+            lua_insert(state, -2);
+            lua_rawset(state, contents);
+            //removing the key while traversing is allowed
+            lua_pushvalue(state, -1);
+            lua_pushnil(state);
+            lua_rawset(state, table);
+        }
+        int original = 0;
+        if(lua_getmetatable(state, table))
+        {
+            //__index, __newindex, __len, and __mode apply to the contents, through the watch metamethods
+            original = lua_gettop(state);
+            lua_createtable(state, 0, 4);
+            for(const char* field : internal::watchContentsFields)
+            {
+                lua_getfield(state, original, field);
+                lua_setfield(state, -2, field);
+            }
+            lua_setmetatable(state, contents);
+        }
+
+        lua_newtable(state);
+        int dirty = lua_gettop(state);
+
+        lua_newtable(state);
+        if(original)
+        {
+            //the other metamethods (__call, __tostring, __eq, arithmetic, __gc...) apply to the table itself
+            lua_pushnil(state);
+            while(lua_next(state, original) != 0)
+            {
+                if(!internal::isWatchContentsField(state, -2))
+                {
+                    lua_pushvalue(state, -2);
+                    lua_insert(state, -2);
+                    lua_rawset(state, -4);
+                }
+                else
+                    lua_pop(state, 1);
+            }
+        }
+        lua_pushvalue(state, contents);
+        lua_setfield(state, -2, "__index");
+        lua_pushvalue(state, contents);
+        lua_pushvalue(state, dirty);
+        lua_pushcclosure(state, internal::watchNewIndex, 2);
+        lua_setfield(state, -2, "__newindex");
+        const luaL_Reg metamethods[] =
+        {
+            {"__len", internal::watchLen},
+            {"__pairs", internal::watchPairs},
+            {"__ipairs", internal::watchIpairs},
+            {nullptr, nullptr}
+        };
+        lua_pushvalue(state, contents);
+        luaL_setfuncs(state, metamethods, 1);
+        lua_pushvalue(state, contents);
+        lua_rawsetp(state, -2, &internal::watchedContentsKey);
+        lua_setmetatable(state, table);
+
+        lua_rawgetp(state, LUA_REGISTRYINDEX, &internal::watchListKey);
+        if(lua_isnil(state, -1))
+        {
+            lua_pop(state, 1);
+            lua_newtable(state);
+            lua_pushvalue(state, -1);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::watchListKey);
+        }
+        lua_createtable(state, 3, 0);
+        lua_pushlstring(state, name.data(), name.size());
+        lua_rawseti(state, -2, 1);
+        lua_pushvalue(state, contents);
+        lua_rawseti(state, -2, 2);
+        lua_pushvalue(state, dirty);
+        lua_rawseti(state, -2, 3);
+        lua_rawseti(state, -2, lua_rawlen(state, -2) + 1);
+
+        lua_settop(state, top);
+    }
+
+    std::vector <Change> State::collectChanges()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::collectChanges");
+
+        std::vector <Change> changes;
+        int top = lua_gettop(state);
+        internal::growStack(state, 8);
+        lua_rawgetp(state, LUA_REGISTRYINDEX, &internal::watchListKey);
+        int list = lua_gettop(state);
+        std::size_t count = lua_istable(state, list) ? lua_rawlen(state, list) : 0;
+
+        try
+        {
+            for(std::size_t i = 1; i <= count; ++i)
+            {
+                lua_rawgeti(state, list, i);
+                int watched = lua_gettop(state);
+                lua_rawgeti(state, watched, 1);
+                lua_rawgeti(state, watched, 2);
+                lua_rawgeti(state, watched, 3);
+                int contents = watched + 2;
+                int dirty = watched + 3;
+
+                std::size_t size;
+                const char* name = lua_tolstring(state, watched + 1, &size);
+                lua_pushnil(state);
+                while(lua_next(state, dirty) != 0)
+                {
+                    lua_pop(state, 1);
+                    Change change;
+                    change.table.assign(name, size);
+                    change.key = internal::GetStackVar<Object>()(state, -1);
+                    lua_pushvalue(state, -1);
+                    lua_rawget(state, contents);
+                    change.value = internal::GetStackVar<Object>()(state, -1);
+                    lua_pop(state, 1);
+                    changes.push_back(std::move(change));
+                }
+                lua_settop(state, list);
+            }
+        }
+        catch(...)
+        {
+            //nothing has been cleared, so the changes will be reported again
+            lua_settop(state, top);
+            throw;
+        }
+
+        //everything was converted, so now the dirty sets can be emptied
+        for(std::size_t i = 1; i <= count; ++i)
+        {
+            lua_rawgeti(state, list, i);
+            lua_rawgeti(state, -1, 3);
+            int dirty = lua_gettop(state);
+            lua_pushnil(state);
+            while(lua_next(state, dirty) != 0)
+            {
+                lua_pop(state, 1);
+                lua_pushvalue(state, -1);
+                lua_pushnil(state);
+                lua_rawset(state, dirty);
+            }
+            lua_settop(state, list);
+        }
+
+        lua_settop(state, top);
+        return changes;
+    }
+
+    namespace internal
+    {
+        //Helper functions for ModuleArchive
+
+        //The archive format is a header ("SLA", a version byte, and the module count), an index of 24-byte
+        //entries sorted by hash (hash, name offset, name size, chunk offset, chunk size), then the names and chunks.
+        //All numbers are little endian, and offsets are from the start of the file.
+        static const char archiveMagic[3] = {'S', 'L', 'A'};
+        static const unsigned char archiveVersion = 1;
+        static const std::size_t archiveHeaderSize = 8;
+        static const std::size_t archiveEntrySize = 24;
+
+        static std::uint64_t hashModuleName(const char* name, std::size_t size)
+        {
+            std::uint64_t hash = 14695981039346656037ULL;
+            for(std::size_t i = 0; i < size; ++i)
+            {
+                hash ^= static_cast<unsigned char>(name[i]);
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        static std::uint64_t readLittleEndian(const char* p, int bytes)
+        {
+            std::uint64_t value = 0;
+            for(int i = bytes - 1; i >= 0; --i)
+                value = (value << 8) | static_cast<unsigned char>(p[i]);
+            return value;
+        }
+
+        static void putLittleEndian(std::string& out, std::uint64_t value, int bytes)
+        {
+            for(int i = 0; i < bytes; ++i)
+                out += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+
+        //package.searchers entry; upvalue 1 holds the archive.
+        static int archiveSearcher(lua_State* state)
+        {
+            std::size_t size;
+            const char* name = luaL_checklstring(state, 1, &size);
+            StringSlice chunk = getShared<const ModuleArchive>(state, lua_upvalueindex(1)).find(name, size);
+            if(!chunk.data)
+            {
+                lua_pushfstring(state, "\n\tno module '%s' in archive", name);
+                return 1;
+            }
+
+            const char* chunkName = lua_pushfstring(state, "@%s", name);
+            if(luaL_loadbufferx(state, chunk.data, chunk.size, chunkName, "bt") != LUA_OK)
+                return luaL_error(state, "error loading module '%s' from archive:\n\t%s", name, lua_tostring(state, -1));
+            lua_pushvalue(state, 1);
+            return 2;
+        }
+    }//namespace internal
+
+    void State::setModuleArchive(const std::shared_ptr<const ModuleArchive>& archive)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::setModuleArchive");
+
+        int top = lua_gettop(state);
+        internal::growStack(state, 4);
+        //this also opens the package library if it is loaded lazily
+        lua_getglobal(state, "package");
+        if(lua_istable(state, -1))
+            lua_getfield(state, -1, "searchers");
+        if(!lua_istable(state, -1))
+        {
+            lua_settop(state, top);
+            throw uninitialized_resource("lua::State::setModuleArchive");
+        }
+
+        int searchers = lua_gettop(state);
+        for(int i = lua_rawlen(state, searchers); i >= 2; --i)
+        {
+            lua_rawgeti(state, searchers, i);
+            lua_rawseti(state, searchers, i + 1);
+        }
+        internal::pushShared(state, archive, "Simplua.ModuleArchive");
+        lua_pushcclosure(state, internal::archiveSearcher, 1);
+        lua_rawseti(state, searchers, 2);
+        lua_settop(state, top);
+    }
+
+
+    ModuleArchive::ModuleArchive(const std::string& filename)
+    : data(nullptr), size(0), count(0), mapped(false)
+    {
+#ifndef _WIN32
+        int file = open(filename.c_str(), O_RDONLY);
+        if(file < 0)
+            throw std::runtime_error("lua::ModuleArchive - cannot open " + filename);
+        struct stat info;
+        if(fstat(file, &info) == 0 && info.st_size > 0)
+        {
+            void* memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if(memory != MAP_FAILED)
+            {
+                data = static_cast<const char*>(memory);
+                size = info.st_size;
+                mapped = true;
+            }
+        }
+        close(file);
+#endif
+        if(!mapped)
+        {
+            std::ifstream in(filename, std::ios::binary);
+            if(!in.is_open())
+                throw std::runtime_error("lua::ModuleArchive - cannot open " + filename);
+            std::stringstream ss;
+            ss << in.rdbuf();
+            contents = ss.str();
+            data = contents.data();
+            size = contents.size();
+        }
+
+        //everything is checked once here, so find never reads outside the file
+        try
+        {
+            if(size < internal::archiveHeaderSize || std::memcmp(data, internal::archiveMagic, 3) != 0)
+                throw parse_error("lua::ModuleArchive - not a module archive");
+            if(static_cast<unsigned char>(data[3]) != internal::archiveVersion)
+                throw parse_error("lua::ModuleArchive - unsupported version");
+            count = internal::readLittleEndian(data + 4, 4);
+            if(count > (size - internal::archiveHeaderSize) / internal::archiveEntrySize)
+                throw parse_error("lua::ModuleArchive - truncated index");
+
+            std::uint64_t previous = 0;
+            for(std::size_t i = 0; i < count; ++i)
+            {
+                const char* entry = data + internal::archiveHeaderSize + i * internal::archiveEntrySize;
+                std::uint64_t hash = internal::readLittleEndian(entry, 8);
+                std::uint64_t nameOffset = internal::readLittleEndian(entry + 8, 4);
+                std::uint64_t nameSize = internal::readLittleEndian(entry + 12, 4);
+                std::uint64_t chunkOffset = internal::readLittleEndian(entry + 16, 4);
+                std::uint64_t chunkSize = internal::readLittleEndian(entry + 20, 4);
+                if(i > 0 && hash < previous)
+                    throw parse_error("lua::ModuleArchive - index is not sorted");
+                if(nameOffset + nameSize > size || chunkOffset + chunkSize > size)
+                    throw parse_error("lua::ModuleArchive - entry outside the file");
+                if(hash != internal::hashModuleName(data + nameOffset, nameSize))
+                    throw parse_error("lua::ModuleArchive - wrong hash");
+                previous = hash;
+            }
+        }
+        catch(...)
+        {
+#ifndef _WIN32
+            if(mapped)
+                munmap(const_cast<char*>(data), size);
+#endif
+            throw;
+        }
+    }
+
+    ModuleArchive::~ModuleArchive()
+    {
+#ifndef _WIN32
+        if(mapped)
+            munmap(const_cast<char*>(data), size);
+#endif
+    }
+
+    StringSlice ModuleArchive::find(const char* name, std::size_t nameSize) const
+    {
+        std::uint64_t hash = internal::hashModuleName(name, nameSize);
+        const char* index = data + internal::archiveHeaderSize;
+
+        //find the first entry with the hash, then compare the names of all entries with it
+        std::size_t low = 0;
+        std::size_t high = count;
+        while(low < high)
+        {
+            std::size_t middle = low + (high - low) / 2;
+            if(internal::readLittleEndian(index + middle * internal::archiveEntrySize, 8) < hash)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for(; low < count; ++low)
+        {
+            const char* entry = index + low * internal::archiveEntrySize;
+            if(internal::readLittleEndian(entry, 8) != hash)
+                break;
+            std::size_t entryNameSize = internal::readLittleEndian(entry + 12, 4);
+            if(entryNameSize == nameSize && std::memcmp(data + internal::readLittleEndian(entry + 8, 4), name, nameSize) == 0)
+            {
+                StringSlice chunk = {data + internal::readLittleEndian(entry + 16, 4), static_cast<std::size_t>(internal::readLittleEndian(entry + 20, 4))};
+                return chunk;
+            }
+        }
+
+        StringSlice none = {nullptr, 0};
+        return none;
+    }
+
+    std::size_t ModuleArchive::getModuleCount() const
+    {
+        return count;
+    }
+
+    void writeModuleArchive(const std::string& filename, const std::vector <std::pair<std::string, std::string>>& modules)
+    {
+        struct Entry
+        {
+            std::uint64_t hash;
+            const std::string* name;
+            std::string chunk;
+        };
+
+        std::vector <Entry> entries(modules.size());
+        State compiler;
+        for(std::size_t i = 0; i < modules.size(); ++i)
+        {
+            compiler.loadFile(modules[i].second);
+            internal::dumpFunction(compiler.get(), entries[i].chunk);
+            lua_pop(compiler.get(), 1);
+            entries[i].name = &modules[i].first;
+            entries[i].hash = internal::hashModuleName(modules[i].first.data(), modules[i].first.size());
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b)
+        {
+            return a.hash < b.hash || (a.hash == b.hash && *a.name < *b.name);
+        });
+        for(std::size_t i = 1; i < entries.size(); ++i)
+            if(*entries[i].name == *entries[i - 1].name)
+                throw std::invalid_argument("lua::writeModuleArchive - duplicate module " + *entries[i].name);
+
+        std::string out(internal::archiveMagic, 3);
+        out += static_cast<char>(internal::archiveVersion);
+        internal::putLittleEndian(out, entries.size(), 4);
+
+        std::size_t offset = internal::archiveHeaderSize + entries.size() * internal::archiveEntrySize;
+        for(auto& entry : entries)
+        {
+            internal::putLittleEndian(out, entry.hash, 8);
+            internal::putLittleEndian(out, offset, 4);
+            internal::putLittleEndian(out, entry.name->size(), 4);
+            internal::putLittleEndian(out, offset + entry.name->size(), 4);
+            internal::putLittleEndian(out, entry.chunk.size(), 4);
+            offset += entry.name->size() + entry.chunk.size();
+        }
+        if(offset > 0xffffffffULL)
+            throw std::runtime_error("lua::writeModuleArchive - archive too large");
+        for(auto& entry : entries)
+        {
+            out += *entry.name;
+            out += entry.chunk;
+        }
+
+        std::ofstream file(filename, std::ios::binary);
+        if(!file.write(out.data(), out.size()))
+            throw std::runtime_error("lua::writeModuleArchive - cannot write " + filename);
+    }
+
+    namespace internal
+    {
+        //Helper function for State::loadFiles; upvalue 1 is an array of the chunks.
+        static int runChunks(lua_State* state)
+        {
+            lua_settop(state, 0);
+            int count = lua_rawlen(state, lua_upvalueindex(1));
+            for(int i = 1; i <= count; ++i)
+            {
+                lua_settop(state, 0);
+                lua_rawgeti(state, lua_upvalueindex(1), i);
+                lua_call(state, 0, i == count ? LUA_MULTRET : 0);
+            }
+            return lua_gettop(state);
+        }
+    }//namespace internal
+
+    std::vector <std::string> compileFiles(const std::vector <std::string>& filenames, unsigned threads, const std::string& mode)
+    {
+        if(mode != "b" && mode != "t" && mode != "bt" && mode != "tb")
+            throw std::invalid_argument("lua::compileFiles");
+
+        std::vector <std::string> chunks(filenames.size());
+        std::vector <std::string> errors(filenames.size());
+        std::atomic <std::size_t> next(0);
+
+        auto compile = [&]()
+        {
+            State compiler;
+            lua_State* L = compiler.get();
+            for(std::size_t i = next++; i < filenames.size(); i = next++)
+            {
+                try
+                {
+                    compiler.loadFile(filenames[i], mode);
+                    internal::dumpFunction(L, chunks[i]);
+                }
+                catch(const std::exception& e)
+                {
+                    //readFile does not name the file
+                    errors[i] = filenames[i] + ": " + e.what();
+                }
+                lua_settop(L, 0);
+            }
+        };
+
+        if(threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = static_cast<unsigned>(std::min<std::size_t>(threads, filenames.size()));
+
+        std::vector <std::thread> workers;
+        for(unsigned i = 1; i < threads; ++i)
+            workers.push_back(std::thread(compile));
+        compile();
+        for(auto& worker : workers)
+            worker.join();
+
+        std::string message;
+        for(auto& error : errors)
+            if(!error.empty())
+                message += "\n" + error;
+        if(!message.empty())
+            throw compile_error("lua::compileFiles -" + message);
+
+        return chunks;
+    }
+
+    void State::loadFiles(const std::vector <std::string>& filenames, unsigned threads, const std::string& mode)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::loadFiles");
+
+        std::vector <std::string> chunks = compileFiles(filenames, threads, mode);
+
+        int top = lua_gettop(state);
+        internal::growStack(state, 3);
+        lua_createtable(state, chunks.size(), 0);
+        for(std::size_t i = 0; i < chunks.size(); ++i)
+        {
+            if(luaL_loadbufferx(state, chunks[i].data(), chunks[i].size(), filenames[i].c_str(), "b") != LUA_OK)
+            {
+                Object err = internal::GetStackVar<Object>()(state, -1);
+                lua_settop(state, top);
+                std::stringstream ss;
+                ss << "lua::State::loadFiles - " << err;
+                throw compile_error(ss.str());
+            }
+            lua_rawseti(state, -2, i + 1);
+        }
+        lua_pushcclosure(state, internal::runChunks, 1);
+
+        for(auto& filename : filenames)
+            internal::rememberFile(state, filename, mode);
+    }
+
+    struct ScriptReloader::Watcher
+    {
+        struct File
+        {
+            std::string name;
+            std::string mode;
+            std::string directory;
+            std::string base;
+            long long modified;
+        };
+
+        struct Reload
+        {
+            std::string filename;
+            std::string chunk;
+            std::string error;
+        };
+
+        std::vector <File> files;
+        std::mutex mutex;
+        std::vector <Reload> pending;
+        std::atomic <bool> stop;
+        std::thread thread;
+
+        static long long modificationTime(const std::string& filename)
+        {
+            struct stat info;
+            if(stat(filename.c_str(), &info) != 0)
+                return -1;
+            return static_cast<long long>(info.st_mtime);
+        }
+
+        void compile(const File& file)
+        {
+            Reload reload;
+            reload.filename = file.name;
+            try
+            {
+                State compiler;
+                compiler.loadFile(file.name, file.mode);
+                internal::dumpFunction(compiler.get(), reload.chunk);
+            }
+            catch(const std::exception& e)
+            {
+                reload.error = file.name + ": " + e.what();
+            }
+
+            //only the newest version of a file is kept
+            std::lock_guard <std::mutex> lock(mutex);
+            pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const Reload& r) { return r.filename == file.name; }),
+                          pending.end());
+            pending.push_back(std::move(reload));
+        }
+
+        void poll()
+        {
+            while(!stop)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                for(auto& file : files)
+                {
+                    long long modified = modificationTime(file.name);
+                    if(modified != file.modified && modified != -1)
+                    {
+                        file.modified = modified;
+                        compile(file);
+                    }
+                }
+            }
+        }
+
+#ifdef __linux__
+        int notify;
+        std::map <int, std::string> directories;
+#endif
+
+        //Starts watching before the thread starts, so no change made after the constructor returns is missed.
+        void start()
+        {
+#ifdef __linux__
+            //directories are watched rather than files, since editors often replace a file instead of writing to it
+            notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if(notify >= 0)
+            {
+                for(auto& file : files)
+                {
+                    int wd = inotify_add_watch(notify, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+                    if(wd >= 0)
+                        directories[wd] = file.directory;
+                }
+            }
+#endif
+            stop = false;
+            thread = std::thread(&Watcher::run, this);
+        }
+
+        void run()
+        {
+#ifdef __linux__
+            if(notify >= 0)
+            {
+                alignas(struct inotify_event) char buffer[4096];
+                while(!stop)
+                {
+                    pollfd descriptor = {notify, POLLIN, 0};
+                    if(::poll(&descriptor, 1, 100) <= 0)
+                        continue;
+
+                    ssize_t size = read(notify, buffer, sizeof(buffer));
+                    for(ssize_t offset = 0; offset < size; )
+                    {
+                        const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                        offset += sizeof(inotify_event) + event->len;
+                        if(event->len == 0)
+                            continue;
+
+                        auto directory = directories.find(event->wd);
+                        for(auto& file : files)
+                            if(directory != directories.end() && file.directory == directory->second && file.base == event->name)
+                                compile(file);
+                    }
+                }
+
+                close(notify);
+                return;
+            }
+#endif
+            poll();
+        }
+    };
+
+    ScriptReloader::ScriptReloader(State& state, void (*before)(State&, const std::string&), void (*after)(State&, const std::string&))
+    : state(state), before(before), after(after), watcher(new Watcher)
+    {
+        lua_State* L = state.get();
+        if(!L)
+            throw uninitialized_resource("lua::ScriptReloader");
+
+        internal::growStack(L, 3);
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &internal::loadedFilesKey);
+        if(lua_istable(L, -1))
+        {
+            lua_pushnil(L);
+            while(lua_next(L, -2) != 0)
+            {
+                Watcher::File file;
+                file.name = lua_tostring(L, -2);
+                file.mode = lua_tostring(L, -1);
+                std::size_t slash = file.name.find_last_of("/\\");
+                file.directory = slash == std::string::npos ? "." : file.name.substr(0, slash + 1);
+                file.base = slash == std::string::npos ? file.name : file.name.substr(slash + 1);
+                file.modified = Watcher::modificationTime(file.name);
+                watcher->files.push_back(std::move(file));
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+
+        watcher->start();
+    }
+
+    ScriptReloader::~ScriptReloader()
+    {
+        watcher->stop = true;
+        watcher->thread.join();
+    }
+
+    std::size_t ScriptReloader::applyReloads()
+    {
+        std::vector <Watcher::Reload> reloads;
+        {
+            std::lock_guard <std::mutex> lock(watcher->mutex);
+            reloads.swap(watcher->pending);
+        }
+
+        lua_State* L = state.get();
+        std::string compileErrors;
+        std::string runErrors;
+        std::size_t count = 0;
+        for(auto& reload : reloads)
+        {
+            if(!reload.error.empty())
+            {
+                compileErrors += "\n" + reload.error;
+                continue;
+            }
+
+            if(before)
+                before(state, reload.filename);
+            internal::growStack(L, 1);
+            if(luaL_loadbufferx(L, reload.chunk.data(), reload.chunk.size(), reload.filename.c_str(), "b") != LUA_OK ||
+               lua_pcall(L, 0, 0, 0) != LUA_OK)
+            {
+                Object err = internal::GetStackVar<Object>()(L, -1);
+                lua_pop(L, 1);
+                std::stringstream ss;
+                ss << "\n" << reload.filename << ": " << err;
+                runErrors += ss.str();
+                continue;
+            }
+            ++count;
+            if(after)
+                after(state, reload.filename);
+        }
+
+        if(!runErrors.empty())
+            throw script_error("lua::ScriptReloader::applyReloads -" + compileErrors + runErrors);
+        if(!compileErrors.empty())
+            throw compile_error("lua::ScriptReloader::applyReloads -" + compileErrors);
+        return count;
+    }
+
+
+    //A multiple-producer, single-consumer queue: a linked list that senders append to with one atomic exchange.
+    struct Actor::Mailbox
+    {
+        struct Message
+        {
+            std::atomic <Message*> next;
+            //an empty task stops the thread
+            std::function<void(State&)> task;
+        };
+
+        //senders append at head; the actor's thread reads after tail, which is the last message it took (or a stub)
+        std::atomic <Message*> head;
+        Message* tail;
+        //set while the actor's thread is about to sleep, so senders only touch the mutex when it is needed
+        std::atomic <bool> waiting;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::thread thread;
+
+        Mailbox()
+        : head(new Message), waiting(false)
+        {
+            tail = head.load();
+            tail->next = nullptr;
+        }
+
+        ~Mailbox()
+        {
+            while(tail)
+            {
+                Message* next = tail->next.load();
+                delete tail;
+                tail = next;
+            }
+        }
+
+        void push(Message* message)
+        {
+            message->next.store(nullptr, std::memory_order_relaxed);
+            Message* previous = head.exchange(message, std::memory_order_acq_rel);
+            //Sequentially consistent, paired with sleep: either the actor's thread sees the message
+            //before sleeping or the sender sees that it is waiting.
+            previous->next.store(message);
+            if(waiting.load())
+            {
+                std::lock_guard <std::mutex> lock(mutex);
+                wakeup.notify_one();
+            }
+        }
+
+        //Returns the next message, or nullptr if there is none yet.  The message stays in the list as the new tail.
+        Message* pop()
+        {
+            Message* next = tail->next.load();
+            if(!next)
+                return nullptr;
+            delete tail;
+            tail = next;
+            return next;
+        }
+
+        void sleep()
+        {
+            std::unique_lock <std::mutex> lock(mutex);
+            waiting.store(true);
+            while(!tail->next.load())
+                wakeup.wait(lock);
+            waiting.store(false);
+        }
+
+        void run(State& state)
+        {
+            for(;;)
+            {
+                //run everything that has arrived before sleeping again
+                while(Message* message = pop())
+                {
+                    std::function<void(State&)> task = std::move(message->task);
+                    if(!task)
+                        return;
+                    task(state);
+                }
+                sleep();
+            }
+        }
+    };
+
+    Actor::Actor(void (*setup)(State&))
+    : mailbox(new Mailbox)
+    {
+        auto ready = std::make_shared<std::promise<void>>();
+        std::future <void> started = ready->get_future();
+        Mailbox* box = mailbox.get();
+        box->thread = std::thread([box, setup, ready]()
+        {
+            State state;
+            try
+            {
+                if(setup)
+                    setup(state);
+                ready->set_value();
+            }
+            catch(...)
+            {
+                ready->set_exception(std::current_exception());
+                return;
+            }
+            box->run(state);
+        });
+
+        try
+        {
+            started.get();
+        }
+        catch(...)
+        {
+            box->thread.join();
+            throw;
+        }
+    }
+
+    Actor::~Actor()
+    {
+        //an empty task
+        post(std::function<void(State&)>());
+        mailbox->thread.join();
+    }
+
+    void Actor::post(std::function<void(State&)> task)
+    {
+        Mailbox::Message* message = new Mailbox::Message;
+        message->task = std::move(task);
+        mailbox->push(message);
+    }
+
+    std::future <void> Actor::setVariable(const std::string& name, const Object& object)
+    {
+        auto promise = std::make_shared<std::promise<void>>();
+        std::future <void> result = promise->get_future();
+        post([=](State& state)
+        {
+            try
+            {
+                state.setVariable(name, object);
+                promise->set_value();
+            }
+            catch(...)
+            {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return result;
+    }
+
+    std::future <Object> Actor::getVariable(const std::string& name)
+    {
+        auto promise = std::make_shared<std::promise<Object>>();
+        std::future <Object> result = promise->get_future();
+        post([=](State& state)
+        {
+            try
+            {
+                promise->set_value(state.getVariable(name));
+            }
+            catch(...)
+            {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return result;
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for Scheduler
+
+        //The address of this is the registry key of the light userdata pointing to a worker State's Scheduler::Pool::Worker.
+        static const char schedulerWorkerKey = 0;
+    }//namespace internal
+
+    struct Scheduler::Pool
+    {
+        struct NewTask
+        {
+            TaskId id;
+            std::string function;
+            Object argument;
+        };
+
+        struct Resume
+        {
+            TaskId id;
+            //the registry reference of the task's coroutine
+            int thread;
+            //nil if the task yielded rather than parked
+            bool hasValue;
+            Object value;
+        };
+
+        struct Worker
+        {
+            Pool* pool;
+            unsigned index;
+            State state;
+
+            //the task being resumed, if any
+            lua_State* current;
+            TaskId currentId;
+            bool parking;
+
+            //protects the queues
+            std::mutex mutex;
+            std::condition_variable wakeup;
+            //new tasks can be stolen; resumed tasks must run here
+            std::deque <NewTask> fresh;
+            std::deque <Resume> resumes;
+            std::atomic <std::size_t> freshCount;
+            //set while the worker waits for wakeup; stealable is set when it is woken to steal
+            bool sleeping;
+            bool stealable;
+            std::thread thread;
+
+            Worker(Pool* pool, unsigned index)
+            : pool(pool), index(index), current(nullptr), currentId(0), parking(false), freshCount(0),
+              sleeping(false), stealable(false)
+            {}
+        };
+
+        enum class Status
+        {
+            queued,
+            running,
+            parked
+        };
+
+        struct Task
+        {
+            Status status;
+            unsigned worker;
+            int thread;
+            //set if wake was called before the task parked
+            bool woken;
+            Object value;
+        };
+
+        //tasks are spread over several maps so spawning and finishing tasks on different workers rarely contend
+        struct Shard
+        {
+            std::mutex mutex;
+            std::unordered_map <TaskId, Task> tasks;
+        };
+
+        static const std::size_t shardCount = 16;
+
+        Shard shards[shardCount];
+        std::vector <std::unique_ptr<Worker>> workers;
+        std::atomic <TaskId> nextId;
+        std::atomic <unsigned> nextWorker;
+        std::atomic <bool> stop;
+        std::atomic <unsigned> sleepers;
+
+        //tasks that are queued or running; waitIdle waits for this to reach 0
+        std::atomic <std::size_t> active;
+        std::atomic <std::size_t> parked;
+        std::atomic <std::size_t> steals;
+        std::atomic <std::size_t> completed;
+        std::atomic <std::size_t> failed;
+        std::mutex idleMutex;
+        std::condition_variable idle;
+
+        std::mutex errorMutex;
+        std::vector <std::string> errors;
+
+        Pool()
+        : nextId(1), nextWorker(0), stop(false), sleepers(0), active(0), parked(0), steals(0), completed(0), failed(0)
+        {}
+
+        Shard& shard(TaskId id)
+        {
+            return shards[id % shardCount];
+        }
+
+        void deactivate()
+        {
+            if(--active == 0)
+            {
+                std::lock_guard <std::mutex> lock(idleMutex);
+                idle.notify_all();
+            }
+        }
+
+        //Wakes one sleeping worker other than busy so it steals from the busiest worker.
+        void wakeThief(Worker& busy)
+        {
+            for(auto& other : workers)
+            {
+                if(other.get() == &busy)
+                    continue;
+                std::lock_guard <std::mutex> lock(other->mutex);
+                if(other->sleeping && !other->stealable)
+                {
+                    other->stealable = true;
+                    other->wakeup.notify_one();
+                    return;
+                }
+            }
+        }
+
+        void queue(Worker& worker, NewTask task)
+        {
+            bool busy;
+            {
+                std::lock_guard <std::mutex> lock(worker.mutex);
+                worker.fresh.push_back(std::move(task));
+                ++worker.freshCount;
+                busy = !worker.sleeping;
+                if(!busy)
+                    worker.wakeup.notify_one();
+            }
+            //freshCount is raised before sleepers is read, and a worker going to sleep does the opposite (see run),
+            //so either the task is seen before sleeping or the sleeper is seen here
+            if(busy && sleepers > 0)
+                wakeThief(worker);
+        }
+
+        //Returns true if another worker has new tasks that worker could steal.
+        bool canSteal(const Worker& worker) const
+        {
+            for(auto& other : workers)
+                if(other.get() != &worker && other->freshCount > 0)
+                    return true;
+            return false;
+        }
+
+        void queue(Worker& worker, Resume resume)
+        {
+            std::lock_guard <std::mutex> lock(worker.mutex);
+            worker.resumes.push_back(std::move(resume));
+            worker.wakeup.notify_one();
+        }
+
+        TaskId spawn(Worker* worker, const std::string& function, const Object& argument)
+        {
+            NewTask task = {nextId++, function, argument};
+            {
+                Shard& s = shard(task.id);
+                std::lock_guard <std::mutex> lock(s.mutex);
+                Task& t = s.tasks[task.id];
+                t.status = Status::queued;
+                t.worker = 0;
+                t.thread = LUA_NOREF;
+                t.woken = false;
+            }
+            ++active;
+
+            TaskId id = task.id;
+            //tasks spawned by a task stay on its worker until they are stolen
+            if(worker)
+                queue(*worker, std::move(task));
+            else
+                queue(*workers[nextWorker++ % workers.size()], std::move(task));
+            return id;
+        }
+
+        //Moves half of the new tasks of the worker with the most to worker.
+        bool steal(Worker& worker)
+        {
+            Worker* victim = nullptr;
+            std::size_t most = 0;
+            for(auto& other : workers)
+            {
+                std::size_t count = other->freshCount;
+                if(other.get() != &worker && count > most)
+                {
+                    victim = other.get();
+                    most = count;
+                }
+            }
+            if(!victim)
+                return false;
+
+            std::deque <NewTask> taken;
+            {
+                std::lock_guard <std::mutex> lock(victim->mutex);
+                std::size_t n = (victim->fresh.size() + 1) / 2;
+                //the owner takes from the front, so the thief takes from the back
+                for(std::size_t i = 0; i < n; ++i)
+                {
+                    taken.push_front(std::move(victim->fresh.back()));
+                    victim->fresh.pop_back();
+                }
+                victim->freshCount -= n;
+            }
+            if(taken.empty())
+                return false;
+
+            std::lock_guard <std::mutex> lock(worker.mutex);
+            worker.freshCount += taken.size();
+            for(auto& task : taken)
+                worker.fresh.push_back(std::move(task));
+            ++steals;
+            return true;
+        }
+
+        void resume(Worker& worker, TaskId id, lua_State* thread, int reference, int nargs)
+        {
+            worker.current = thread;
+            worker.currentId = id;
+            worker.parking = false;
+            int status = lua_resume(thread, nullptr, nargs);
+            worker.current = nullptr;
+            worker.currentId = 0;
+
+            if(status == LUA_YIELD)
+            {
+                lua_settop(thread, 0);
+                if(!worker.parking)
+                {
+                    Resume again = {id, reference, false, Object()};
+                    queue(worker, std::move(again));
+                    return;
+                }
+
+                Shard& s = shard(id);
+                std::unique_lock <std::mutex> lock(s.mutex);
+                Task& t = s.tasks[id];
+                if(t.woken)
+                {
+                    t.woken = false;
+                    Resume woken = {id, reference, true, std::move(t.value)};
+                    t.value = Object();
+                    lock.unlock();
+                    queue(worker, std::move(woken));
+                }
+                else
+                {
+                    t.status = Status::parked;
+                    ++parked;
+                    lock.unlock();
+                    deactivate();
+                }
+                return;
+            }
+
+            if(status == LUA_OK)
+                ++completed;
+            else
+            {
+                Object err = internal::GetStackVar<Object>()(thread, -1);
+                std::stringstream ss;
+                ss << "task " << id << ": " << err;
+                std::lock_guard <std::mutex> lock(errorMutex);
+                errors.push_back(ss.str());
+                ++failed;
+            }
+            lua_settop(thread, 0);
+            luaL_unref(worker.state.get(), LUA_REGISTRYINDEX, reference);
+            {
+                Shard& s = shard(id);
+                std::lock_guard <std::mutex> lock(s.mutex);
+                s.tasks.erase(id);
+            }
+            deactivate();
+        }
+
+        void start(Worker& worker, NewTask& task)
+        {
+            lua_State* L = worker.state.get();
+            internal::growStack(L, 1);
+            lua_State* thread = lua_newthread(L);
+            int reference = luaL_ref(L, LUA_REGISTRYINDEX);
+            {
+                Shard& s = shard(task.id);
+                std::lock_guard <std::mutex> lock(s.mutex);
+                Task& t = s.tasks[task.id];
+                t.status = Status::running;
+                t.worker = worker.index;
+                t.thread = reference;
+            }
+
+            lua_getglobal(thread, task.function.c_str());
+            internal::pushVar(thread, task.argument);
+            resume(worker, task.id, thread, reference, 1);
+        }
+
+        void run(Worker& worker)
+        {
+            lua_State* L = worker.state.get();
+            while(!stop)
+            {
+                bool found = false;
+                NewTask task;
+                Resume resumed;
+                bool isResume = false;
+                {
+                    std::unique_lock <std::mutex> lock(worker.mutex);
+                    if(!worker.resumes.empty())
+                    {
+                        resumed = std::move(worker.resumes.front());
+                        worker.resumes.pop_front();
+                        found = isResume = true;
+                    }
+                    else if(!worker.fresh.empty())
+                    {
+                        task = std::move(worker.fresh.front());
+                        worker.fresh.pop_front();
+                        --worker.freshCount;
+                        found = true;
+                    }
+                }
+
+                if(!found)
+                {
+                    if(steal(worker))
+                        continue;
+                    std::unique_lock <std::mutex> lock(worker.mutex);
+                    if(worker.resumes.empty() && worker.fresh.empty() && !stop)
+                    {
+                        //new tasks queued on a busy worker wake a sleeping one to steal them (see queue)
+                        worker.sleeping = true;
+                        ++sleepers;
+                        if(!canSteal(worker))
+                        {
+                            worker.wakeup.wait(lock, [&]()
+                            {
+                                return !worker.resumes.empty() || !worker.fresh.empty() || worker.stealable || stop;
+                            });
+                        }
+                        --sleepers;
+                        worker.sleeping = false;
+                        worker.stealable = false;
+                    }
+                    continue;
+                }
+
+                if(!isResume)
+                {
+                    start(worker, task);
+                    continue;
+                }
+
+                internal::growStack(L, 1);
+                lua_rawgeti(L, LUA_REGISTRYINDEX, resumed.thread);
+                lua_State* thread = lua_tothread(L, -1);
+                lua_pop(L, 1);
+                if(resumed.hasValue)
+                    internal::pushVar(thread, resumed.value);
+                resume(worker, resumed.id, thread, resumed.thread, resumed.hasValue ? 1 : 0);
+            }
+        }
+
+        static Worker* getWorker(lua_State* state)
+        {
+            internal::growStack(state, 1);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &internal::schedulerWorkerKey);
+            Worker* worker = static_cast<Worker*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            return worker;
+        }
+
+        //The functions of the scheduler table other than park.
+        static int yield(lua_State* state)
+        {
+            Worker* worker = getWorker(state);
+            if(!worker || worker->current != state)
+                return luaL_error(state, "scheduler.yield - not called from a task");
+            return lua_yield(state, 0);
+        }
+
+        static int spawnFromLua(lua_State* state)
+        {
+            Worker* worker = getWorker(state);
+            const char* function = luaL_checkstring(state, 1);
+            return internal::protect(state, [&]()
+            {
+                Object argument = internal::GetStackVar<Object>()(state, 2);
+                lua_pushnumber(state, static_cast<lua_Number>(worker->pool->spawn(worker, function, argument)));
+                return 1;
+            });
+        }
+
+        static int id(lua_State* state)
+        {
+            lua_pushnumber(state, static_cast<lua_Number>(currentTask(state)));
+            return 1;
+        }
+    };
+
+    Scheduler::Scheduler(unsigned threads, void (*setup)(State&))
+    : pool(new Pool)
+    {
+        static const luaL_Reg functions[] =
+        {
+            {"park", Scheduler::park},
+            {"yield", Pool::yield},
+            {"spawn", Pool::spawnFromLua},
+            {"id", Pool::id},
+            {nullptr, nullptr}
+        };
+
+        if(threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        for(unsigned i = 0; i < threads; ++i)
+        {
+            pool->workers.emplace_back(new Pool::Worker(pool.get(), i));
+            lua_State* L = pool->workers.back()->state.get();
+            if(!L)
+                throw std::bad_alloc();
+            pool->workers.back()->state.loadLibLazy(Lib::all);
+            lua_pushlightuserdata(L, pool->workers.back().get());
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &internal::schedulerWorkerKey);
+            luaL_newlib(L, functions);
+            lua_setglobal(L, "scheduler");
+        }
+
+        //setup runs on the workers' own threads, which wait for all of them before taking tasks
+        std::vector <std::future<void>> ready;
+        std::shared_future <void> go;
+        auto start = std::make_shared<std::promise<void>>();
+        go = start->get_future().share();
+        for(auto& worker : pool->workers)
+        {
+            auto promise = std::make_shared<std::promise<void>>();
+            ready.push_back(promise->get_future());
+            Pool* p = pool.get();
+            Pool::Worker* w = worker.get();
+            worker->thread = std::thread([p, w, setup, promise, go]()
+            {
+                try
+                {
+                    if(setup)
+                        setup(w->state);
+                    promise->set_value();
+                }
+                catch(...)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+                go.wait();
+                p->run(*w);
+            });
+        }
+
+        std::exception_ptr error;
+        for(auto& r : ready)
+        {
+            try
+            {
+                r.get();
+            }
+            catch(...)
+            {
+                if(!error)
+                    error = std::current_exception();
+            }
+        }
+        if(error)
+            pool->stop = true;
+        start->set_value();
+        if(error)
+        {
+            for(auto& worker : pool->workers)
+                worker->thread.join();
+            std::rethrow_exception(error);
+        }
+    }
+
+    Scheduler::~Scheduler()
+    {
+        pool->stop = true;
+        for(auto& worker : pool->workers)
+        {
+            {
+                std::lock_guard <std::mutex> lock(worker->mutex);
+                worker->wakeup.notify_one();
+            }
+            worker->thread.join();
+        }
+    }
+
+    Scheduler::TaskId Scheduler::spawn(const std::string& function, const Object& argument)
+    {
+        return pool->spawn(nullptr, function, argument);
+    }
+
+    bool Scheduler::wake(TaskId task, const Object& value)
+    {
+        Pool::Shard& s = pool->shard(task);
+        std::unique_lock <std::mutex> lock(s.mutex);
+        auto it = s.tasks.find(task);
+        if(it == s.tasks.end())
+            return false;
+
+        Pool::Task& t = it->second;
+        if(t.status != Pool::Status::parked)
+        {
+            t.woken = true;
+            t.value = value;
+            return true;
+        }
+
+        t.status = Pool::Status::queued;
+        --pool->parked;
+        ++pool->active;
+        Pool::Resume resume = {task, t.thread, true, value};
+        unsigned worker = t.worker;
+        lock.unlock();
+        pool->queue(*pool->workers[worker], std::move(resume));
+        return true;
+    }
+
+    void Scheduler::waitIdle()
+    {
+        std::unique_lock <std::mutex> lock(pool->idleMutex);
+        pool->idle.wait(lock, [&]() { return pool->active == 0; });
+    }
+
+    SchedulerStats Scheduler::getStats() const
+    {
+        SchedulerStats stats;
+        for(auto& worker : pool->workers)
+        {
+            std::lock_guard <std::mutex> lock(worker->mutex);
+            stats.queueDepths.push_back(worker->fresh.size() + worker->resumes.size());
+        }
+        stats.parked = pool->parked;
+        stats.steals = pool->steals;
+        stats.completed = pool->completed;
+        stats.failed = pool->failed;
+        return stats;
+    }
+
+    std::vector <std::string> Scheduler::takeErrors()
+    {
+        std::vector <std::string> errors;
+        std::lock_guard <std::mutex> lock(pool->errorMutex);
+        errors.swap(pool->errors);
+        return errors;
+    }
+
+    int Scheduler::park(lua_State* state)
+    {
+        Pool::Worker* worker = Pool::getWorker(state);
+        if(!worker || worker->current != state)
+            return luaL_error(state, "scheduler.park - not called from a task");
+        worker->parking = true;
+        return lua_yield(state, 0);
+    }
+
+    Scheduler::TaskId Scheduler::currentTask(lua_State* state)
+    {
+        Pool::Worker* worker = Pool::getWorker(state);
+        if(!worker || worker->current != state)
+            return 0;
+        return worker->currentId;
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for asynchronous native functions
+
+        //The address of this is the registry key of the State's AsyncLoop userdata.
+        static const char asyncLoopKey = 0;
+        //The address of this is the registry key of the table mapping each task started by State::spawn to its
+        //reference in the registry.
+        static const char asyncTasksKey = 0;
+
+        struct AsyncLoop;
+
+        struct AsyncSlot : std::enable_shared_from_this<AsyncSlot>
+        {
+            std::mutex mutex;
+            std::condition_variable finished;
+            bool done;
+            bool failed;
+            std::function<int(lua_State*)> push;
+            std::string error;
+            //gets the result of a future; only used on the State's thread
+            std::function<bool(AsyncSlot&, bool)> poll;
+            //set when a task waits for the call
+            std::shared_ptr <AsyncLoop> loop;
+            int thread;
+
+            AsyncSlot()
+            : done(false), failed(false), thread(LUA_NOREF)
+            {}
+
+            void finish();
+        };
+
+        //The calls finished for a State's tasks, and the tasks that yielded, waiting for pollAsync.
+        struct AsyncLoop
+        {
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::vector <std::shared_ptr<AsyncSlot>> ready;
+            int eventFd;
+
+            //only used on the State's thread
+            std::vector <std::shared_ptr<AsyncSlot>> polling;
+            std::vector <int> yielded;
+            std::size_t tasks;
+            //set when a task yields to wait for a call rather than with coroutine.yield
+            bool awaiting;
+
+            AsyncLoop()
+            : eventFd(-1), tasks(0), awaiting(false)
+            {
+#ifdef __linux__
+                eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+            }
+
+            ~AsyncLoop()
+            {
+#ifdef __linux__
+                if(eventFd >= 0)
+                    close(eventFd);
+#endif
+            }
+
+            void post(const std::shared_ptr<AsyncSlot>& slot)
+            {
+                {
+                    std::lock_guard <std::mutex> lock(mutex);
+                    ready.push_back(slot);
+                    finished.notify_one();
+                }
+#ifdef __linux__
+                if(eventFd >= 0)
+                {
+                    std::uint64_t one = 1;
+                    if(write(eventFd, &one, sizeof(one)) < 0)
+                    {
+                        //the counter can only be full if nobody reads it, so the wakeup is not lost
+                    }
+                }
+#endif
+            }
+
+            void resetEvent()
+            {
+#ifdef __linux__
+                std::uint64_t count;
+                if(eventFd >= 0 && read(eventFd, &count, sizeof(count)) < 0)
+                {
+                    //nothing was signaled
+                }
+#endif
+            }
+        };
+
+        void AsyncSlot::finish()
+        {
+            std::shared_ptr <AsyncLoop> waiting;
+            {
+                std::lock_guard <std::mutex> lock(mutex);
+                waiting = loop;
+                finished.notify_all();
+            }
+            if(waiting)
+                waiting->post(shared_from_this());
+        }
+
+        void completeAsync(AsyncSlot& slot, std::function<int(lua_State*)> push)
+        {
+            {
+                std::lock_guard <std::mutex> lock(slot.mutex);
+                if(slot.done)
+                    return;
+                slot.done = true;
+                slot.push = std::move(push);
+            }
+            slot.finish();
+        }
+
+        void failAsync(AsyncSlot& slot, const std::string& error)
+        {
+            {
+                std::lock_guard <std::mutex> lock(slot.mutex);
+                if(slot.done)
+                    return;
+                slot.done = true;
+                slot.failed = true;
+                slot.error = error;
+            }
+            slot.finish();
+        }
+
+        std::shared_ptr <AsyncSlot> newAsyncSlot()
+        {
+            return std::make_shared<AsyncSlot>();
+        }
+
+        void pollAsync(AsyncSlot& slot, std::function<bool(AsyncSlot&, bool)> poll)
+        {
+            slot.poll = std::move(poll);
+        }
+
+        static int collectAsyncLoop(lua_State* state)
+        {
+            auto& loop = *static_cast<std::shared_ptr<AsyncLoop>*>(lua_touserdata(state, 1));
+            //slots being polled refer to the loop
+            loop->polling.clear();
+            {
+                std::lock_guard <std::mutex> lock(loop->mutex);
+                loop->ready.clear();
+            }
+            loop.~shared_ptr<AsyncLoop>();
+            return 0;
+        }
+
+        //Returns the State's loop, creating it if create is true.
+        static std::shared_ptr <AsyncLoop> getAsyncLoop(lua_State* state, bool create)
+        {
+            growStack(state, 3);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &asyncLoopKey);
+            if(lua_isuserdata(state, -1))
+            {
+                std::shared_ptr <AsyncLoop> loop = *static_cast<std::shared_ptr<AsyncLoop>*>(lua_touserdata(state, -1));
+                lua_pop(state, 1);
+                return loop;
+            }
+            lua_pop(state, 1);
+            if(!create)
+                return nullptr;
+
+            std::shared_ptr <AsyncLoop> loop = std::make_shared<AsyncLoop>();
+            void* memory = lua_newuserdata(state, sizeof(std::shared_ptr<AsyncLoop>));
+            new (memory) std::shared_ptr<AsyncLoop>(loop);
+            if(luaL_newmetatable(state, "Simplua.AsyncLoop"))
+            {
+                lua_pushcfunction(state, collectAsyncLoop);
+                lua_setfield(state, -2, "__gc");
+            }
+            lua_setmetatable(state, -2);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &asyncLoopKey);
+            return loop;
+        }
+
+        //Returns the registry reference of the task running on state, or LUA_NOREF if it is not a task.
+        static int getTaskReference(lua_State* state)
+        {
+            growStack(state, 2);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &asyncTasksKey);
+            if(!lua_istable(state, -1))
+            {
+                lua_pop(state, 1);
+                return LUA_NOREF;
+            }
+            lua_pushthread(state);
+            lua_rawget(state, -2);
+            int reference = lua_isnumber(state, -1) ? static_cast<int>(lua_tointeger(state, -1)) : LUA_NOREF;
+            lua_pop(state, 2);
+            return reference;
+        }
+
+        //Pushes the results of a finished call, or its error message.
+        static int pushAsyncResults(lua_State* state, AsyncSlot& slot)
+        {
+            if(slot.failed)
+            {
+                lua_pushlstring(state, slot.error.data(), slot.error.size());
+                return asyncError;
+            }
+            return slot.push(state);
+        }
+
+        int beginAsync(lua_State* state, const std::shared_ptr<AsyncSlot>& slot)
+        {
+            if(slot->poll)
+                slot->poll(*slot, false);
+
+            int reference = getTaskReference(state);
+            std::unique_lock <std::mutex> lock(slot->mutex);
+            if(!slot->done && reference != LUA_NOREF)
+            {
+                std::shared_ptr <AsyncLoop> loop = getAsyncLoop(state, true);
+                slot->loop = loop;
+                slot->thread = reference;
+                lock.unlock();
+                if(slot->poll)
+                    loop->polling.push_back(slot);
+                loop->awaiting = true;
+                return asyncYield;
+            }
+
+            //outside a task, the call has to finish before the function returns
+            if(!slot->done && slot->poll)
+            {
+                lock.unlock();
+                slot->poll(*slot, true);
+                lock.lock();
+            }
+            slot->finished.wait(lock, [&]() { return slot->done; });
+            lock.unlock();
+            return pushAsyncResults(state, *slot);
+        }
+
+        //Runs when a task that waited for a call is resumed.  The stack holds a flag telling whether the call
+        //succeeded, followed by its results or error message.
+        static int continueAsyncCall(lua_State* state)
+        {
+            int base = 0;
+            lua_getctx(state, &base);
+            if(!lua_toboolean(state, base + 1))
+                return lua_error(state);
+            return lua_gettop(state) - base - 1;
+        }
+
+        int finishAsyncCall(lua_State* state, int results)
+        {
+            if(results == asyncError)
+                return lua_error(state);
+            if(results == asyncYield)
+                return lua_yieldk(state, 0, lua_gettop(state), continueAsyncCall);
+            return results;
+        }
+
+        //Resumes a task with nargs arguments on its stack.  Appends the error message to errors if the task fails.
+        static void resumeTask(lua_State* state, AsyncLoop& loop, lua_State* thread, int reference, int nargs, std::string& errors)
+        {
+            loop.awaiting = false;
+            int status = lua_resume(thread, state, nargs);
+            if(status == LUA_YIELD)
+            {
+                if(!loop.awaiting)
+                {
+                    //coroutine.yield: continue the task in the next pollAsync
+                    lua_settop(thread, 0);
+                    loop.yielded.push_back(reference);
+                }
+                return;
+            }
+
+            if(status != LUA_OK)
+            {
+                Object err = GetStackVar<Object>()(thread, -1);
+                std::stringstream ss;
+                ss << "\n" << err;
+                errors += ss.str();
+            }
+            lua_settop(thread, 0);
+
+            growStack(state, 3);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &asyncTasksKey);
+            lua_pushthread(thread);
+            lua_xmove(thread, state, 1);
+            lua_pushnil(state);
+            lua_rawset(state, -3);
+            lua_pop(state, 1);
+            luaL_unref(state, LUA_REGISTRYINDEX, reference);
+            --loop.tasks;
+        }
+    }//namespace internal
+
+    namespace internal
+    {
+        //Starts a task calling the function below the nargs arguments on top of the stack, popping them.
+        static void startTask(lua_State* state, AsyncLoop& loop, int nargs, std::string& errors)
+        {
+            growStack(state, 4);
+            lua_State* thread = lua_newthread(state);
+            lua_insert(state, -(nargs + 2));
+            lua_xmove(state, thread, nargs + 1);
+            int reference = luaL_ref(state, LUA_REGISTRYINDEX);
+
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &asyncTasksKey);
+            if(lua_isnil(state, -1))
+            {
+                lua_pop(state, 1);
+                lua_newtable(state);
+                lua_pushvalue(state, -1);
+                lua_rawsetp(state, LUA_REGISTRYINDEX, &asyncTasksKey);
+            }
+            lua_rawgeti(state, LUA_REGISTRYINDEX, reference);
+            lua_pushinteger(state, reference);
+            lua_rawset(state, -3);
+            lua_pop(state, 1);
+            ++loop.tasks;
+
+            resumeTask(state, loop, thread, reference, nargs, errors);
+        }
+    }//namespace internal
+
+    void State::spawnTask(int nargs)
+    {
+        std::shared_ptr <internal::AsyncLoop> loop = internal::getAsyncLoop(state, true);
+
+        std::string errors;
+        internal::startTask(state, *loop, nargs, errors);
+        if(!errors.empty())
+            throw script_error("lua::State::spawn -" + errors);
+    }
+
+    std::size_t State::pollAsync(int timeout)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::pollAsync");
+
+        std::shared_ptr <internal::AsyncLoop> loop = internal::getAsyncLoop(state, false);
+        if(!loop)
+            return 0;
+
+        auto checkFutures = [&]()
+        {
+            auto& polling = loop->polling;
+            polling.erase(std::remove_if(polling.begin(), polling.end(),
+                                         [](const std::shared_ptr<internal::AsyncSlot>& slot) { return slot->poll(*slot, false); }),
+                          polling.end());
+        };
+
+        checkFutures();
+        std::vector <std::shared_ptr<internal::AsyncSlot>> ready;
+        {
+            std::unique_lock <std::mutex> lock(loop->mutex);
+            if(loop->ready.empty() && loop->yielded.empty() && loop->tasks > 0 && timeout != 0)
+            {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+                while(loop->ready.empty())
+                {
+                    //futures cannot signal, so they are checked every millisecond while any are pending
+                    if(!loop->polling.empty())
+                    {
+                        loop->finished.wait_for(lock, std::chrono::milliseconds(1));
+                        lock.unlock();
+                        checkFutures();
+                        lock.lock();
+                    }
+                    else if(timeout < 0)
+                        loop->finished.wait(lock);
+                    else
+                        loop->finished.wait_until(lock, deadline);
+
+                    if(timeout > 0 && std::chrono::steady_clock::now() >= deadline)
+                        break;
+                }
+            }
+            ready.swap(loop->ready);
+        }
+        loop->resetEvent();
+
+        std::vector <int> yielded;
+        yielded.swap(loop->yielded);
+
+        std::string errors;
+        std::size_t count = 0;
+        internal::growStack(state, 1);
+        for(int reference : yielded)
+        {
+            lua_rawgeti(state, LUA_REGISTRYINDEX, reference);
+            lua_State* thread = lua_tothread(state, -1);
+            lua_pop(state, 1);
+            internal::resumeTask(state, *loop, thread, reference, 0, errors);
+            ++count;
+        }
+        for(auto& slot : ready)
+        {
+            lua_rawgeti(state, LUA_REGISTRYINDEX, slot->thread);
+            lua_State* thread = lua_tothread(state, -1);
+            lua_pop(state, 1);
+
+            internal::growStack(thread, 2);
+            lua_pushboolean(thread, !slot->failed);
+            int results = internal::pushAsyncResults(thread, *slot);
+            internal::resumeTask(state, *loop, thread, slot->thread, slot->failed ? 2 : results + 1, errors);
+            ++count;
+        }
+
+        if(!errors.empty())
+            throw script_error("lua::State::pollAsync -" + errors);
+        return count;
+    }
+
+    std::size_t State::getAsyncTaskCount() const
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::getAsyncTaskCount");
+
+        std::shared_ptr <internal::AsyncLoop> loop = internal::getAsyncLoop(state, false);
+        return loop ? loop->tasks : 0;
+    }
+
+    int State::getAsyncEventFd()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::getAsyncEventFd");
+
+        return internal::getAsyncLoop(state, true)->eventFd;
+    }
+
+    std::vector <Object> State::run()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::run");
+
+        internal::TraceSpan span("run", std::string());
+
+        if(lua_pcall(state, 0, LUA_MULTRET, 0) != LUA_OK)
+        {
+            Object err = internal::GetStackVar<Object>()(state, -1);
+            lua_pop(state, 1);
+            std::stringstream ss;
+            ss << "lua::State::run - " << err;
+            throw script_error(ss.str());
+        }
+
+        unsigned retsLeft = lua_gettop(state);
+        std::vector <Object> ret(retsLeft);
+        while(retsLeft > 0)
+        {
+            Object obj = internal::GetStackVar<Object>()(state, -1);
+            lua_pop(state, 1);
+            ret[--retsLeft] = std::move(obj);
+        }
+
+        return ret;
+    }
+
+
+    Handle::Handle()
+    : state(nullptr), reference(LUA_NOREF)
+    {}
+
+    Handle::Handle(lua_State* state, int reference)
+    : state(state), reference(reference)
+    {}
+
+    Handle::~Handle()
+    {
+        if(state)
+            luaL_unref(state, LUA_REGISTRYINDEX, reference);
+    }
+
+    Handle::Handle(Handle&& rhs)
+    : state(rhs.state), reference(rhs.reference)
+    {
+        rhs.state = nullptr;
+        rhs.reference = LUA_NOREF;
+    }
+
+    Handle& Handle::operator =(Handle&& rhs)
+    {
+        if(this == &rhs)
+            return *this;
+
+        if(state)
+            luaL_unref(state, LUA_REGISTRYINDEX, reference);
+        state = rhs.state;
+        reference = rhs.reference;
+        rhs.state = nullptr;
+        rhs.reference = LUA_NOREF;
+
+        return *this;
+    }
+
+    bool Handle::isValid() const
+    {
+        return state != nullptr;
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for State::newEnvironment
+
+        //The address of this is the registry key of a weak table mapping tables to their read-only views,
+        //so each table gets only one view.  Views cannot be modified, so every environment can share them.
+        static const char readOnlyViewsKey = 0;
+
+        static void pushReadOnlyView(lua_State* state, int index);
+
+        //Replaces the value on top of the stack with its read-only view if it is a table.
+        static void wrapReadOnly(lua_State* state)
+        {
+            if(lua_istable(state, -1))
+            {
+                pushReadOnlyView(state, -1);
+                lua_replace(state, -2);
+            }
+        }
+
+        //The metamethods of a read-only view.  Upvalue 1 is the table it shows.
+        static int readOnlyIndex(lua_State* state)
+        {
+            lua_settop(state, 2);
+            //not raw, so lazily loaded libraries are opened when first read
+            lua_gettable(state, lua_upvalueindex(1));
+            wrapReadOnly(state);
+            return 1;
+        }
+
+        static int readOnlyNewIndex(lua_State* state)
+        {
+            return luaL_error(state, "attempt to modify a read-only table");
+        }
+
+        static int readOnlyNext(lua_State* state)
+        {
+            lua_settop(state, 2);
+            if(!lua_next(state, lua_upvalueindex(1)))
+            {
+                lua_pushnil(state);
+                return 1;
+            }
+            wrapReadOnly(state);
+            return 2;
+        }
+
+        static int readOnlyPairs(lua_State* state)
+        {
+            lua_pushvalue(state, lua_upvalueindex(1));
+            lua_pushcclosure(state, readOnlyNext, 1);
+            lua_pushvalue(state, 1);
+            lua_pushnil(state);
+            return 3;
+        }
+
+        static int readOnlyIpairsNext(lua_State* state)
+        {
+            lua_Integer i = lua_tointeger(state, 2) + 1;
+            lua_pushinteger(state, i);
+            lua_rawgeti(state, lua_upvalueindex(1), i);
+            if(lua_isnil(state, -1))
+                return 1;
+            wrapReadOnly(state);
+            return 2;
+        }
+
+        static int readOnlyIpairs(lua_State* state)
+        {
+            lua_pushvalue(state, lua_upvalueindex(1));
+            lua_pushcclosure(state, readOnlyIpairsNext, 1);
+            lua_pushvalue(state, 1);
+            lua_pushinteger(state, 0);
+            return 3;
+        }
+
+        static int readOnlyLen(lua_State* state)
+        {
+            lua_len(state, lua_upvalueindex(1));
+            return 1;
+        }
+
+        //Pushes the read-only view of the table at index, creating it the first time.
+        //The view is an empty full userdata whose metamethods read from the original; unlike a table,
+        //rawset cannot bypass its __newindex.
+        static void pushReadOnlyView(lua_State* state, int index)
+        {
+            static const luaL_Reg viewMetamethods[] =
+            {
+                {"__index", readOnlyIndex},
+                {"__len", readOnlyLen},
+                {"__pairs", readOnlyPairs},
+                {"__ipairs", readOnlyIpairs},
+                {nullptr, nullptr}
+            };
+
+            index = lua_absindex(state, index);
+            growStack(state, 5);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &readOnlyViewsKey);
+            if(lua_isnil(state, -1))
+            {
+                lua_pop(state, 1);
+                lua_newtable(state);
+                lua_newtable(state);
+                lua_pushliteral(state, "k");
+                lua_setfield(state, -2, "__mode");
+                lua_setmetatable(state, -2);
+                lua_pushvalue(state, -1);
+                lua_rawsetp(state, LUA_REGISTRYINDEX, &readOnlyViewsKey);
+            }
+            int views = lua_gettop(state);
+
+            lua_pushvalue(state, index);
+            lua_rawget(state, views);
+            if(lua_isnil(state, -1))
+            {
+                lua_pop(state, 1);
+                lua_newuserdata(state, 0);
+                lua_newtable(state);
+                lua_pushvalue(state, index);
+                luaL_setfuncs(state, viewMetamethods, 1);
+                lua_pushcfunction(state, readOnlyNewIndex);
+                lua_setfield(state, -2, "__newindex");
+                lua_pushboolean(state, 0);
+                lua_setfield(state, -2, "__metatable");
+                lua_setmetatable(state, -2);
+
+                lua_pushvalue(state, index);
+                lua_pushvalue(state, -2);
+                lua_rawset(state, views);
+            }
+            lua_remove(state, views);
+        }
+
+        //Makes getmetatable('') return a read-only view of the string metatable, so code in an environment
+        //cannot reach the string library through it.
+        static void protectStringMetatable(lua_State* state)
+        {
+            growStack(state, 3);
+            lua_pushliteral(state, "");
+            if(lua_getmetatable(state, -1))
+            {
+                pushReadOnlyView(state, -1);
+                lua_setfield(state, -2, "__metatable");
+                lua_pop(state, 1);
+            }
+            lua_pop(state, 1);
+        }
+
+        //Checks that the value at index is a Lua function whose first upvalue is _ENV.
+        //Stripped chunks have no upvalue names, so an empty name is accepted too.
+        static bool isChunk(lua_State* state, int index)
+        {
+            if(!lua_isfunction(state, index) || lua_iscfunction(state, index))
+                return false;
+            const char* name = lua_getupvalue(state, index, 1);
+            if(!name)
+                return false;
+            lua_pop(state, 1);
+            return std::strcmp(name, "_ENV") == 0 || name[0] == '\0';
+        }
+    }//namespace internal
+
+    Chunk State::takeChunk()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::takeChunk");
+
+        if(lua_gettop(state) == 0 || !internal::isChunk(state, -1))
+            throw type_mismatch("lua::State::takeChunk - the value is not a chunk");
+
+        return Chunk(state, luaL_ref(state, LUA_REGISTRYINDEX));
+    }
+
+    Environment State::newEnvironment()
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::newEnvironment");
+
+        internal::growStack(state, 4);
+        internal::protectStringMetatable(state);
+        //The handle refers to a tiny chunk whose _ENV upvalue is the environment.
+        //run joins the chunk's _ENV upvalue to it, so the compiled chunk never has to be copied.
+        if(luaL_loadstring(state, "return _ENV") != LUA_OK)
+        {
+            lua_pop(state, 1);
+            throw std::bad_alloc();
+        }
+
+        lua_newtable(state);
+        lua_newtable(state);
+        lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        lua_pushcclosure(state, internal::readOnlyIndex, 1);
+        lua_setfield(state, -2, "__index");
+        lua_pushboolean(state, 0);
+        lua_setfield(state, -2, "__metatable");
+        lua_setmetatable(state, -2);
+        lua_pushvalue(state, -1);
+        lua_setfield(state, -2, "_G");
+        lua_setupvalue(state, -2, 1);
+
+        return Environment(state, luaL_ref(state, LUA_REGISTRYINDEX));
+    }
+
+    std::vector <Object> State::run(const Chunk& chunk, const Environment& env)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::run");
+        if(chunk.state != state || env.state != state)
+            throw std::invalid_argument("lua::State::run - the chunk or environment belongs to a different State");
+
+        internal::TraceSpan span("run", std::string());
+
+        int base = lua_gettop(state);
+        internal::growStack(state, 2);
+        lua_rawgeti(state, LUA_REGISTRYINDEX, chunk.reference);
+        lua_rawgeti(state, LUA_REGISTRYINDEX, env.reference);
+        lua_upvaluejoin(state, -2, 1, -1, 1);
+        lua_pop(state, 1);
+
+        if(lua_pcall(state, 0, LUA_MULTRET, 0) != LUA_OK)
+        {
+            Object err = internal::GetStackVar<Object>()(state, -1);
+            lua_pop(state, 1);
+            std::stringstream ss;
+            ss << "lua::State::run - " << err;
+            throw script_error(ss.str());
+        }
+
+        unsigned retsLeft = lua_gettop(state) - base;
+        std::vector <Object> ret(retsLeft);
+        while(retsLeft > 0)
+        {
+            Object obj = internal::GetStackVar<Object>()(state, -1);
+            lua_pop(state, 1);
+            ret[--retsLeft] = std::move(obj);
+        }
+
+        return ret;
+    }
+
+
+    namespace internal
+    {
+        //Helper functions for State::loadLibLazy
+
+        //The address of this is the registry key of the table mapping the names of libraries
+        //that have not been opened yet to their luaopen functions, and other globals they define to their names.
+        static const char lazyLibsKey = 0;
+
+        //Makes require work for libraries that have not been opened yet by adding them to package.preload.
+        static void preloadLazyLibs(lua_State* state)
+        {
+            growStack(state, 4);
+            int top = lua_gettop(state);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &lazyLibsKey);
+            int lazy = lua_gettop(state);
+            luaL_getsubtable(state, LUA_REGISTRYINDEX, "_LOADED");
+            lua_getfield(state, -1, "package");
+            if(lua_istable(state, lazy) && lua_istable(state, -1))
+            {
+                lua_getfield(state, -1, "preload");
+                int preload = lua_gettop(state);
+                if(lua_istable(state, preload))
+                {
+                    lua_pushnil(state);
+                    while(lua_next(state, lazy) != 0)
+                    {
+                        //skip aliases
+                        if(!lua_iscfunction(state, -1))
+                        {
+                            lua_pop(state, 1);
+                            continue;
+                        }
+                        lua_pushvalue(state, -2);
+                        lua_insert(state, -2);
+                        lua_rawset(state, preload);
+                    }
+                }
+            }
+            lua_settop(state, top);
+        }
+
+        //__index of _G when libraries are loaded lazily.  Upvalue 1 is the table of unopened libraries
+        //and upvalue 2 is the previous __index of _G, if any.
+        static int lazyLibIndex(lua_State* state)
+        {
+            lua_pushvalue(state, 2);
+            lua_rawget(state, lua_upvalueindex(1));
+            if(lua_iscfunction(state, -1))
+            {
+                lua_CFunction open = lua_tocfunction(state, -1);
+                lua_pop(state, 1);
+                lua_pushvalue(state, 2);
+                lua_pushnil(state);
+                lua_rawset(state, lua_upvalueindex(1));
+
+                //require may have opened it already
+                luaL_getsubtable(state, LUA_REGISTRYINDEX, "_LOADED");
+                lua_pushvalue(state, 2);
+                lua_rawget(state, -2);
+                if(!lua_isnil(state, -1))
+                {
+                    lua_pushvalue(state, -1);
+                    lua_setglobal(state, lua_tostring(state, 2));
+                    return 1;
+                }
+                lua_pop(state, 2);
+
+                //this also sets the global, so the metamethod is not used again
+                luaL_requiref(state, lua_tostring(state, 2), open, 1);
+                if(open == luaopen_package)
+                    preloadLazyLibs(state);
+                return 1;
+            }
+            if(lua_type(state, -1) == LUA_TSTRING)
+            {
+                //an alias for a library that defines more than one global, like require for package
+                lua_pushvalue(state, 2);
+                lua_pushnil(state);
+                lua_rawset(state, lua_upvalueindex(1));
+                lua_getglobal(state, lua_tostring(state, -1));
+                lua_pop(state, 2);
+                lua_getglobal(state, lua_tostring(state, 2));
+                return 1;
+            }
+            lua_pop(state, 1);
+
+            if(lua_isfunction(state, lua_upvalueindex(2)))
+            {
+                lua_pushvalue(state, lua_upvalueindex(2));
+                lua_pushvalue(state, 1);
+                lua_pushvalue(state, 2);
+                lua_call(state, 2, 1);
+            }
+            else if(lua_istable(state, lua_upvalueindex(2)))
+            {
+                lua_pushvalue(state, 2);
+                lua_gettable(state, lua_upvalueindex(2));
+            }
+            else
+                lua_pushnil(state);
+            return 1;
+        }
+    }//namespace internal
+
+    namespace internal
+    {
+        //Helper functions for the timer library
+
+        //The address of this is the registry key of the State's TimerWheel userdata.
+        static const char timerWheelKey = 0;
+
+        //A hierarchical timer wheel with a resolution of one millisecond.  Level n has 256 slots of 256^n milliseconds;
+        //when a level's index wraps around, the next level's current slot is spread over the levels below.
+        //Timers are kept in intrusive lists, so adding and cancelling them takes constant time.
+        struct TimerWheel
+        {
+            enum Kind
+            {
+                sleepTimer,
+                afterTimer,
+                everyTimer
+            };
+
+            struct Timer
+            {
+                std::uint64_t due;
+                std::uint64_t interval;
+                //the sleeping task, or the function to call
+                int reference;
+                Kind kind;
+                //0 while the timer is free
+                std::uint64_t id;
+                int previous;
+                int next;
+                //the list holding the timer, or -1
+                int slot;
+            };
+
+            static const int levels = 4;
+            static const int slotBits = 8;
+            static const int slotCount = 1 << slotBits;
+            //timers too far away to fit in the wheel
+            static const int overflowSlot = levels * slotCount;
+            //timers added before the first tick, with their delay in due
+            static const int unstartedSlot = overflowSlot + 1;
+
+            std::vector <Timer> timers;
+            std::vector <int> heads;
+            int freeList;
+            std::uint64_t now;
+            bool started;
+            //the number of timers in the lists
+            std::size_t count;
+            //ids are never reused, so a stale id cannot cancel a timer that reuses its slot.  They stay below 2^53,
+            //so Lua numbers hold them exactly.
+            std::uint64_t nextId;
+            std::unordered_map <std::uint64_t, int> ids;
+
+            TimerWheel()
+            : heads(unstartedSlot + 1, -1), freeList(-1), now(0), started(false), count(0), nextId(1)
+            {}
+
+            void link(int index)
+            {
+                Timer& timer = timers[index];
+                int slot = unstartedSlot;
+                if(started)
+                {
+                    std::uint64_t delta = timer.due - now;
+                    slot = overflowSlot;
+                    for(int level = 0; level < levels; ++level)
+                    {
+                        if(delta < (std::uint64_t(1) << (slotBits * (level + 1))))
+                        {
+                            slot = level * slotCount + static_cast<int>((timer.due >> (slotBits * level)) & (slotCount - 1));
+                            break;
+                        }
+                    }
+                }
+
+                timer.slot = slot;
+                timer.previous = -1;
+                timer.next = heads[slot];
+                if(timer.next != -1)
+                    timers[timer.next].previous = index;
+                heads[slot] = index;
+                ++count;
+            }
+
+            void unlink(int index)
+            {
+                Timer& timer = timers[index];
+                if(timer.previous != -1)
+                    timers[timer.previous].next = timer.next;
+                else
+                    heads[timer.slot] = timer.next;
+                if(timer.next != -1)
+                    timers[timer.next].previous = timer.previous;
+                timer.slot = -1;
+                --count;
+            }
+
+            //Adds a timer due delay milliseconds from now; it fires on a later tick, never the current one.
+            int add(Kind kind, std::uint64_t delay, std::uint64_t interval, int reference)
+            {
+                int index = freeList;
+                if(index != -1)
+                    freeList = timers[index].next;
+                else
+                {
+                    index = static_cast<int>(timers.size());
+                    Timer timer = Timer();
+                    timers.push_back(timer);
+                }
+
+                Timer& timer = timers[index];
+                delay = std::max<std::uint64_t>(delay, 1);
+                timer.due = started ? now + delay : delay;
+                timer.interval = interval;
+                timer.reference = reference;
+                timer.kind = kind;
+                timer.id = nextId++;
+                ids[timer.id] = index;
+                link(index);
+                return index;
+            }
+
+            void release(int index)
+            {
+                Timer& timer = timers[index];
+                if(timer.slot != -1)
+                    unlink(index);
+                ids.erase(timer.id);
+                timer.id = 0;
+                timer.next = freeList;
+                freeList = index;
+            }
+
+            //Returns the index of the timer with the specified id, or -1 if it has fired or been cancelled.
+            int find(std::uint64_t id) const
+            {
+                auto it = ids.find(id);
+                return it != ids.end() ? it->second : -1;
+            }
+
+            //Moves every timer in slot to the lists it belongs in now.
+            void spread(int slot)
+            {
+                int index = heads[slot];
+                heads[slot] = -1;
+                while(index != -1)
+                {
+                    int next = timers[index].next;
+                    --count;
+                    link(index);
+                    index = next;
+                }
+            }
+
+            void start(std::uint64_t time)
+            {
+                started = true;
+                now = time;
+                int index = heads[unstartedSlot];
+                heads[unstartedSlot] = -1;
+                while(index != -1)
+                {
+                    int next = timers[index].next;
+                    timers[index].due += now;
+                    --count;
+                    link(index);
+                    index = next;
+                }
+            }
+
+            //Advances to time, appending the timers that are due to fired (with their id) in the order they are due.
+            void advance(std::uint64_t time, std::vector <std::pair<int, std::uint64_t>>& fired)
+            {
+                while(now < time)
+                {
+                    if(count == 0)
+                    {
+                        now = time;
+                        break;
+                    }
+
+                    ++now;
+                    for(int level = 1; level <= levels; ++level)
+                    {
+                        if(((now >> (slotBits * (level - 1))) & (slotCount - 1)) != 0)
+                            break;
+                        spread(level == levels ? overflowSlot : level * slotCount + static_cast<int>((now >> (slotBits * level)) & (slotCount - 1)));
+                    }
+
+                    int slot = static_cast<int>(now & (slotCount - 1));
+                    int index = heads[slot];
+                    heads[slot] = -1;
+                    while(index != -1)
+                    {
+                        Timer& timer = timers[index];
+                        timer.slot = -1;
+                        --count;
+                        fired.push_back(std::make_pair(index, timer.id));
+                        index = timer.next;
+                    }
+                }
+            }
+        };
+
+        static int collectTimerWheel(lua_State* state)
+        {
+            static_cast<TimerWheel*>(lua_touserdata(state, 1))->~TimerWheel();
+            return 0;
+        }
+
+        static TimerWheel* getTimerWheel(lua_State* state)
+        {
+            growStack(state, 1);
+            lua_rawgetp(state, LUA_REGISTRYINDEX, &timerWheelKey);
+            TimerWheel* wheel = static_cast<TimerWheel*>(lua_touserdata(state, -1));
+            lua_pop(state, 1);
+            return wheel;
+        }
+
+        static std::uint64_t toDelay(lua_State* state, int index)
+        {
+            lua_Number ms = luaL_checknumber(state, index);
+            if(!(ms > 0))
+                return 0;
+            if(ms > 1e18)
+                return static_cast<std::uint64_t>(1e18);
+            return static_cast<std::uint64_t>(ms);
+        }
+
+        static void pushTimerId(lua_State* state, TimerWheel& wheel, int index)
+        {
+            lua_pushnumber(state, static_cast<lua_Number>(wheel.timers[index].id));
+        }
+
+        //The functions of the timer library.  Upvalue 1 is the TimerWheel.
+        static int timerSleep(lua_State* state)
+        {
+            {
+                TimerWheel* wheel = static_cast<TimerWheel*>(lua_touserdata(state, lua_upvalueindex(1)));
+                std::uint64_t delay = toDelay(state, 1);
+                int reference = getTaskReference(state);
+                if(reference == LUA_NOREF)
+                    return luaL_error(state, "timer.sleep - only tasks started with State::spawn can sleep");
+                wheel->add(TimerWheel::sleepTimer, delay, 0, reference);
+                getAsyncLoop(state, true)->awaiting = true;
+            }
+            //no C++ object may be alive here, since Lua does not unwind the C++ stack
+            return lua_yield(state, 0);
+        }
+
+        static int timerAdd(lua_State* state, TimerWheel::Kind kind)
+        {
+            TimerWheel* wheel = static_cast<TimerWheel*>(lua_touserdata(state, lua_upvalueindex(1)));
+            std::uint64_t delay = toDelay(state, 1);
+            luaL_checktype(state, 2, LUA_TFUNCTION);
+            lua_settop(state, 2);
+            int reference = luaL_ref(state, LUA_REGISTRYINDEX);
+            int index = wheel->add(kind, delay, kind == TimerWheel::everyTimer ? std::max<std::uint64_t>(delay, 1) : 0, reference);
+            pushTimerId(state, *wheel, index);
+            return 1;
+        }
+
+        static int timerAfter(lua_State* state)
+        {
+            return timerAdd(state, TimerWheel::afterTimer);
+        }
+
+        static int timerEvery(lua_State* state)
+        {
+            return timerAdd(state, TimerWheel::everyTimer);
+        }
+
+        static int timerCancel(lua_State* state)
+        {
+            TimerWheel* wheel = static_cast<TimerWheel*>(lua_touserdata(state, lua_upvalueindex(1)));
+            lua_Number id = luaL_checknumber(state, 1);
+            int index = -1;
+            if(id >= 1 && id < 9007199254740992.0 && id == std::floor(id))
+                index = wheel->find(static_cast<std::uint64_t>(id));
+            if(index == -1 || wheel->timers[index].kind == TimerWheel::sleepTimer)
+            {
+                lua_pushboolean(state, 0);
+                return 1;
+            }
+            luaL_unref(state, LUA_REGISTRYINDEX, wheel->timers[index].reference);
+            wheel->release(index);
+            lua_pushboolean(state, 1);
+            return 1;
+        }
+
+        static int openTimerLib(lua_State* state)
+        {
+            static const luaL_Reg functions[] =
+            {
+                {"sleep", timerSleep},
+                {"after", timerAfter},
+                {"every", timerEvery},
+                {"cancel", timerCancel},
+                {nullptr, nullptr}
+            };
+
+            TimerWheel* wheel = getTimerWheel(state);
+            if(!wheel)
+            {
+                void* memory = lua_newuserdata(state, sizeof(TimerWheel));
+                wheel = new (memory) TimerWheel;
+                if(luaL_newmetatable(state, "Simplua.TimerWheel"))
+                {
+                    lua_pushcfunction(state, collectTimerWheel);
+                    lua_setfield(state, -2, "__gc");
+                }
+                lua_setmetatable(state, -2);
+                lua_rawsetp(state, LUA_REGISTRYINDEX, &timerWheelKey);
+            }
+
+            luaL_newlibtable(state, functions);
+            lua_pushlightuserdata(state, wheel);
+            luaL_setfuncs(state, functions, 1);
+            return 1;
+        }
+    }//namespace internal
+
+    std::size_t State::tick(std::uint64_t now)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::tick");
+
+        internal::TimerWheel* wheel = internal::getTimerWheel(state);
+        if(!wheel)
+            return 0;
+        if(!wheel->started)
+            wheel->start(now);
+
+        std::vector <std::pair<int, std::uint64_t>> fired;
+        wheel->advance(now, fired);
+        if(fired.empty())
+            return 0;
+
+        std::shared_ptr <internal::AsyncLoop> loop = internal::getAsyncLoop(state, true);
+        std::string errors;
+        std::size_t count = 0;
+        internal::growStack(state, 1);
+        for(auto& f : fired)
+        {
+            //a timer fired earlier in the batch may have cancelled this one
+            if(wheel->timers[f.first].id != f.second)
+                continue;
+
+            internal::TimerWheel::Timer& timer = wheel->timers[f.first];
+            int reference = timer.reference;
+            internal::TimerWheel::Kind kind = timer.kind;
+            lua_rawgeti(state, LUA_REGISTRYINDEX, reference);
+            if(kind == internal::TimerWheel::everyTimer)
+            {
+                timer.due = std::max(timer.due + timer.interval, wheel->now + 1);
+                wheel->link(f.first);
+            }
+            else
+            {
+                wheel->release(f.first);
+                if(kind == internal::TimerWheel::afterTimer)
+                    luaL_unref(state, LUA_REGISTRYINDEX, reference);
+            }
+
+            if(kind == internal::TimerWheel::sleepTimer)
+            {
+                lua_State* thread = lua_tothread(state, -1);
+                lua_pop(state, 1);
+                internal::resumeTask(state, *loop, thread, reference, 0, errors);
+            }
+            else
+                internal::startTask(state, *loop, 0, errors);
+            ++count;
+        }
+
+        if(!errors.empty())
+            throw script_error("lua::State::tick -" + errors);
+        return count;
+    }
+
+    namespace internal
+    {
+        //Helper functions for the vmath library
+
+        //Kernels on arrays of doubles.  Sums are computed in several lanes, so their rounding can differ slightly
+        //from a sequential loop.  min and max ignore NaN only where the hardware instructions do.
+        struct VectorKernels
+        {
+            double (*sum)(const double* a, std::size_t n);
+            double (*dot)(const double* a, const double* b, std::size_t n);
+            void (*scale)(const double* a, double k, double* out, std::size_t n);
+            double (*min)(const double* a, std::size_t n);
+            double (*max)(const double* a, std::size_t n);
+            void (*clamp)(const double* a, double low, double high, double* out, std::size_t n);
+        };
+
+        static double scalarSum(const double* a, std::size_t n)
+        {
+            double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+            std::size_t i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                s0 += a[i];
+                s1 += a[i + 1];
+                s2 += a[i + 2];
+                s3 += a[i + 3];
+            }
+            for(; i < n; ++i)
+                s0 += a[i];
+            return (s0 + s1) + (s2 + s3);
+        }
+
+        static double scalarDot(const double* a, const double* b, std::size_t n)
+        {
+            double s0 = 0, s1 = 0;
+            std::size_t i = 0;
+            for(; i + 2 <= n; i += 2)
+            {
+                s0 += a[i] * b[i];
+                s1 += a[i + 1] * b[i + 1];
+            }
+            for(; i < n; ++i)
+                s0 += a[i] * b[i];
+            return s0 + s1;
+        }
+
+        static void scalarScale(const double* a, double k, double* out, std::size_t n)
+        {
+            for(std::size_t i = 0; i < n; ++i)
+                out[i] = a[i] * k;
+        }
+
+        static double scalarMin(const double* a, std::size_t n)
+        {
+            double m = a[0];
+            for(std::size_t i = 1; i < n; ++i)
+                m = a[i] < m ? a[i] : m;
+            return m;
+        }
+
+        static double scalarMax(const double* a, std::size_t n)
+        {
+            double m = a[0];
+            for(std::size_t i = 1; i < n; ++i)
+                m = a[i] > m ? a[i] : m;
+            return m;
+        }
+
+        static void scalarClamp(const double* a, double low, double high, double* out, std::size_t n)
+        {
+            for(std::size_t i = 0; i < n; ++i)
+            {
+                double x = a[i] < low ? low : a[i];
+                out[i] = x > high ? high : x;
+            }
+        }
+
+#ifdef SIMPLUA_X86_KERNELS
+        __attribute__((target("sse2"))) static double sse2Sum(const double* a, std::size_t n)
+        {
+            __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+            std::size_t i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+                s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+            }
+            double lanes[2];
+            _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+            double s = lanes[0] + lanes[1];
+            for(; i < n; ++i)
+                s += a[i];
+            return s;
+        }
+
+        __attribute__((target("sse2"))) static double sse2Dot(const double* a, const double* b, std::size_t n)
+        {
+            __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+            std::size_t i = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+                s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+            }
+            double lanes[2];
+            _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+            double s = lanes[0] + lanes[1];
+            for(; i < n; ++i)
+                s += a[i] * b[i];
+            return s;
+        }
+
+        __attribute__((target("sse2"))) static void sse2Scale(const double* a, double k, double* out, std::size_t n)
+        {
+            __m128d factor = _mm_set1_pd(k);
+            std::size_t i = 0;
+            for(; i + 2 <= n; i += 2)
+                _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+            for(; i < n; ++i)
+                out[i] = a[i] * k;
+        }
+
+        __attribute__((target("sse2"))) static double sse2Min(const double* a, std::size_t n)
+        {
+            if(n < 2)
+                return scalarMin(a, n);
+            __m128d m = _mm_loadu_pd(a);
+            std::size_t i = 2;
+            for(; i + 2 <= n; i += 2)
+                m = _mm_min_pd(_mm_loadu_pd(a + i), m);
+            double lanes[2];
+            _mm_storeu_pd(lanes, m);
+            double result = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+            for(; i < n; ++i)
+                result = a[i] < result ? a[i] : result;
+            return result;
+        }
+
+        __attribute__((target("sse2"))) static double sse2Max(const double* a, std::size_t n)
+        {
+            if(n < 2)
+                return scalarMax(a, n);
+            __m128d m = _mm_loadu_pd(a);
+            std::size_t i = 2;
+            for(; i + 2 <= n; i += 2)
+                m = _mm_max_pd(_mm_loadu_pd(a + i), m);
+            double lanes[2];
+            _mm_storeu_pd(lanes, m);
+            double result = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+            for(; i < n; ++i)
+                result = a[i] > result ? a[i] : result;
+            return result;
+        }
+
+        __attribute__((target("sse2"))) static void sse2Clamp(const double* a, double low, double high, double* out, std::size_t n)
+        {
+            __m128d lo = _mm_set1_pd(low), hi = _mm_set1_pd(high);
+            std::size_t i = 0;
+            for(; i + 2 <= n; i += 2)
+                _mm_storeu_pd(out + i, _mm_min_pd(_mm_max_pd(_mm_loadu_pd(a + i), lo), hi));
+            scalarClamp(a + i, low, high, out + i, n - i);
+        }
+
+        __attribute__((target("avx2"))) static double avx2Sum(const double* a, std::size_t n)
+        {
+            __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+            std::size_t i = 0;
+            for(; i + 8 <= n; i += 8)
+            {
+                s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+                s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+            }
+            double lanes[4];
+            _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+            double s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+            for(; i < n; ++i)
+                s += a[i];
+            return s;
+        }
+
+        __attribute__((target("avx2"))) static double avx2Dot(const double* a, const double* b, std::size_t n)
+        {
+            __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+            std::size_t i = 0;
+            for(; i + 8 <= n; i += 8)
+            {
+                s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+                s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+            }
+            double lanes[4];
+            _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+            double s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+            for(; i < n; ++i)
+                s += a[i] * b[i];
+            return s;
+        }
+
+        __attribute__((target("avx2"))) static void avx2Scale(const double* a, double k, double* out, std::size_t n)
+        {
+            __m256d factor = _mm256_set1_pd(k);
+            std::size_t i = 0;
+            for(; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+            for(; i < n; ++i)
+                out[i] = a[i] * k;
+        }
+
+        __attribute__((target("avx2"))) static double avx2Min(const double* a, std::size_t n)
+        {
+            if(n < 4)
+                return scalarMin(a, n);
+            __m256d m = _mm256_loadu_pd(a);
+            std::size_t i = 4;
+            for(; i + 4 <= n; i += 4)
+                m = _mm256_min_pd(_mm256_loadu_pd(a + i), m);
+            double lanes[4];
+            _mm256_storeu_pd(lanes, m);
+            double result = scalarMin(lanes, 4);
+            for(; i < n; ++i)
+                result = a[i] < result ? a[i] : result;
+            return result;
+        }
+
+        __attribute__((target("avx2"))) static double avx2Max(const double* a, std::size_t n)
+        {
+            if(n < 4)
+                return scalarMax(a, n);
+            __m256d m = _mm256_loadu_pd(a);
+            std::size_t i = 4;
+            for(; i + 4 <= n; i += 4)
+                m = _mm256_max_pd(_mm256_loadu_pd(a + i), m);
+            double lanes[4];
+            _mm256_storeu_pd(lanes, m);
+            double result = scalarMax(lanes, 4);
+            for(; i < n; ++i)
+                result = a[i] > result ? a[i] : result;
+            return result;
+        }
+
+        __attribute__((target("avx2"))) static void avx2Clamp(const double* a, double low, double high, double* out, std::size_t n)
+        {
+            __m256d lo = _mm256_set1_pd(low), hi = _mm256_set1_pd(high);
+            std::size_t i = 0;
+            for(; i + 4 <= n; i += 4)
+                _mm256_storeu_pd(out + i, _mm256_min_pd(_mm256_max_pd(_mm256_loadu_pd(a + i), lo), hi));
+            scalarClamp(a + i, low, high, out + i, n - i);
+        }
+#endif
+
+        static VectorKernels chooseVectorKernels()
+        {
+            VectorKernels k = {scalarSum, scalarDot, scalarScale, scalarMin, scalarMax, scalarClamp};
+#ifdef SIMPLUA_X86_KERNELS
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))
+            {
+                VectorKernels avx2 = {avx2Sum, avx2Dot, avx2Scale, avx2Min, avx2Max, avx2Clamp};
+                k = avx2;
+            }
+            else if(__builtin_cpu_supports("sse2"))
+            {
+                VectorKernels sse2 = {sse2Sum, sse2Dot, sse2Scale, sse2Min, sse2Max, sse2Clamp};
+                k = sse2;
+            }
+#endif
+            return k;
+        }
+
+        static const VectorKernels& getVectorKernels()
+        {
+            static const VectorKernels kernels = chooseVectorKernels();
+            return kernels;
+        }
+
+        //The numbers of a vmath argument, which is either a buffer or a sequence of numbers in a table.
+        //float64 buffers are used in place; other buffers and tables are copied into scratch.
+        struct Numbers
+        {
+            double* data;
+            std::size_t size;
+            bool isBuffer;
+            std::vector <double> scratch;
+
+            Numbers(lua_State* state, int index, const char* function)
+            {
+                if(BufferBlock* block = toBufferBlock(state, index))
+                {
+                    isBuffer = true;
+                    size = block->size;
+                    if(block->type == BufferType::float64)
+                    {
+                        data = static_cast<double*>(block->data);
+                        return;
+                    }
+                    scratch.resize(size);
+                    for(std::size_t i = 0; i < size; ++i)
+                        scratch[i] = loadElement(block, i);
+                    data = scratch.data();
+                    return;
+                }
+                if(!lua_istable(state, index))
+                    throw type_mismatch(std::string("vmath.") + function + " - expected a buffer or a table of numbers");
+
+                isBuffer = false;
+                size = lua_rawlen(state, index);
+                scratch.resize(size);
+                growStack(state, 1);
+                for(std::size_t i = 0; i < size; ++i)
+                {
+                    lua_rawgeti(state, index, static_cast<int>(i + 1));
+                    int isNumber = 0;
+                    scratch[i] = lua_tonumberx(state, -1, &isNumber);
+                    lua_pop(state, 1);
+                    if(!isNumber)
+                        throw type_mismatch(std::string("vmath.") + function + " - element " + std::to_string(i + 1) + " is not a number");
+                }
+                data = scratch.data();
+            }
+        };
+
+        //Reads a number argument.  Unlike luaL_checknumber this throws, so it can be used while a Numbers is alive.
+        static double toNumberArgument(lua_State* state, int index, const char* function)
+        {
+            int isNumber = 0;
+            double n = lua_tonumberx(state, index, &isNumber);
+            if(!isNumber)
+                throw type_mismatch(std::string("vmath.") + function + " - argument " + std::to_string(index) + " is not a number");
+            return n;
+        }
+
+        static double* pushNumberArray(lua_State* state, std::size_t size)
+        {
+            return static_cast<double*>(pushBuffer(state, nullptr, size, BufferType::float64)->data);
+        }
+
+        //Calls kernel(input, output) and pushes the output: into the float64 buffer at outIndex if there is one,
+        //into a new float64 buffer if the input is a buffer, and into a new table otherwise.
+        template <typename K>
+        static int pushElementwise(lua_State* state, const Numbers& input, int outIndex, const char* function, K kernel)
+        {
+            if(!lua_isnoneornil(state, outIndex))
+            {
+                BufferBlock* out = toBufferBlock(state, outIndex);
+                if(!out || out->type != BufferType::float64 || out->size != input.size)
+                    throw type_mismatch(std::string("vmath.") + function + " - out must be a float64 buffer of the same length");
+                kernel(input.data, static_cast<double*>(out->data));
+                lua_pushvalue(state, outIndex);
+                return 1;
+            }
+            if(input.isBuffer)
+            {
+                kernel(input.data, pushNumberArray(state, input.size));
+                return 1;
+            }
+
+            std::vector <double> result(input.size);
+            kernel(input.data, result.data());
+            growStack(state, 2);
+            lua_createtable(state, static_cast<int>(std::min<std::size_t>(input.size, INT_MAX)), 0);
+            for(std::size_t i = 0; i < result.size(); ++i)
+            {
+                lua_pushnumber(state, result[i]);
+                lua_rawseti(state, -2, static_cast<int>(i + 1));
+            }
+            return 1;
+        }
+
+        //The functions of the vmath library.
+        static int vmathArray(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                if(lua_type(state, 1) == LUA_TNUMBER)
+                {
+                    lua_Number n = lua_tonumber(state, 1);
+                    if(!(n >= 0) || n != std::floor(n))
+                        throw std::invalid_argument("vmath.array - the length must be a whole number");
+                    pushNumberArray(state, static_cast<std::size_t>(n));
+                    return 1;
+                }
+                Numbers input(state, 1, "array");
+                std::copy(input.data, input.data + input.size, pushNumberArray(state, input.size));
+                return 1;
+            });
+        }
+
+        static int vmathToTable(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers input(state, 1, "totable");
+                growStack(state, 2);
+                lua_createtable(state, static_cast<int>(std::min<std::size_t>(input.size, INT_MAX)), 0);
+                for(std::size_t i = 0; i < input.size; ++i)
+                {
+                    lua_pushnumber(state, input.data[i]);
+                    lua_rawseti(state, -2, static_cast<int>(i + 1));
+                }
+                return 1;
+            });
+        }
+
+        static int vmathSum(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "sum");
+                lua_pushnumber(state, getVectorKernels().sum(a.data, a.size));
+                return 1;
+            });
+        }
+
+        static int vmathDot(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "dot");
+                Numbers b(state, 2, "dot");
+                if(a.size != b.size)
+                    throw type_mismatch("vmath.dot - the arrays have different lengths");
+                lua_pushnumber(state, getVectorKernels().dot(a.data, b.data, a.size));
+                return 1;
+            });
+        }
+
+        static int vmathScale(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "scale");
+                double k = toNumberArgument(state, 2, "scale");
+                return pushElementwise(state, a, 3, "scale", [&](const double* in, double* out)
+                {
+                    getVectorKernels().scale(in, k, out, a.size);
+                });
+            });
+        }
+
+        static int vmathMin(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "min");
+                if(a.size == 0)
+                    lua_pushnil(state);
+                else
+                    lua_pushnumber(state, getVectorKernels().min(a.data, a.size));
+                return 1;
+            });
+        }
+
+        static int vmathMax(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "max");
+                if(a.size == 0)
+                    lua_pushnil(state);
+                else
+                    lua_pushnumber(state, getVectorKernels().max(a.data, a.size));
+                return 1;
+            });
+        }
+
+        static int vmathClamp(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "clamp");
+                double low = toNumberArgument(state, 2, "clamp");
+                double high = toNumberArgument(state, 3, "clamp");
+                return pushElementwise(state, a, 4, "clamp", [&](const double* in, double* out)
+                {
+                    getVectorKernels().clamp(in, low, high, out, a.size);
+                });
+            });
+        }
+
+        static int vmathPrefix(lua_State* state)
+        {
+            return protect(state, [&]()
+            {
+                Numbers a(state, 1, "prefix");
+                //each sum depends on the previous one, so this is a plain loop
+                return pushElementwise(state, a, 2, "prefix", [&](const double* in, double* out)
+                {
+                    double s = 0;
+                    for(std::size_t i = 0; i < a.size; ++i)
+                    {
+                        s += in[i];
+                        out[i] = s;
+                    }
+                });
+            });
+        }
+
+        static int openVmathLib(lua_State* state)
+        {
+            static const luaL_Reg functions[] =
+            {
+                {"array", vmathArray},
+                {"totable", vmathToTable},
+                {"sum", vmathSum},
+                {"dot", vmathDot},
+                {"scale", vmathScale},
+                {"min", vmathMin},
+                {"max", vmathMax},
+                {"clamp", vmathClamp},
+                {"prefix", vmathPrefix},
+                {nullptr, nullptr}
+            };
+
+            luaL_newlib(state, functions);
+            return 1;
+        }
+    }//namespace internal
+
+    static LuaFunction getLibraryFunction(Lib lib)
+    {
+        switch(lib)
+        {
+            case Lib::base:
+                return luaopen_base;
+            case Lib::coroutine:
+                return luaopen_coroutine;
+            case Lib::table:
+                return luaopen_table;
+            case Lib::io:
+                return luaopen_io;
+            case Lib::os:
+                return luaopen_os;
+            case Lib::string:
+                return luaopen_string;
+            case Lib::bit32:
+                return luaopen_bit32;
+            case Lib::math:
+                return luaopen_math;
+            case Lib::debug:
+                return luaopen_debug;
+            case Lib::package:
+                return luaopen_package;
+            case Lib::timer:
+                return internal::openTimerLib;
+            case Lib::vmath:
+                return internal::openVmathLib;
+            default:
+                return luaopen_base; //this should not happen
+        }
+    }
+
+    static const char* getLibraryName(Lib lib)
+    {
+        switch(lib)
+        {
+            case Lib::base:
+                return "base";
+            case Lib::coroutine:
+                return "coroutine";
+            case Lib::table:
+                return "table";
             case Lib::io:
                 return "io";
             case Lib::os:
@@ -681,6 +8296,10 @@ namespace lua
                 return "debug";
             case Lib::package:
                 return "package";
+            case Lib::timer:
+                return "timer";
+            case Lib::vmath:
+                return "vmath";
             default:
                 return "Error:getLibraryName"; //this should not happen
         }
@@ -703,10 +8322,10 @@ namespace lua
         }
         else
         {
-            LuaFunction f = getLibraryFunction(lib);
-            std::string name = getLibraryName(lib);
-            luaL_requiref(state, name.c_str(), f, 1);
+            luaL_requiref(state, getLibraryName(lib), getLibraryFunction(lib), 1);
             lua_pop(state, 1);
+            if(lib == Lib::package)
+                internal::preloadLazyLibs(state);
         }
     }
 
@@ -733,6 +8352,104 @@ namespace lua
         }
     }
 
+    void State::loadLibLazy(Lib lib)
+    {
+        if(!state)
+            throw uninitialized_resource("lua::State::loadLibLazy");
+
+        if(lib == Lib::all)
+        {
+            loadLib(Lib::base);
+            //all means the standard libraries; timer and vmath must be asked for by name
+            for(int i = static_cast<int>(Lib::coroutine); i <= static_cast<int>(Lib::package); ++i)
+                loadLibLazy(static_cast<Lib>(i));
+            return;
+        }
+        //the base functions are globals themselves, so there is no name to trigger loading them, and string
+        //methods ('abc'):upper() reach the string library through the string metatable, not the global
+        if(lib == Lib::base || lib == Lib::string)
+        {
+            loadLib(lib);
+            return;
+        }
+
+        internal::growStack(state, 5);
+        int top = lua_gettop(state);
+        luaL_getsubtable(state, LUA_REGISTRYINDEX, "_LOADED");
+        lua_getfield(state, -1, getLibraryName(lib));
+        bool loaded = !lua_isnil(state, -1);
+        lua_settop(state, top);
+        if(loaded)
+            return;
+
+        lua_rawgetp(state, LUA_REGISTRYINDEX, &internal::lazyLibsKey);
+        if(lua_isnil(state, -1))
+        {
+            //first lazy library: create the table and hook it into _G's metatable
+            lua_pop(state, 1);
+            lua_newtable(state);
+            lua_pushvalue(state, -1);
+            lua_rawsetp(state, LUA_REGISTRYINDEX, &internal::lazyLibsKey);
+
+            lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            if(!lua_getmetatable(state, -1))
+            {
+                lua_newtable(state);
+                lua_pushvalue(state, -1);
+                lua_setmetatable(state, -3);
+            }
+            lua_pushvalue(state, top + 1);
+            lua_getfield(state, -2, "__index");
+            lua_pushcclosure(state, internal::lazyLibIndex, 2);
+            lua_setfield(state, -2, "__index");
+            lua_settop(state, top + 1);
+        }
+        lua_pushcfunction(state, getLibraryFunction(lib));
+        lua_setfield(state, -2, getLibraryName(lib));
+        if(lib == Lib::package)
+        {
+            lua_pushliteral(state, "package");
+            lua_setfield(state, -2, "require");
+            lua_pushliteral(state, "package");
+            lua_setfield(state, -2, "module");
+        }
+        lua_settop(state, top);
+
+        internal::preloadLazyLibs(state);
+    }
+
+    void State::copyLibs(const State& prototype)
+    {
+        if(!state || !prototype.state)
+            throw uninitialized_resource("lua::State::copyLibs");
+
+        lua_State* other = prototype.state;
+        internal::growStack(other, 3);
+        int top = lua_gettop(other);
+        luaL_getsubtable(other, LUA_REGISTRYINDEX, "_LOADED");
+        lua_rawgetp(other, LUA_REGISTRYINDEX, &internal::lazyLibsKey);
+        for(int i = static_cast<int>(Lib::base); i < static_cast<int>(Lib::all); ++i)
+        {
+            Lib lib = static_cast<Lib>(i);
+            lua_getfield(other, top + 1, getLibraryName(lib));
+            bool loaded = !lua_isnil(other, -1);
+            lua_pop(other, 1);
+            bool lazy = false;
+            if(lua_istable(other, top + 2))
+            {
+                lua_getfield(other, top + 2, getLibraryName(lib));
+                lazy = !lua_isnil(other, -1);
+                lua_pop(other, 1);
+            }
+
+            if(loaded)
+                loadLib(lib);
+            else if(lazy)
+                loadLibLazy(lib);
+        }
+        lua_settop(other, top);
+    }
+
 
 
     namespace internal
@@ -740,7 +8457,7 @@ namespace lua
         LuaString emptyString;
         LuaTable emptyTable;
 
-        std::set <Object> emptySet;
+        ObjectSet emptySet;
         std::vector <std::string> emptyVector;
 
         void* toUserData(lua_State* state, int upvalueindex)
@@ -765,12 +8482,37 @@ namespace lua
             lua_getglobal(state, function);
         }
 
-        std::vector <Object> callLuaFunction(lua_State* state, int nargs)
+        void getEnvironmentField(lua_State* state, int reference, const char* name)
+        {
+            growStack(state, 3);
+            lua_rawgeti(state, LUA_REGISTRYINDEX, reference);
+            if(!lua_getupvalue(state, -1, 1))
+            {
+                //not a valid environment; calling nil reports the error
+                lua_pop(state, 1);
+                lua_pushnil(state);
+                return;
+            }
+            lua_getfield(state, -1, name);
+            lua_replace(state, -3);
+            lua_pop(state, 1);
+        }
+
+        std::vector <Object> callLuaFunction(lua_State* state, int nargs, const char* name, bool environment)
         {
+            int kind = environment ? Recorder::environment : 0;
+            Recorder* recorder = name ? getRecorder(state) : nullptr;
+            std::vector <Object> args;
+            if(recorder)
+                args = recordValues(state, lua_gettop(state) - nargs + 1, nargs);
+            std::uint64_t begin = recorder ? traceClock() : 0;
+
             if(lua_pcall(state, nargs, LUA_MULTRET, 0) != 0)
             {
                 Object err = internal::GetStackVar<Object>()(state, -1);
                 lua_pop(state, 1);
+                if(recorder)
+                    recorder->write(kind | Recorder::failed, name, args, std::vector <Object>(1, err), begin, traceClock());
                 std::stringstream ss;
                 ss << "lua::State::call - " << err;
                 throw script_error(ss.str());
@@ -785,10 +8527,59 @@ namespace lua
                 ret[--retsLeft] = std::move(obj);
             }
 
+            if(recorder)
+                recorder->write(kind, name, args, ret, begin, traceClock());
             return ret;
         }
 
 
+        //Pushes the table graph reachable from root, creating each distinct table only once.
+        static void pushWeakTable(lua_State* state, LuaWeakTable root)
+        {
+            growStack(state, 4);
+            //maps each LuaTable's address to the Lua table created for it
+            lua_newtable(state);
+            int created = lua_gettop(state);
+
+            std::vector <LuaWeakTable> pending;
+            auto pushReference = [&](const Object& obj)
+            {
+                if(!obj.isWeakTable())
+                {
+                    pushVar(state, obj);
+                    return;
+                }
+
+                //the stack may already hold created, the root, the table being filled and a key
+                growStack(state, 2);
+                LuaWeakTable t = obj.getWeakTable();
+                lua_rawgetp(state, created, t);
+                if(lua_isnil(state, -1))
+                {
+                    lua_pop(state, 1);
+                    lua_createtable(state, 0, t->size());
+                    lua_pushvalue(state, -1);
+                    lua_rawsetp(state, created, t);
+                    pending.push_back(t);
+                }
+            };
+
+            pushReference(Object::makeWeakTable(root));
+            for(std::size_t i = 0; i < pending.size(); ++i)
+            {
+                lua_rawgetp(state, created, pending[i]);
+                for(auto& p : *pending[i])
+                {
+                    pushReference(p.first);
+                    pushReference(p.second);
+                    lua_rawset(state, -3);
+                }
+                lua_pop(state, 1);
+            }
+
+            lua_remove(state, created);
+        }
+
         void PushVar<Object>::operator()(lua_State* state, Object object) const
         {
             internal::growStack(state, 1);
@@ -819,6 +8610,9 @@ namespace lua
                 case Object::BOOLEAN:
                     lua_pushboolean(state, object.getBoolean());
                     break;
+                case Object::WEAK_TABLE:
+                    pushWeakTable(state, object.getWeakTable());
+                    break;
                 default:
                     throw type_mismatch("lua::PushVar<Object>");
                     break;
@@ -868,7 +8662,7 @@ namespace lua
         }
 
 
-        Object GetStackVar<Object>::operator()(lua_State* state, int index, const std::set<Object>& ignoreList, int level) const
+        Object GetStackVar<Object>::operator()(lua_State* state, int index, const ObjectSet& ignoreList, int level) const
         {
             if(level <= 0)
             {
@@ -891,15 +8685,21 @@ namespace lua
                     obj = Object::makeNumber(lua_tonumber(state, index));
                     break;
                 case LUA_TSTRING:
-                    obj = Object::makeString(lua_tostring(state, index));
+                {
+                    std::size_t size;
+                    const char* str = lua_tolstring(state, index, &size);
+                    obj = Object::makeString(LuaString(str, size));
                     break;
+                }
                 case LUA_TTABLE:
                 {
-                    std::map <Object, Object> table;
+                    LuaTable table;
 
                     internal::growStack(state, 2);
+                    int top = lua_gettop(state);
+                    int contents = contentsIndex(state, index);
                     lua_pushnil(state);
-                    while (lua_next(state, index) != 0)
+                    while (lua_next(state, contents) != 0)
                     {
                         Object key = GetStackVar<Object>()(state, -2, emptySet, level - 1);
                         if(ignoreList.find(key) != ignoreList.end())
@@ -917,7 +8717,8 @@ namespace lua
                         lua_pop(state, 1);
                     }
 
-                    obj = Object::makeTable(table);
+                    lua_settop(state, top);
+                    obj = Object::makeTable(std::move(table));
 
                     break;
                 }
@@ -937,6 +8738,81 @@ namespace lua
             return obj;
         }
 
+        ObjectGraph GetStackVar<ObjectGraph>::operator()(lua_State* state, int index, const ObjectSet& ignoreList) const
+        {
+            index = lua_absindex(state, index);
+
+            ObjectGraph graph;
+            if(!lua_istable(state, index))
+            {
+                graph.root = GetStackVar<Object>()(state, index);
+                return graph;
+            }
+
+            //Tables are converted breadth-first.  Each newly found table is appended to a scratch
+            //Lua table in the same order as graph.tables, so no native recursion is needed and
+            //the Lua stack never holds more than a few values.
+            growStack(state, 4);
+            lua_newtable(state);
+            int pending = lua_gettop(state);
+
+            std::unordered_map <const void*, LuaWeakTable> converted;
+            auto reference = [&](int valueIndex) -> Object
+            {
+                if(!lua_istable(state, valueIndex))
+                    return GetStackVar<Object>()(state, valueIndex);
+
+                const void* identity = lua_topointer(state, valueIndex);
+                auto found = converted.find(identity);
+                if(found != converted.end())
+                    return Object::makeWeakTable(found->second);
+
+                graph.tables.push_back(std::unique_ptr<LuaTable>(new LuaTable));
+                LuaWeakTable t = graph.tables.back().get();
+                converted[identity] = t;
+
+                lua_pushvalue(state, valueIndex);
+                lua_rawseti(state, pending, graph.tables.size());
+                return Object::makeWeakTable(t);
+            };
+
+            //tables are compared by identity, so a table just found in Lua can never be in the ignore list
+            auto ignored = [&](int valueIndex) -> bool
+            {
+                if(ignoreList.empty() || lua_istable(state, valueIndex))
+                    return false;
+                return ignoreList.find(GetStackVar<Object>()(state, valueIndex)) != ignoreList.end();
+            };
+
+            graph.root = reference(index);
+            for(std::size_t i = 0; i < graph.tables.size(); ++i)
+            {
+                lua_rawgeti(state, pending, i + 1);
+                int table = contentsIndex(state, -1);
+                LuaTable& out = *graph.tables[i];
+
+                lua_pushnil(state);
+                while(lua_next(state, table) != 0)
+                {
+                    //as in GetStackVar<Object>, the ignore list only applies to the top-level table.  It is checked
+                    //before converting, so the tables of ignored entries are never added to the graph.
+                    if(i == 0 && (ignored(table + 1) || ignored(table + 2)))
+                    {
+                        lua_pop(state, 1);
+                        continue;
+                    }
+                    Object key = reference(table + 1);
+                    out[std::move(key)] = reference(table + 2);
+                    lua_pop(state, 1);
+                }
+
+                lua_settop(state, pending);
+            }
+
+            lua_pop(state, 1);
+            return graph;
+        }
+
         LuaNumber GetStackVar<LuaNumber>::operator()(lua_State* state, int index) const
         {
             if(!lua_isnumber(state, index))
@@ -972,11 +8848,13 @@ namespace lua
 
             if(!lua_istable(state, index))
                 throw type_mismatch("lua::GetStackVar<LuaFunction>");
-            std::map <Object, Object> table;
+            LuaTable table;
 
             internal::growStack(state, 2);
+            int top = lua_gettop(state);
+            int contents = contentsIndex(state, index);
             lua_pushnil(state);
-            while (lua_next(state, index) != 0)
+            while (lua_next(state, contents) != 0)
             {
                 Object key = GetStackVar<Object>()(state, -2, emptySet, level - 1);
                 if(key == Object::makeString("_G") || key == Object::makeString("base"))
@@ -989,6 +8867,7 @@ namespace lua
                 lua_pop(state, 1);
             }
 
+            lua_settop(state, top);
             return table;
         }
 
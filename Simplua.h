@@ -23,10 +23,19 @@
 #pragma once
 
 #include <string>
+#include <iosfwd>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
 #include <vector>
 #include <tuple>
+#include <memory>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <cstdint>
 #include <stdexcept>
 
 //Note that lua.hpp is not included.
@@ -42,6 +51,9 @@ class lua_State;
 #define LUA_MAX_TABLE_RECURSION 8
 //If this not defined, no exception is thrown; rather, any elements past the limit are set to nil.
 #define LUA_THROW_TABLE_TOO_DEEP
+//If this is defined, LuaTable is a hash table (std::unordered_map) with O(1) lookups instead of a std::map,
+//and ignore lists are hash sets.  Tables are then iterated in no particular order.
+//#define LUA_UNORDERED_TABLES
 
 namespace lua
 {
@@ -77,6 +89,14 @@ namespace lua
         {}
     };
 
+    class parse_error : public std::runtime_error
+    {
+    public:
+        explicit parse_error(const std::string& what)
+        : runtime_error(what)
+        {}
+    };
+
     class uninitialized_resource : public std::logic_error
     {
     public:
@@ -92,12 +112,18 @@ namespace lua
     typedef double LuaNumber;
     typedef int LuaInteger;  //you might want to change this to long long
     typedef std::string LuaString;
+#ifdef LUA_UNORDERED_TABLES
+    typedef std::unordered_map <Object, Object> LuaTable;
+    typedef std::unordered_set <Object> ObjectSet;
+#else
     typedef std::map <Object, Object> LuaTable;
+    typedef std::set <Object> ObjectSet;
+#endif
     typedef int (*LuaFunction)(lua_State*);
     typedef bool LuaBoolean;
     typedef void* LuaUserdata;
     typedef lua_State* LuaThread;
-    typedef std::map <Object, Object>* LuaWeakTable;
+    typedef LuaTable* LuaWeakTable;
 
 
     namespace internal
@@ -112,6 +138,9 @@ namespace lua
     //If the internal type of the Object does not match the requested type, it throws a type_mismatch.
     //If you cannot handle the exception, check the type yourself with the is* member functions.
     //Note that Objects are immutable except when moved.
+    //Strings and tables are reference counted, so copying an Object never copies them.
+    //Tables are compared by identity, as in Lua: copies of a table Object share the same table and are equal,
+    //but two tables made separately are not, even if their contents are the same.
     class Object
     {
     private:
@@ -128,12 +157,14 @@ namespace lua
             LuaNumber num;
             LuaFunction func;
             LuaBoolean boolean;
+            LuaWeakTable weakTable;
             //LuaUserdata userdata;
             //LuaThread thread;
         };
         //these members cannot be in the union, unfortunately
-        LuaString str;
-        LuaTable table;
+        //they are shared between copies, which also gives tables an identity
+        std::shared_ptr <const LuaString> str;
+        std::shared_ptr <const LuaTable> table;
 
     public:
         static const int NIL = 0;
@@ -159,7 +190,9 @@ namespace lua
         static Object makeNumber(LuaNumber d = LuaNumber());
         static Object makeInteger(LuaInteger i = LuaInteger());
         static Object makeString(const LuaString& s = internal::emptyString);
+        static Object makeString(LuaString&& s);
         static Object makeTable(const LuaTable& m = internal::emptyTable);
+        static Object makeTable(LuaTable&& m);
         static Object makeFunction(LuaFunction f);
         static Object makeBoolean(LuaBoolean b = LuaBoolean());
         static Object makeWeakTable(LuaWeakTable t);
@@ -180,6 +213,11 @@ namespace lua
         LuaBoolean getBoolean() const;
         LuaWeakTable getWeakTable() const;
 
+        //Returns the table for modification.  If other Objects share the table, it is copied first,
+        //so they are not affected and this Object gets a new identity.
+        //Throws type_mismatch if the Object is not a table.
+        LuaTable& editTable();
+
         //is* functions return true only if the Object's dynamic type is the one being checked.
         //Use these if you need to guarantee that no type_mismatch exceptions will be thrown.
         bool isNil() const;
@@ -203,6 +241,209 @@ namespace lua
     };
 
     std::ostream& operator <<(std::ostream& out, const Object& obj);
+}//namespace lua
+
+namespace std
+{
+    //Hashes Objects consistently with Object::operator ==, so they can be used in unordered containers.
+    template <>
+    struct hash<lua::Object>
+    {
+        std::size_t operator()(const lua::Object& obj) const;
+    };
+}//namespace std
+
+namespace lua
+{
+
+    namespace internal
+    {
+        template <typename T>
+        struct GetStackVar;
+    }//namespace internal
+
+    //The result of converting a Lua value while preserving the identity of its tables.
+    //Every Lua table is converted exactly once, no matter how many times it is referenced.
+    //Tables are stored inside the graph and referenced by weak table Objects, so shared
+    //subtables are shared in C++ as well and cycles are represented rather than rejected.
+    //The weak table Objects are only valid for the lifetime of the graph that owns them.
+    class ObjectGraph
+    {
+        friend struct internal::GetStackVar<ObjectGraph>;
+
+        std::vector <std::unique_ptr<LuaTable>> tables;
+        Object root;
+
+    public:
+        ObjectGraph();
+
+        ObjectGraph(const ObjectGraph& rhs) = delete;
+        ObjectGraph& operator =(const ObjectGraph& rhs) = delete;
+
+        ObjectGraph(ObjectGraph&& rhs);
+        ObjectGraph& operator =(ObjectGraph&& rhs);
+
+        //Returns the converted value.  If it is a table, this is a weak table Object.
+        const Object& getRoot() const;
+        //Returns the number of distinct tables that were converted.
+        std::size_t getTableCount() const;
+    };
+
+    //A string inside a buffer owned by someone else.  The characters are not null terminated.
+    struct StringSlice
+    {
+        const char* data;
+        std::size_t size;
+    };
+
+    //The element types of a Buffer.
+    enum class BufferType
+    {
+        uint8,
+        int8,
+        uint16,
+        int16,
+        uint32,
+        int32,
+        float32,
+        float64
+    };
+
+    namespace internal
+    {
+        template <typename T>
+        struct BufferTypeOf;
+
+        template <> struct BufferTypeOf<std::uint8_t> {static const BufferType value = BufferType::uint8;};
+        template <> struct BufferTypeOf<std::int8_t> {static const BufferType value = BufferType::int8;};
+        template <> struct BufferTypeOf<std::uint16_t> {static const BufferType value = BufferType::uint16;};
+        template <> struct BufferTypeOf<std::int16_t> {static const BufferType value = BufferType::int16;};
+        template <> struct BufferTypeOf<std::uint32_t> {static const BufferType value = BufferType::uint32;};
+        template <> struct BufferTypeOf<std::int32_t> {static const BufferType value = BufferType::int32;};
+        template <> struct BufferTypeOf<float> {static const BufferType value = BufferType::float32;};
+        template <> struct BufferTypeOf<double> {static const BufferType value = BufferType::float64;};
+    }//namespace internal
+
+    //Elements in memory owned by someone else.
+    template <typename T>
+    struct Span
+    {
+        T* data;
+        std::size_t size;
+
+        T* begin() const
+        {
+            return data;
+        }
+
+        T* end() const
+        {
+            return data + size;
+        }
+
+        T& operator[](std::size_t i) const
+        {
+            return data[i];
+        }
+    };
+
+    //The memory of a buffer userdata, which scripts index from 1 to #buffer like an array of numbers.
+    //The memory is either owned by Lua (see State::newBuffer) or by the host (see State::setBuffer),
+    //and is never copied.  A Buffer is only valid while Lua keeps the userdata, or the host keeps its memory.
+    //Registered functions may take a Buffer or a Span of the buffer's element type as an argument.
+    class Buffer
+    {
+        friend class State;
+        friend struct internal::GetStackVar<Buffer>;
+
+        void* data;
+        std::size_t size;
+        BufferType type;
+
+        Buffer(void* data, std::size_t size, BufferType type);
+
+    public:
+        Buffer();
+
+        void* getData() const;
+        //Returns the number of elements.
+        std::size_t getSize() const;
+        BufferType getType() const;
+
+        //Throws type_mismatch if T does not match the element type.
+        template <typename T>
+        Span<T> getSpan() const
+        {
+            if(internal::BufferTypeOf<T>::value != type)
+                throw type_mismatch("lua::Buffer::getSpan");
+            Span<T> span = {static_cast<T*>(data), size};
+            return span;
+        }
+    };
+
+    //Starts or stops recording spans for State::run, State::call, State::loadFile and registered native functions.
+    //Each thread records into its own buffer without locking.
+    void setTracing(bool enabled);
+    bool isTracing();
+    //Writes the recorded spans in the Chrome trace event format, which chrome://tracing and Perfetto can open.
+    //This may be done while spans are being recorded.
+    void writeTraceJson(std::ostream& out);
+    void writeTraceJson(std::string& buffer);
+    //Discards the recorded spans.  No other thread may be recording or writing spans at the same time.
+    void clearTrace();
+
+    //Simplua's binary format is a four byte header ("SLB" followed by the format version)
+    //and a single value encoded with the MessagePack type system: integral numbers are stored
+    //as integers, tables with the keys 1..n as arrays and all other tables as maps.
+    //Functions and other values that only make sense within one process cannot be serialized.
+    const unsigned char BINARY_VERSION = 1;
+
+    //Appends the binary form of obj to out.
+    //Throws type_mismatch for functions and table_too_deep if a weak table contains itself or tables are nested more than 1000 deep.
+    void writeBinary(const Object& obj, std::string& out);
+    //Reads a value written by writeBinary or State::writeBinary.
+    //Throws parse_error if the data is invalid or was written by an unsupported version.
+    Object readBinary(const char* data, std::size_t size);
+
+    //Parses a Lua data file: a sequence of assignments of constants and table constructors to global variables
+    //or fields of tables assigned before, such as e = {} and e.key["embedded"] = "e_val".  Nothing is run, and any
+    //other code is rejected.  Returns the assigned globals.  Throws parse_error if the text is not a data file.
+    LuaTable parseData(const char* data, std::size_t size);
+
+    //Reads the binary format one value at a time without copying.  Strings are returned as slices of the buffer,
+    //which must outlive them.  Every function throws parse_error if the data is invalid.
+    class BinaryReader
+    {
+        const char* begin;
+        const char* p;
+        const char* end;
+
+        unsigned char next();
+        unsigned long long readBigEndian(int bytes);
+        void need(std::size_t bytes) const;
+        void fail(const char* what) const;
+
+    public:
+        //Reads and checks the header.
+        BinaryReader(const char* data, std::size_t size);
+
+        //Returns the Object type (NIL, NUMBER, STRING, TABLE or BOOLEAN) of the next value.
+        int peekType() const;
+        void readNil();
+        LuaNumber readNumber();
+        LuaBoolean readBoolean();
+        StringSlice readString();
+        //Reads the start of a table and returns its number of entries.
+        //An array is followed by that many values (its keys are 1..n), and a map by that many key/value pairs.
+        std::size_t readTable(bool& isArray);
+        //Skips the next value, including everything inside it.
+        void skip();
+
+        //Returns true when every value has been read.
+        bool atEnd() const;
+        //Returns the number of bytes read so far, including the header.
+        std::size_t getOffset() const;
+    };
 
     namespace internal
     {
@@ -275,6 +516,15 @@ namespace lua
                 return Object::makeWeakTable(t);
             }
         };
+
+        template <>
+        struct MakeObject<Object>
+        {
+            Object operator()(const Object& o) const
+            {
+                return o;
+            }
+        };
     } //namespace internal
 
     template <typename T>
@@ -286,7 +536,7 @@ namespace lua
 
     namespace internal
     {
-        extern std::set <Object> emptySet;
+        extern ObjectSet emptySet;
         extern std::vector <std::string> emptyVector;
 
         //this function is defined later
@@ -357,7 +607,14 @@ namespace lua
         template <>
         struct GetStackVar<Object>
         {
-             Object operator()(lua_State* state, int index, const std::set<Object>& ignoreList = emptySet, int level = LUA_MAX_TABLE_RECURSION) const;
+             Object operator()(lua_State* state, int index, const ObjectSet& ignoreList = emptySet, int level = LUA_MAX_TABLE_RECURSION) const;
+        };
+
+        //Converts without a recursion limit or native recursion; see ObjectGraph.
+        template <>
+        struct GetStackVar<ObjectGraph>
+        {
+             ObjectGraph operator()(lua_State* state, int index, const ObjectSet& ignoreList = emptySet) const;
         };
 
         template <>
@@ -396,6 +653,21 @@ namespace lua
             LuaBoolean operator()(lua_State* state, int index) const;
         };
 
+        template <>
+        struct GetStackVar<Buffer>
+        {
+            Buffer operator()(lua_State* state, int index) const;
+        };
+
+        template <typename T>
+        struct GetStackVar<Span<T>>
+        {
+            Span<T> operator()(lua_State* state, int index) const
+            {
+                return GetStackVar<Buffer>()(state, index).template getSpan<T>();
+            }
+        };
+
 
 
         template<int... Args>
@@ -526,38 +798,245 @@ namespace lua
         void throwLuaError(lua_State* state, const char* str);
         int getStackTop(lua_State* state);
         void getGlobal(lua_State* state, const char*);
-        std::vector <Object> callLuaFunction(lua_State* state, int nargs);
+        //Records the call if name is not null and the State is recording.
+        std::vector <Object> callLuaFunction(lua_State* state, int nargs, const char* name, bool environment = false);
+        void getEnvironmentField(lua_State* state, int reference, const char* name);
+
+        //true while spans are being recorded (see setTracing)
+        extern std::atomic <bool> tracing;
+
+        //Records a span from its construction to its destruction if tracing was enabled when it began.
+        class TraceSpan
+        {
+            const char* name;
+            std::string detail;
+            std::uint64_t begin;
+            bool active;
+
+            void start();
+            void startNative(lua_State* state);
+            void finish();
+
+        public:
+            TraceSpan(const char* name, const std::string& detail)
+            : name(name), active(tracing.load(std::memory_order_relaxed))
+            {
+                if(active)
+                {
+                    this->detail = detail;
+                    start();
+                }
+            }
+
+            //A span for the native function that state is running, named as the caller named it.
+            explicit TraceSpan(lua_State* state)
+            : name("native"), active(tracing.load(std::memory_order_relaxed))
+            {
+                if(active)
+                    startNative(state);
+            }
+
+            ~TraceSpan()
+            {
+                if(active)
+                    finish();
+            }
+
+            TraceSpan(const TraceSpan& rhs) = delete;
+            TraceSpan& operator =(const TraceSpan& rhs) = delete;
+        };
+
+        //the number of States recording (see State::startRecording)
+        extern std::atomic <int> recordingStates;
+
+        //Records a native function call if the State is recording.  Nothing is recorded unless finish or fail is called.
+        //None of its functions throw.
+        class NativeRecord
+        {
+            lua_State* state;
+            void* recorder;
+            std::string name;
+            std::vector <Object> args;
+            std::uint64_t begin;
+
+            void start();
+            void write(int results, const char* error);
+
+        public:
+            explicit NativeRecord(lua_State* state)
+            : state(state), recorder(nullptr), begin(0)
+            {
+                if(recordingStates.load(std::memory_order_relaxed) > 0)
+                    start();
+            }
+
+            //Records the results on top of the stack.  Returns results.
+            int finish(int results)
+            {
+                if(recorder)
+                    write(results, nullptr);
+                return results;
+            }
+
+            //Records that the call failed with error.
+            void fail(const char* error)
+            {
+                if(recorder)
+                    write(0, error);
+            }
+
+            NativeRecord(const NativeRecord& rhs) = delete;
+            NativeRecord& operator =(const NativeRecord& rhs) = delete;
+        };
+
+        //the number of States replaying with recorded native results (see State::replay)
+        extern std::atomic <int> replayingStates;
+
+        //Pushes the recorded results of the native call state is making and returns their number, or returns -1.
+        //Raises the recorded error, or an error if no recorded call matches.
+        int pushReplayedResults(lua_State* state);
+
+        //Returns -1 unless the State is replaying with recorded native results, in which case the native
+        //function must not be called; see pushReplayedResults.
+        inline int replayNative(lua_State* state)
+        {
+            if(replayingStates.load(std::memory_order_relaxed) == 0)
+                return -1;
+            return pushReplayedResults(state);
+        }
 
         //A version of this function is used when functions are registered.
         template <typename R, typename... Args>
         int registeredCFunction(lua_State* state)
         {
-            try
+            //State::replay may answer the call from a recording instead
+            int replayed = replayNative(state);
+            if(replayed >= 0)
+                return replayed;
+
+            const char* error;
             {
-                typedef R (*TypedFunction)(Args...);
-                //get the actual function pointer from Lua's storage
-                TypedFunction func = (TypedFunction)toUserData(state, 1);//lua_touserdata(state, lua_upvalueindex(1));
-                //get the arguments from Lua's stack
-                auto args = CallPrepareArgs<sizeof...(Args), Args...>()(state, 1);
-                if(std::tuple_size<decltype(args)>::value != (unsigned)getStackTop(state))
-                    throw type_mismatch("registeredCFunction");
-                //call the function and push the return values onto the stack
-                return PushReturnValuesIfNotVoid<R, TypedFunction, decltype(args)>()(state, func, std::move(args));
+                NativeRecord record(state);
+                try
+                {
+                    TraceSpan span(state);
+                    typedef R (*TypedFunction)(Args...);
+                    //get the actual function pointer from Lua's storage
+                    TypedFunction func = (TypedFunction)toUserData(state, 1);//lua_touserdata(state, lua_upvalueindex(1));
+                    //get the arguments from Lua's stack
+                    auto args = CallPrepareArgs<sizeof...(Args), Args...>()(state, 1);
+                    if(std::tuple_size<decltype(args)>::value != (unsigned)getStackTop(state))
+                        throw type_mismatch("registeredCFunction");
+                    //call the function and push the return values onto the stack
+                    return record.finish(PushReturnValuesIfNotVoid<R, TypedFunction, decltype(args)>()(state, func, std::move(args)));
+                }
+                catch(const type_mismatch& e)
+                {
+                    error = "Native function: type mismatch";
+                }
+                catch(...)
+                {
+                    error = "Native function: unknown exception";
+                }
+                record.fail(error);
             }
-            catch(const type_mismatch& e)
+            //the record is destroyed first, since Lua does not unwind the C++ stack
+            throwLuaError(state, error);
+
+            //this can't actually happen
+            return 0;
+        }
+
+
+        //Helper functions for registerPureFunction
+        int pushPureResults(lua_State* state, void* function, std::vector <Object>& args);
+        void storePureResults(lua_State* state, void* function, std::vector <Object>&& args, const std::vector <Object>& results);
+
+        template <typename Tuple, int... I>
+        std::vector <Object> tupleToObjects(const Tuple& t, Sequence<I...>)
+        {
+            return std::vector <Object>{MakeObject<typename std::tuple_element<I, Tuple>::type>()(std::get<I>(t))...};
+        }
+
+        template <typename R, typename F, typename Args>
+        struct CallPure
+        {
+            std::vector <Object> operator()(F func, Args&& args) const
             {
-                throwLuaError(state, "Native function: type mismatch");
+                auto u = makeUnpacker(func, std::move(args));
+                return std::vector <Object>{MakeObject<R>()(u.call())};
             }
-            catch(...)
+        };
+
+        template <typename F, typename Args>
+        struct CallPure <std::vector<Object>, F, Args>
+        {
+            std::vector <Object> operator()(F func, Args&& args) const
+            {
+                return makeUnpacker(func, std::move(args)).call();
+            }
+        };
+
+        template <typename F, typename Args>
+        struct CallPure <void, F, Args>
+        {
+            std::vector <Object> operator()(F func, Args&& args) const
+            {
+                makeUnpacker(func, std::move(args)).call();
+                return std::vector <Object>();
+            }
+        };
+
+        //The version of registeredCFunction used by registerPureFunction.
+        template <typename R, typename... Args>
+        int registeredPureCFunction(lua_State* state)
+        {
+            int replayed = replayNative(state);
+            if(replayed >= 0)
+                return replayed;
+
+            const char* error;
             {
-                throwLuaError(state, "Native function: unknown exception");
+                NativeRecord record(state);
+                try
+                {
+                    TraceSpan span(state);
+                    typedef R (*TypedFunction)(Args...);
+                    TypedFunction func = (TypedFunction)toUserData(state, 1);
+                    auto args = CallPrepareArgs<sizeof...(Args), Args...>()(state, 1);
+                    if(std::tuple_size<decltype(args)>::value != (unsigned)getStackTop(state))
+                        throw type_mismatch("registeredPureCFunction");
+
+                    std::vector <Object> key = tupleToObjects(args, typename SequenceGenerator<sizeof...(Args)>::type());
+                    int cached = pushPureResults(state, (void*)func, key);
+                    if(cached >= 0)
+                        return record.finish(cached);
+
+                    std::vector <Object> results = CallPure<R, TypedFunction, decltype(args)>()(func, std::move(args));
+                    storePureResults(state, (void*)func, std::move(key), results);
+                    return record.finish(PushReturnValues<std::vector<Object>>()(state, results));
+                }
+                catch(const type_mismatch& e)
+                {
+                    error = "Native function: type mismatch";
+                }
+                catch(...)
+                {
+                    error = "Native function: unknown exception";
+                }
+                record.fail(error);
             }
+            throwLuaError(state, error);
 
             //this can't actually happen
             return 0;
         }
 
 
+        inline void pushArgs(lua_State*)
+        {
+        }
+
         template <typename T>
         void pushArgs(lua_State* state, T t)
         {
@@ -573,6 +1052,172 @@ namespace lua
     }//namespace internal
 
 
+    namespace internal
+    {
+        //The shared state of an asynchronous call; defined in Simplua.cpp.
+        struct AsyncSlot;
+
+        //Sets the result of an asynchronous call.  push pushes the results onto a Lua stack and returns their number.
+        //Only the first result given is used.
+        void completeAsync(AsyncSlot& slot, std::function<int(lua_State*)> push);
+        void failAsync(AsyncSlot& slot, const std::string& error);
+        std::shared_ptr <AsyncSlot> newAsyncSlot();
+
+        template <typename R>
+        struct CompleteAsync
+        {
+            void operator()(AsyncSlot& slot, R value) const
+            {
+                auto shared = std::make_shared<R>(std::move(value));
+                completeAsync(slot, [shared](lua_State* state) { return PushReturnValues<R>()(state, *shared); });
+            }
+        };
+    }//namespace internal
+
+    //Lets an asynchronous native function (see State::registerAsyncFunction) finish later, from any thread.
+    //Copies refer to the same call.  If no copy is ever completed, the calling script waits forever.
+    template <typename R>
+    class Completion
+    {
+        std::shared_ptr <internal::AsyncSlot> slot;
+
+    public:
+        explicit Completion(const std::shared_ptr<internal::AsyncSlot>& slot)
+        : slot(slot)
+        {}
+
+        //Makes the call return value to the script.
+        void complete(R value)
+        {
+            internal::CompleteAsync<R>()(*slot, std::move(value));
+        }
+
+        //Makes the call raise a Lua error with the message error.
+        void fail(const std::string& error)
+        {
+            internal::failAsync(*slot, error);
+        }
+    };
+
+    namespace internal
+    {
+        //Installs a poll function that gets the result of future when it is ready.
+        void pollAsync(AsyncSlot& slot, std::function<bool(AsyncSlot&, bool)> poll);
+        //Waits for slot on behalf of the running script.  Returns the number of results pushed if the call
+        //has finished (waiting for it first if the script cannot yield), asyncYield if the script must yield,
+        //or asyncError with the error message pushed.
+        int beginAsync(lua_State* state, const std::shared_ptr<AsyncSlot>& slot);
+        //Returns results, raises the pushed error, or yields until the call finishes.
+        //It is called last so that no C++ object is alive when Lua unwinds the native function.
+        int finishAsyncCall(lua_State* state, int results);
+
+        static const int asyncYield = -1;
+        static const int asyncError = -2;
+
+        template <typename R>
+        struct GetFutureResult
+        {
+            void operator()(AsyncSlot& slot, std::future<R>& future) const
+            {
+                CompleteAsync<R>()(slot, future.get());
+            }
+        };
+
+        template <>
+        struct GetFutureResult <void>
+        {
+            void operator()(AsyncSlot& slot, std::future<void>& future) const
+            {
+                future.get();
+                completeAsync(slot, [](lua_State*) { return 0; });
+            }
+        };
+
+        //Converts the arguments and starts the call, catching every exception.
+        template <typename R, typename... Args>
+        int startFutureCall(lua_State* state)
+        {
+            try
+            {
+                typedef std::future<R> (*TypedFunction)(Args...);
+                TypedFunction func = (TypedFunction)toUserData(state, 1);
+                auto args = CallPrepareArgs<sizeof...(Args), Args...>()(state, 1);
+                if(std::tuple_size<decltype(args)>::value != (unsigned)getStackTop(state))
+                    throw type_mismatch("registeredFutureCFunction");
+
+                auto future = std::make_shared<std::future<R>>(makeUnpacker(func, std::move(args)).call());
+                std::shared_ptr <AsyncSlot> slot = newAsyncSlot();
+                pollAsync(*slot, [future](AsyncSlot& slot, bool wait)
+                {
+                    if(!wait && future->wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                        return false;
+                    try
+                    {
+                        GetFutureResult<R>()(slot, *future);
+                    }
+                    catch(const std::exception& e)
+                    {
+                        failAsync(slot, e.what());
+                    }
+                    catch(...)
+                    {
+                        failAsync(slot, "Native function: unknown exception");
+                    }
+                    return true;
+                });
+                return beginAsync(state, slot);
+            }
+            catch(const type_mismatch& e)
+            {
+                pushArgs(state, LuaString("Native function: type mismatch"));
+            }
+            catch(...)
+            {
+                pushArgs(state, LuaString("Native function: unknown exception"));
+            }
+            return asyncError;
+        }
+
+        template <typename R, typename... Args>
+        int startCompletionCall(lua_State* state)
+        {
+            try
+            {
+                typedef void (*TypedFunction)(Completion<R>, Args...);
+                TypedFunction func = (TypedFunction)toUserData(state, 1);
+                auto args = CallPrepareArgs<sizeof...(Args), Args...>()(state, 1);
+                if(std::tuple_size<decltype(args)>::value != (unsigned)getStackTop(state))
+                    throw type_mismatch("registeredCompletionCFunction");
+
+                std::shared_ptr <AsyncSlot> slot = newAsyncSlot();
+                makeUnpacker(func, std::tuple_cat(std::make_tuple(Completion<R>(slot)), std::move(args))).call();
+                return beginAsync(state, slot);
+            }
+            catch(const type_mismatch& e)
+            {
+                pushArgs(state, LuaString("Native function: type mismatch"));
+            }
+            catch(...)
+            {
+                pushArgs(state, LuaString("Native function: unknown exception"));
+            }
+            return asyncError;
+        }
+
+        template <typename R, typename... Args>
+        int registeredFutureCFunction(lua_State* state)
+        {
+            return finishAsyncCall(state, startFutureCall<R, Args...>(state));
+        }
+
+        template <typename R, typename... Args>
+        int registeredCompletionCFunction(lua_State* state)
+        {
+            return finishAsyncCall(state, startCompletionCall<R, Args...>(state));
+        }
+    }//namespace internal
+
+
     enum class Lib
     {
         base = 1,
@@ -585,14 +1230,160 @@ namespace lua
         math,
         debug,
         package,
+        //sleep, after, every and cancel, driven by State::tick
+        timer,
+        //sum, dot, scale, min, max, clamp and prefix over buffers and tables of numbers, using SIMD where available
+        vmath,
+        //the standard libraries, base to package
         all
     };
 
+    class Channel;
+    class ModuleArchive;
+
+    //A Lua value kept alive in the registry of the State that created it.
+    //Handles can be moved but not copied, and must not outlive their State.
+    class Handle
+    {
+        friend class State;
+
+    protected:
+        lua_State* state;
+        int reference;
+
+        Handle(lua_State* state, int reference);
+
+    public:
+        Handle();
+        ~Handle();
+
+        Handle(const Handle& rhs) = delete;
+        Handle& operator =(const Handle& rhs) = delete;
+
+        Handle(Handle&& rhs);
+        Handle& operator =(Handle&& rhs);
+
+        bool isValid() const;
+    };
+
+    //A compiled chunk that can be run in any number of Environments (see State::takeChunk).
+    class Chunk : public Handle
+    {
+        friend class State;
+        using Handle::Handle;
+
+    public:
+        Chunk() = default;
+    };
+
+    //A separate set of globals for running chunks (see State::newEnvironment).
+    class Environment : public Handle
+    {
+        friend class State;
+        using Handle::Handle;
+
+    public:
+        Environment() = default;
+    };
+
+    //A change to a watched table reported by State::collectChanges.
+    struct Change
+    {
+        //the name the table was watched with
+        std::string table;
+        Object key;
+        //the value after the change; nil if the key was removed
+        Object value;
+    };
+
+    //Counters for the chunk cache (see State::setChunkCacheCapacity).
+    struct ChunkCacheStats
+    {
+        std::size_t hits;
+        std::size_t misses;
+        //the number of chunks currently cached
+        std::size_t size;
+        std::size_t capacity;
+    };
+
+    //A call from C++ to Lua, or from Lua to a native function, read from a recording (see State::startRecording).
+    struct RecordedCall
+    {
+        //true for a call to a native function
+        bool native;
+        //true for a call that raised an error; results holds the error
+        bool failed;
+        //true for a call made with call(const Environment&, ...)
+        bool environment;
+        std::string function;
+        std::vector <Object> args;
+        std::vector <Object> results;
+        //when the call started, from the start of the recording
+        std::chrono::nanoseconds time;
+        std::chrono::nanoseconds duration;
+    };
+
+    //Reads a recording made by State::startRecording.  Calls are listed in the order they finished.
+    //Throws std::runtime_error if the file cannot be opened and parse_error if it is invalid.
+    std::vector <RecordedCall> readRecording(const std::string& filename);
+
+    //The results of State::replay.
+    struct ReplayStats
+    {
+        //the number of calls replayed
+        std::size_t calls;
+        //calls whose results differed from the recorded ones, or that failed or succeeded when the recorded call did not
+        std::size_t mismatches;
+        //calls that raised an error
+        std::size_t failures;
+        //native calls answered from the recording, and those that matched no recorded call (see State::replay)
+        std::size_t natives;
+        std::size_t unmatched;
+        //the total time the calls took when recorded and when replayed
+        std::chrono::nanoseconds recorded;
+        std::chrono::nanoseconds replayed;
+    };
+
+    //Counters for the cache of pure functions (see State::registerPureFunction).
+    struct PureCacheStats
+    {
+        std::size_t hits;
+        std::size_t misses;
+        //the number of argument lists currently cached
+        std::size_t size;
+        std::size_t capacity;
+    };
+
+    //A native function to install with State::registerLibrary.  A list of these can be built once and
+    //registered in any number of States.
+    struct LibraryFunction
+    {
+        std::string name;
+        void* function;
+        int (*registered)(lua_State*);
+
+        //Converts the arguments and results as registerFunction does.
+        template <typename R, typename... Args>
+        LibraryFunction(std::string name, R(*func)(Args... args))
+        : name(std::move(name)), function((void*)func), registered(internal::registeredCFunction<R, Args...>)
+        {}
+
+        //Caches the results as registerPureFunction does.
+        template <typename R, typename... Args>
+        static LibraryFunction pure(std::string name, R(*func)(Args... args))
+        {
+            LibraryFunction f(std::move(name), func);
+            f.registered = internal::registeredPureCFunction<R, Args...>;
+            return f;
+        }
+    };
+
     class State
     {
         void cleanup();
 
         void internal_registerFunction(const std::string& name, void* func, int(*registered)(lua_State*));
+        void spawnTask(int nargs);
 
         lua_State* state;
 
@@ -619,8 +1410,19 @@ namespace lua
 
 
         //Throws std::invalid_argument if mode is invalid.
+        //The file name and mode are remembered for ScriptReloader.
         void loadFile(const std::string& filename, const std::string& mode = "bt");
         void loadString(const std::string& script, const std::string& mode = "t");
+        //Makes loadString keep the bytecode of up to capacity compiled chunks, so loading the same script with the same
+        //mode again loads the bytecode instead of compiling it.  The least recently used chunk is evicted first.
+        //The cache is disabled by default; a capacity of 0 disables it and releases the cached chunks.
+        void setChunkCacheCapacity(std::size_t capacity);
+        //Returns the cache's hit and miss counts and size, or all zeroes if it is disabled.
+        ChunkCacheStats getChunkCacheStats() const;
+        //Compiles the files in parallel (see compileFiles) and pushes a single function that runs them in the
+        //order given, returning the results of the last one.  Throws compile_error listing every file that failed,
+        //in which case nothing is pushed.
+        void loadFiles(const std::vector <std::string>& filenames, unsigned threads = 0, const std::string& mode = "bt");
 
         //Creates a new global object for the script to use.
         void setVariable(const std::string& name, const Object& object);//, const std::vector<std::string>& path = internal::emptyVector);
@@ -630,7 +1432,46 @@ namespace lua
         //Any table entries (keys or values) contained in ignoreList are ignored, but only for the top-level table.
         //This is useful for getting a table of global values while removing recursive references (_G, base, and package)
         //Object getVariable(const std::string& name, const std::vector<std::string>& path = internal::emptyVector, const std::set<Object>& ignoreList = internal::emptySet) const;
-        Object getVariable(const std::string& name, const std::set<Object>& ignoreList = internal::emptySet) const;
+        Object getVariable(const std::string& name, const ObjectSet& ignoreList = internal::emptySet) const;
+        //Returns the variable with the specified name as an ObjectGraph, converting each table only once.
+        //Shared and cyclic tables are allowed, so _G can be obtained without an ignore list.
+        //ignoreList behaves as in getVariable.
+        ObjectGraph getVariableGraph(const std::string& name, const ObjectSet& ignoreList = internal::emptySet) const;
+
+        //Writes the variable with the specified name as JSON, walking the Lua value directly.
+        //Tables whose keys are exactly 1..n are written as arrays; all other tables are written as objects,
+        //with number keys converted to strings.  Empty tables are written as objects.
+        //Throws type_mismatch if the value cannot be represented (functions, userdata, NaN, table keys...)
+        //and table_too_deep if a table contains itself or tables are nested more than 1000 deep.
+        void writeJson(const std::string& name, std::ostream& out) const;
+        //Same, but appends the JSON to buffer.
+        void writeJson(const std::string& name, std::string& buffer) const;
+        //Same as writeJson, but writes the value at the specified stack index.
+        void writeStackJson(int index, std::ostream& out) const;
+        void writeStackJson(int index, std::string& buffer) const;
+
+        //Performs the assignments of a Lua data file (see parseData) directly, without compiling or running it.
+        //Throws parse_error if the text is not a data file, in which case nothing is assigned, or if it assigns to a field
+        //of a variable that is not a table, in which case the assignments before that remain.
+        void loadData(const char* data, std::size_t size);
+        void loadDataFile(const std::string& filename);
+
+        //Parses JSON and stores the result in the variable with the specified name (see setVariable).
+        //Throws parse_error if json is not valid JSON.
+        void readJson(const std::string& name, const std::string& json);
+        //Parses JSON and pushes the result onto the stack.  null is pushed as nil.
+        //Throws parse_error if the text is not valid JSON, leaving the stack unchanged.
+        void pushJson(const char* json, std::size_t size);
+
+        //Appends the variable with the specified name (or the value at a stack index) to out in the binary format.
+        //Throws type_mismatch for values that cannot be serialized and table_too_deep if a table contains itself or tables are nested more than 1000 deep.
+        void writeBinary(const std::string& name, std::string& out) const;
+        void writeStackBinary(int index, std::string& out) const;
+        //Reads a value in the binary format and assigns it to the variable with the specified name or pushes it onto the stack.
+        //Strings are copied into Lua directly from data.
+        //Throws parse_error if the data is invalid, leaving the stack unchanged.
+        void readBinary(const std::string& name, const char* data, std::size_t size);
+        void pushBinary(const char* data, std::size_t size);
 
         //Runs the script, returning all the script's return values in a vector.
         std::vector <Object> run();
@@ -646,10 +1487,50 @@ namespace lua
             if(!state)
                 throw uninitialized_resource("lua::State::registerFunction");
 
+            internal::TraceSpan span("call", function);
             internal::getGlobal(state, function.c_str());//lua_getglobal(state, function.c_str());
             internal::pushArgs(state, args...);
 
-            return internal::callLuaFunction(state, sizeof...(Args));
+            return internal::callLuaFunction(state, sizeof...(Args), function.c_str());
+        }
+
+        //Starts writing every call made with call() and every call of a registered native function, with its
+        //arguments, results and timing, to a file.  Values without a binary form (see writeBinary) are recorded as nil.
+        //Throws std::runtime_error if the file cannot be created.
+        void startRecording(const std::string& filename);
+        //Finishes the recording, if there is one.  Destroying the State also finishes it.
+        void stopRecording();
+        //Repeats the call() calls of a recording, with the recorded arguments, and compares their results and timing
+        //with the recorded ones.  Native calls are not repeated, since the script makes them itself.  Calls made in an
+        //Environment are skipped, since the environment is not part of the recording.
+        //If recordedNatives is true, registered native functions are not called while replaying; each call returns
+        //the results (or raises the error) of the first unused recorded call with the same name and arguments,
+        //or raises an error if there is none.
+        ReplayStats replay(const std::string& filename, bool recordedNatives = false);
+
+        //Pops the chunk on top of the stack (e.g. from loadFile or loadString) so it can be run in Environments.
+        //Throws type_mismatch if the value is not a chunk with an _ENV upvalue, in which case it is not popped.
+        Chunk takeChunk();
+        //Creates an environment with its own globals.  Globals it does not define are read from the State's
+        //globals through a read-only view, so library tables (and tables inside them) cannot be modified.
+        //Views are userdata, so rawset cannot bypass them.  Within the environment, _G refers to the environment
+        //itself.  From then on getmetatable('') returns a read-only view of the string metatable.
+        Environment newEnvironment();
+        //Runs the chunk with env as its globals and returns the chunk's return values.
+        //The chunk is compiled only once; functions it defines keep using env after it is run elsewhere.
+        std::vector <Object> run(const Chunk& chunk, const Environment& env);
+        //Calls a function defined in env, as call does for the State's globals.
+        template <typename... Args>
+        std::vector <Object> call(const Environment& env, const std::string& function, Args... args)
+        {
+            if(!state)
+                throw uninitialized_resource("lua::State::call");
+
+            internal::TraceSpan span("call", function);
+            internal::getEnvironmentField(state, env.reference, function.c_str());
+            internal::pushArgs(state, args...);
+
+            return internal::callLuaFunction(state, sizeof...(Args), function.c_str(), true);
         }
 
         //Registers a native function for the script to call.
@@ -666,13 +1547,352 @@ namespace lua
             internal_registerFunction(name, (void*)func, internal::registeredCFunction<R, Args...>);
         }
 
+        //Like registerFunction, but for functions whose results depend only on their arguments.  The results are
+        //kept in a cache shared by the State's pure functions, so calling one again with equal arguments returns
+        //the cached results without calling it.  Table arguments are equal if their contents are, including any
+        //tables used as keys.  The least recently used results are evicted first.
+        template <typename R, typename... Args>
+        void registerPureFunction(const std::string& name, R(*func)(Args... args))
+        {
+            internal_registerFunction(name, (void*)func, internal::registeredPureCFunction<R, Args...>);
+        }
+        //Sets the number of argument lists the pure function cache keeps (1024 by default); 0 disables it.
+        void setPureCacheCapacity(std::size_t capacity);
+        //Does not create the cache; a State that has not used it gets zero counts and the default capacity.
+        PureCacheStats getPureCacheStats() const;
+        //Forgets every cached result, or only those of the pure function with the specified name.
+        void clearPureCache();
+        void clearPureCache(const std::string& name);
+        //Installs all of functions in the table with the specified name (which may contain periods) in one pass.
+        //The table is created with room for every function, unless the variable already holds a table.
+        void registerLibrary(const std::string& name, const std::vector <LibraryFunction>& functions);
+
+
+        //Registers a native function that finishes later: either it returns a std::future, or it takes a Completion
+        //as its first parameter and completes it, possibly from another thread.  The parameters and results
+        //are converted as for registerFunction; a future may also be std::future<void>.
+        //Called from a task started with spawn, the task yields until the result is ready and pollAsync resumes it.
+        //Called from anywhere else, the function waits for the result, blocking the thread.
+        template <typename R, typename... Args>
+        void registerAsyncFunction(const std::string& name, std::future<R>(*func)(Args... args))
+        {
+            internal_registerFunction(name, (void*)func, internal::registeredFutureCFunction<R, Args...>);
+        }
+        template <typename R, typename... Args>
+        void registerAsyncFunction(const std::string& name, void(*func)(Completion<R>, Args... args))
+        {
+            internal_registerFunction(name, (void*)func, internal::registeredCompletionCFunction<R, Args...>);
+        }
+
+        //Starts a task that calls the global function in a new coroutine.  The task runs until it finishes or waits
+        //for an asynchronous function (or yields), and pollAsync continues it later.  Its results are discarded.
+        //Throws script_error if the task fails before it first waits.
+        template <typename... Args>
+        void spawn(const std::string& function, Args... args)
+        {
+            if(!state)
+                throw uninitialized_resource("lua::State::spawn");
+
+            internal::getGlobal(state, function.c_str());
+            internal::pushArgs(state, args...);
+            spawnTask(sizeof...(Args));
+        }
+        //Resumes every task whose asynchronous call has finished or that yielded, waiting up to timeout milliseconds
+        //for one if there is none yet (-1 waits until there is one).  Returns the number of tasks resumed.
+        //Throws script_error with one line per task that failed, after resuming the others.
+        std::size_t pollAsync(int timeout = 0);
+        //Advances the timer library (Lib::timer) to now, in milliseconds on any steady clock, and fires the timers
+        //that are due in the order they are due: sleeping tasks are resumed and after/every functions are started
+        //as tasks (see spawn).  The first call sets the time that timers created before it count from.
+        //Returns the number of timers fired.  Throws script_error with one line per task that failed, after firing the rest.
+        std::size_t tick(std::uint64_t now);
+        //Returns the number of tasks started with spawn that have not finished.
+        std::size_t getAsyncTaskCount() const;
+        //Returns a file descriptor that becomes readable when an asynchronous call finishes, for use in an event loop
+        //(e.g. with epoll), or -1 where eventfd is not available.  pollAsync resets it.
+        int getAsyncEventFd();
 
         //Loads the specified library, assigning a name equal to the library's variable name.
         void loadLib(Lib lib);
         //Loads the specified library with the specified name.  name is ignored if the library "all" is specified.
         void loadLib(Lib lib, const std::string& name);
+        //Like loadLib, but a library is only opened when the script first reads its global name, through an
+        //__index metamethod on _G; require also works for it if the package library is loaded.
+        //base and string are always loaded immediately.
+        void loadLibLazy(Lib lib);
+        //Loads the standard libraries loaded in prototype, lazily if prototype has not opened them yet.
+        //Libraries loaded with a different name are not copied.
+        void copyLibs(const State& prototype);
+
+        //Makes size elements of data, owned by the host, available to the script as a buffer with the specified name.
+        //Scripts read and write the memory directly, so it must outlive every use of the buffer in Lua.
+        void setBuffer(const std::string& name, void* data, std::size_t size, BufferType type);
+        template <typename T>
+        void setBuffer(const std::string& name, T* data, std::size_t size)
+        {
+            setBuffer(name, data, size, internal::BufferTypeOf<T>::value);
+        }
+        //Creates a buffer of size zeroed elements owned by Lua and assigns it to the variable with the specified name.
+        Buffer newBuffer(const std::string& name, BufferType type, std::size_t size);
+        //Throws type_mismatch if the variable is not a buffer.
+        Buffer getBuffer(const std::string& name) const;
+
+        //Makes a channel available to the script as a table with the specified name.
+        //The table holds the functions send(value), try_send(value), recv() and try_recv().
+        //try_send returns false if the channel is full; try_recv returns false if it is empty,
+        //or true and the value otherwise.  send and recv wait until they can complete:
+        //inside a coroutine, they yield and try again each time the coroutine is resumed.
+        void setChannel(const std::string& name, const std::shared_ptr<Channel>& channel);
+
+        //Starts recording changes to the table with the specified name (see setVariable), e.g. "_G" for the globals.
+        //The contents of the table are moved into a hidden table and every assignment goes through a metamethod,
+        //so later reads are slightly slower.  Reads, assignments, pairs, ipairs, and # keep working, but raw access
+        //(rawget, rawset, next, and the table library) does not see the contents.
+        //Watching a table twice has no effect.  Throws type_mismatch if the variable is not a table.
+        void watch(const std::string& name);
+        //Returns the keys of watched tables assigned since the last call, with their current values.
+        //A key assigned several times is reported once.
+        std::vector <Change> collectChanges();
+
+        //Makes require look for modules in archive before searching the file system.
+        //The searcher is inserted into package.searchers right after the one for package.preload.
+        //Throws uninitialized_resource if the package library is not loaded.
+        void setModuleArchive(const std::shared_ptr<const ModuleArchive>& archive);
+    };
+
+
+    //A bounded, lock-free queue for passing values between States on different threads.
+    //Any number of threads can send and receive at the same time.
+    //Values are stored in the binary format, so the same restrictions apply (no functions).
+    class Channel
+    {
+        struct Cell
+        {
+            std::atomic <std::size_t> sequence;
+            std::string data;
+        };
+
+        std::unique_ptr <Cell[]> cells;
+        std::size_t mask;
+
+        //the positions are kept on separate cache lines so senders and receivers do not contend
+        char padding0[64];
+        std::atomic <std::size_t> sendPosition;
+        char padding1[64];
+        std::atomic <std::size_t> receivePosition;
+        char padding2[64];
+
+    public:
+        //The capacity is rounded up to a power of two (at least 2).
+        explicit Channel(std::size_t capacity);
+
+        Channel(const Channel& rhs) = delete;
+        Channel& operator =(const Channel& rhs) = delete;
+
+        std::size_t getCapacity() const;
+
+        //Returns false instead of waiting if the channel is full.
+        //data must be in the binary format and is only moved from if it was sent.
+        bool trySendBinary(std::string& data);
+        bool trySend(const Object& obj);
+        //Returns false instead of waiting if the channel is empty.
+        bool tryReceiveBinary(std::string& data);
+        bool tryReceive(Object& obj);
+
+        //These wait until the value can be sent or received, spinning briefly and then sleeping.
+        void sendBinary(std::string data);
+        void send(const Object& obj);
+        std::string receiveBinary();
+        Object receive();
+    };
+
+
+    //A read-only, indexed file of precompiled Lua modules, written by writeModuleArchive or the SimpluaPack tool.
+    //The file is mapped into memory, so looking up and loading a module makes no system calls.
+    //The index is sorted by the 64-bit FNV-1a hash of each module name and searched with a binary search.
+    class ModuleArchive
+    {
+        const char* data;
+        std::size_t size;
+        std::size_t count;
+        //holds the file if it could not be mapped
+        std::string contents;
+        bool mapped;
+
+    public:
+        //Throws std::runtime_error if the file cannot be opened and parse_error if it is not a valid archive.
+        explicit ModuleArchive(const std::string& filename);
+        ~ModuleArchive();
+
+        ModuleArchive(const ModuleArchive& rhs) = delete;
+        ModuleArchive& operator =(const ModuleArchive& rhs) = delete;
+
+        //Returns the precompiled chunk of the named module, or a slice with a null data pointer if there is none.
+        StringSlice find(const char* name, std::size_t nameSize) const;
+        std::size_t getModuleCount() const;
+    };
+
+    //Compiles each module and writes them to an archive file for ModuleArchive.
+    //modules holds pairs of a module name (as passed to require) and the name of its source file.
+    //Throws compile_error if a file cannot be read or compiled, std::invalid_argument if a module name
+    //appears twice, and std::runtime_error if the archive cannot be written.
+    void writeModuleArchive(const std::string& filename, const std::vector <std::pair<std::string, std::string>>& modules);
+
+
+    //Reloads scripts into a running State when their files change, without recreating the State.
+    //Every file passed to loadFile or loadFiles before the reloader was created is watched, with inotify on Linux
+    //and by checking modification times elsewhere.  A changed file is recompiled on a background thread, and
+    //applyReloads runs the new version in the State.  The State must outlive the reloader.
+    class ScriptReloader
+    {
+        struct Watcher;
+
+        State& state;
+        void (*before)(State&, const std::string&);
+        void (*after)(State&, const std::string&);
+        std::unique_ptr <Watcher> watcher;
+
+    public:
+        //before and after, if given, are called with the file name around each reload, e.g. to save
+        //globals that running the script again would overwrite and restore them afterwards.
+        explicit ScriptReloader(State& state, void (*before)(State&, const std::string&) = nullptr,
+                                void (*after)(State&, const std::string&) = nullptr);
+        ~ScriptReloader();
+
+        ScriptReloader(const ScriptReloader& rhs) = delete;
+        ScriptReloader& operator =(const ScriptReloader& rhs) = delete;
+
+        //Runs every file that has changed and been recompiled since the last call, in the order the changes were seen.
+        //Call this at a point where it is safe for the scripts to change, e.g. between frames.
+        //Returns the number of files that were run.  Failures do not stop the other files from being reloaded;
+        //afterwards, throws compile_error if files could not be compiled or script_error if any failed to run,
+        //with one line per file.
+        std::size_t applyReloads();
     };
 
 
+    //Calls the global Lua function named function once for every element of inputs, spread over
+    //threads worker States (0 means one per hardware thread).  Each worker loads all the standard libraries lazily,
+    //calls setup (if given, e.g. to register native functions), loads the file script and runs it.
+    //Returns the first return value of each call, in the same order as inputs.
+    //Workers take the elements in chunks and idle workers steal half of the remaining work of the busiest one.
+    //Rethrows the first exception thrown by any worker after all workers have stopped.
+    std::vector <Object> parallelMap(const std::string& script, const std::string& function, const std::vector <Object>& inputs,
+                                     unsigned threads = 0, void (*setup)(State&) = nullptr);
+    //Like parallelMap, but calls function once per chunk with an array of elements.
+    //The function must return an array with the result for each element at the same index.
+    std::vector <Object> parallelMapChunks(const std::string& script, const std::string& function, const std::vector <Object>& inputs,
+                                           unsigned threads = 0, void (*setup)(State&) = nullptr);
+
+    //Compiles each file on a scratch State and returns its bytecode (as written by lua_dump), in the same order.
+    //The files are read and compiled by threads worker threads (0 means one per hardware thread).
+    //Throws std::invalid_argument if mode is invalid and compile_error with one line per file that could not
+    //be read or compiled, after all files have been tried.
+    std::vector <std::string> compileFiles(const std::vector <std::string>& filenames, unsigned threads = 0, const std::string& mode = "bt");
+
+
+    //Owns a State on a dedicated thread and runs requests from any thread on it, in the order they arrive.
+    //Requests are queued in a lock-free mailbox, and the thread runs every queued request each time it wakes up,
+    //so senders never wait for the State or for each other.  Results are returned through futures, which
+    //rethrow any exception the request threw.
+    class Actor
+    {
+        struct Mailbox;
+
+        std::unique_ptr <Mailbox> mailbox;
+
+        void post(std::function<void(State&)> task);
+
+    public:
+        //setup (if given) is called on the actor's thread before any request, e.g. to load libraries and run a script.
+        //Rethrows any exception setup throws.
+        explicit Actor(void (*setup)(State&) = nullptr);
+        //Runs the requests already sent, then stops the thread.
+        ~Actor();
+
+        Actor(const Actor& rhs) = delete;
+        Actor& operator =(const Actor& rhs) = delete;
+
+        //These do the same as the State functions of the same name.  The arguments are copied.
+        template <typename... Args>
+        std::future <std::vector<Object>> call(const std::string& function, Args... args)
+        {
+            auto promise = std::make_shared<std::promise<std::vector<Object>>>();
+            std::future <std::vector<Object>> result = promise->get_future();
+            post([=](State& state)
+            {
+                try
+                {
+                    promise->set_value(state.call(function, args...));
+                }
+                catch(...)
+                {
+                    promise->set_exception(std::current_exception());
+                }
+            });
+            return result;
+        }
+        std::future <void> setVariable(const std::string& name, const Object& object);
+        std::future <Object> getVariable(const std::string& name);
+    };
+
+
+    //Counters reported by Scheduler::getStats.
+    struct SchedulerStats
+    {
+        //the number of tasks waiting to run on each worker, new or resumed
+        std::vector <std::size_t> queueDepths;
+        std::size_t parked;
+        //the number of times an idle worker took new tasks from another worker
+        std::size_t steals;
+        std::size_t completed;
+        std::size_t failed;
+    };
+
+    //Runs many Lua tasks as coroutines on a pool of worker threads, each with its own State.
+    //A task calls a global function and runs until it returns, yields (and is queued again) or parks.
+    //A parked task uses no thread until wake is called with its id.  New tasks are queued round-robin,
+    //and an idle worker steals half of the new tasks of the worker with the most.  A task that has started
+    //stays on its worker, since a coroutine cannot move to another State.
+    class Scheduler
+    {
+        struct Pool;
+
+        std::unique_ptr <Pool> pool;
+
+    public:
+        typedef std::uint64_t TaskId;
+
+        //Each worker State loads all the standard libraries lazily and gets a global table named scheduler
+        //holding park(), yield(), spawn(function, argument) and id().  setup (if given) is then called on
+        //the worker's thread, e.g. to run the script that defines the task functions.
+        //threads = 0 uses one worker per hardware thread.  Rethrows the first exception setup throws.
+        explicit Scheduler(unsigned threads = 0, void (*setup)(State&) = nullptr);
+        //Stops the workers after the tasks they are running yield or return.  Unfinished tasks are dropped.
+        ~Scheduler();
+
+        Scheduler(const Scheduler& rhs) = delete;
+        Scheduler& operator =(const Scheduler& rhs) = delete;
+
+        //Queues a task that calls the global function with argument.  Returns the task's id, which is never 0.
+        TaskId spawn(const std::string& function, const Object& argument = Object());
+        //Resumes a parked task; park returns value.  If the task is not parked yet, its next park returns value
+        //without waiting.  Returns false if there is no such task (e.g. it has finished).
+        bool wake(TaskId task, const Object& value = Object());
+        //Waits until every task has finished or is parked.
+        void waitIdle();
+
+        SchedulerStats getStats() const;
+        //Returns the errors of the tasks that failed since the last call, each starting with the task's id.
+        std::vector <std::string> takeErrors();
+
+        //Parks the task that called the native function, e.g.
+        //    int waitForInput(lua_State* state) { subscribe(lua::Scheduler::currentTask(state)); return lua::Scheduler::park(state); }
+        //The native function must be a lua_CFunction (see Object::makeFunction) so that it can yield.
+        //Raises a Lua error if it is not called from a task.
+        static int park(lua_State* state);
+        //Returns the id of the task running on state, or 0 if there is none.
+        static TaskId currentTask(lua_State* state);
+    };
 
 }//namespace lua
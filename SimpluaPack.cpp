@@ -0,0 +1,56 @@
+//Packs Lua modules into an archive for lua::ModuleArchive.
+//Usage: SimpluaPack archive [name=]file.lua...
+//Without a name, the module name is the file name without ".lua", with directory separators replaced by periods.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+
+#include "Simplua.h"
+
+static std::string moduleName(std::string filename)
+{
+    if(filename.compare(0, 2, "./") == 0)
+        filename.erase(0, 2);
+    if(filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".lua") == 0)
+        filename.erase(filename.size() - 4);
+    for(auto& c : filename)
+        if(c == '/' || c == '\\')
+            c = '.';
+    return filename;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " archive [name=]file.lua..." << std::endl;
+        return 1;
+    }
+
+    std::vector <std::pair<std::string, std::string>> modules;
+    for(int i = 2; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::size_t equals = arg.find('=');
+        if(equals != std::string::npos)
+            modules.push_back(std::make_pair(arg.substr(0, equals), arg.substr(equals + 1)));
+        else
+            modules.push_back(std::make_pair(moduleName(arg), arg));
+    }
+
+    try
+    {
+        lua::writeModuleArchive(argv[1], modules);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Packed " << modules.size() << " modules into " << argv[1] << std::endl;
+    return 0;
+}
@@ -20,10 +20,21 @@ void testLua()
     state.registerFunction("myLib.testFunc", testFunc);
     state.run();
 
-    //Don't traverse the nested _G, base, and package tables, as these are recursive
-    std::set <lua::Object> ignore{lua::Object::makeString("_G"), lua::Object::makeString("base"), lua::Object::makeString("package")};
-    //Print all global variables in Lua (except the above)
-    std::cout << state.getVariable("_G", ignore) << std::endl;
+    //Print all global variables in Lua.  _G, base, and package are recursive, but getVariableGraph
+    //converts each table only once, so no ignore list is needed.
+    lua::ObjectGraph globals = state.getVariableGraph("_G");
+    std::cout << globals.getRoot() << std::endl;
+}
+
+//String methods must work even when the string library is loaded lazily, since they do not read the global.
+void testLazyLibs()
+{
+    lua::State state;
+    state.loadLibLazy(lua::Lib::all);
+    state.loadString("return ('abc'):upper()");
+    std::vector <lua::Object> results = state.run();
+    assert(results.size() == 1 && results[0].getString() == "ABC");
+    std::cout << "String methods work with lazily loaded libraries: " << results[0].getString() << std::endl;
 }
 
 
@@ -32,6 +43,7 @@ int main(int, char**)
     try
     {
         testLua();
+        testLazyLibs();
         return 0;
     }
     catch(const lua::type_mismatch& e)